@@ -0,0 +1,488 @@
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bstream.h"
+#include "checksum.h"
+#include "chunker.h"
+#include "huffman.h"
+#include "thread_pool.h"
+
+// One file packed into an archive
+struct ArchiveEntry {
+  std::string name;
+  // Where its zap stream starts in the archive and how long it is. In a
+  // deduplicated archive the offset is 0 and the size counts the chunks
+  // first stored for this file
+  uint64_t offset;
+  uint64_t compressed_size;
+  uint64_t original_size;
+  // CRC-32 of the original file
+  uint32_t crc;
+  // In a deduplicated archive, the chunks the file is made of in order
+  std::vector<uint32_t> chunks;
+};
+
+// A piece of file content stored once in a deduplicated archive, as its own
+// zap stream
+struct ArchiveChunk {
+  uint64_t offset;
+  uint64_t compressed_size;
+  uint64_t original_size;
+};
+
+// An archive holds many files, each as its own zap stream, followed by a
+// central directory of ArchiveEntry and a fixed size trailer pointing at the
+// directory:
+//
+//   "ZAPA" version | member streams... | directory | dir offset "ZAPD"
+//
+// so listing or extracting one member never reads the others.
+//
+// A deduplicated archive, version kDedupVersion, holds chunks from Chunker
+// instead, each stored the first time it shows up in any file. The
+// directory starts with a table of ArchiveChunk and every entry lists its
+// chunks. Chunks are told apart by their SHA-256
+class Archive {
+ public:
+  // Compresses the files on a thread pool and writes them in order, or their
+  // distinct chunks with dedup set. The archive only appears once complete.
+  // Options asking for a sync index or histograms are rejected
+  static void Create(const std::string &archive_name,
+                     const std::vector<std::string> &file_names,
+                     const CompressOptions &options = CompressOptions(),
+                     bool dedup = false);
+  static std::vector<ArchiveEntry> List(const std::string &archive_name);
+  static void Extract(const std::string &archive_name,
+                      const std::string &member_name,
+                      const std::string &output_name);
+  // Whether the open file starts like an archive
+  static bool IsArchive(int fd);
+
+ private:
+  static const char kMagic[4];
+  static const char kTrailerMagic[4];
+  static const char kVersion = 1;
+  static const char kDedupVersion = 2;
+  // Directory offset and magic
+  static const size_t kTrailerSize = 12;
+
+  // Helpers
+  static void ReadFully(int fd, char *data, size_t size, off_t offset);
+  static void WriteFully(int fd, const char *data, size_t size);
+  // Write the members or chunks after the header, and fill in entries
+  static void WriteMembers(int fd, const std::vector<std::string> &file_names,
+                           const CompressOptions &options, uint64_t &offset,
+                           std::vector<ArchiveEntry> &entries);
+  static void WriteChunks(int fd, const std::vector<std::string> &file_names,
+                          const CompressOptions &options, uint64_t &offset,
+                          std::vector<ArchiveEntry> &entries,
+                          std::vector<ArchiveChunk> &chunks);
+  // Returns whether the archive is deduplicated
+  static bool ReadDirectory(int fd, std::vector<ArchiveEntry> &entries,
+                            std::vector<ArchiveChunk> &chunks);
+};
+
+const char Archive::kMagic[4] = {'Z', 'A', 'P', 'A'};
+const char Archive::kTrailerMagic[4] = {'Z', 'A', 'P', 'D'};
+const size_t Archive::kTrailerSize;
+
+void Archive::ReadFully(int fd, char *data, size_t size, off_t offset) {
+  while (size) {
+    ssize_t num_read = pread(fd, data, size, offset);
+    if (num_read < 0 && errno == EINTR)
+      continue;
+    if (num_read <= 0)
+      throw std::runtime_error("Cannot read archive");
+    data += num_read;
+    size -= num_read;
+    offset += num_read;
+  }
+}
+
+void Archive::WriteFully(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      throw std::runtime_error("Cannot write archive");
+    data += written;
+    size -= written;
+  }
+}
+
+bool Archive::IsArchive(int fd) {
+  char magic[sizeof(kMagic)];
+  return pread(fd, magic, sizeof(magic), 0) ==
+             static_cast<ssize_t>(sizeof(magic)) &&
+         std::memcmp(magic, kMagic, sizeof(magic)) == 0;
+}
+
+void Archive::Create(const std::string &archive_name,
+                     const std::vector<std::string> &file_names,
+                     const CompressOptions &options, bool dedup) {
+  // Members are found through the directory, indexes inside them would
+  // point at the wrong offsets
+  if (options.sync_interval || options.histograms)
+    throw std::invalid_argument(
+        "Archives cannot have sync indexes or histograms");
+
+  // Written under another name first, so a failure leaves no partial
+  // archive behind
+  std::string temp_name = archive_name + ".tmp";
+  int fd = open(temp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open archive " + archive_name);
+
+  std::string header(kMagic, sizeof(kMagic));
+  header += dedup ? kDedupVersion : kVersion;
+  std::vector<ArchiveEntry> entries(file_names.size());
+  std::vector<ArchiveChunk> chunks;
+  uint64_t offset = header.size();
+  try {
+    WriteFully(fd, header.data(), header.size());
+    if (dedup)
+      WriteChunks(fd, file_names, options, offset, entries, chunks);
+    else
+      WriteMembers(fd, file_names, options, offset, entries);
+
+    // Central directory and the trailer pointing at it
+    std::string directory;
+    BasicBinaryOutputStream<StringSink> bos(directory);
+    if (dedup) {
+      bos.PutInt(chunks.size());
+      for (size_t i = 0; i < chunks.size(); i++) {
+        bos.PutInt64(chunks[i].offset);
+        bos.PutInt64(chunks[i].compressed_size);
+        bos.PutInt64(chunks[i].original_size);
+      }
+    }
+    bos.PutInt(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+      bos.PutInt(entries[i].name.size());
+      for (size_t j = 0; j < entries[i].name.size(); j++)
+        bos.PutChar(entries[i].name[j]);
+      bos.PutInt64(entries[i].offset);
+      bos.PutInt64(entries[i].compressed_size);
+      bos.PutInt64(entries[i].original_size);
+      bos.PutInt(entries[i].crc);
+      if (dedup) {
+        bos.PutInt(entries[i].chunks.size());
+        for (size_t j = 0; j < entries[i].chunks.size(); j++)
+          bos.PutInt(entries[i].chunks[j]);
+      }
+    }
+    bos.PutInt64(offset);
+    for (size_t i = 0; i < sizeof(kTrailerMagic); i++)
+      bos.PutChar(kTrailerMagic[i]);
+    bos.Close();
+    WriteFully(fd, directory.data(), directory.size());
+  } catch (...) {
+    close(fd);
+    unlink(temp_name.c_str());
+    throw;
+  }
+
+  if (close(fd) < 0 || rename(temp_name.c_str(), archive_name.c_str()) < 0) {
+    unlink(temp_name.c_str());
+    throw std::runtime_error("Cannot write archive " + archive_name);
+  }
+}
+
+void Archive::WriteMembers(int fd, const std::vector<std::string> &file_names,
+                           const CompressOptions &options, uint64_t &offset,
+                           std::vector<ArchiveEntry> &entries) {
+  // Members are coded in parallel, but only a couple per thread are kept in
+  // flight so memory stays bounded
+  ThreadPool pool;
+  std::vector<std::string> compressed(file_names.size());
+  std::deque<std::pair<size_t, std::future<void>>> in_flight;
+  size_t next = 0;
+  try {
+    while (next < file_names.size() || !in_flight.empty()) {
+      while (next < file_names.size() && in_flight.size() < 2 * pool.Size()) {
+        size_t i = next++;
+        in_flight.push_back(std::make_pair(i, pool.Submit([&, i]() {
+          MappedFile file(file_names[i]);
+          std::string contents(file.data(), file.size());
+          entries[i].name = file_names[i];
+          entries[i].original_size = contents.size();
+          entries[i].crc = Checksum::Crc32(contents.data(), contents.size());
+          Huffman::Compress(contents, compressed[i], options);
+        })));
+      }
+
+      // Write the oldest member as soon as it is done
+      size_t i = in_flight.front().first;
+      in_flight.front().second.get();
+      in_flight.pop_front();
+      entries[i].offset = offset;
+      entries[i].compressed_size = compressed[i].size();
+      WriteFully(fd, compressed[i].data(), compressed[i].size());
+      offset += compressed[i].size();
+      std::string().swap(compressed[i]);
+    }
+  } catch (...) {
+    // Let the tasks still running finish before their captures go away. The
+    // one that failed has already been waited for
+    for (size_t i = 0; i < in_flight.size(); i++) {
+      if (in_flight[i].second.valid())
+        in_flight[i].second.wait();
+    }
+    throw;
+  }
+}
+
+// Files go one at a time, since a chunk can only be told new once all the
+// chunks before it are known. Hashing and coding are spread over the pool
+void Archive::WriteChunks(int fd, const std::vector<std::string> &file_names,
+                          const CompressOptions &options, uint64_t &offset,
+                          std::vector<ArchiveEntry> &entries,
+                          std::vector<ArchiveChunk> &chunks) {
+  // A chunk being coded, kept in a deque so that it stays put
+  struct PendingChunk {
+    uint32_t index;
+    std::string compressed;
+    std::future<void> done;
+  };
+
+  ThreadPool pool;
+  std::unordered_map<std::string, uint32_t> chunk_index;
+  std::deque<PendingChunk> in_flight;
+  std::vector<std::future<void>> hashing;
+  // Outlives the tasks reading it, even on errors
+  std::unique_ptr<MappedFile> file;
+  auto write_oldest = [&](ArchiveEntry &entry) {
+    PendingChunk &pending = in_flight.front();
+    pending.done.get();
+    ArchiveChunk &chunk = chunks[pending.index];
+    chunk.offset = offset;
+    chunk.compressed_size = pending.compressed.size();
+    WriteFully(fd, pending.compressed.data(), pending.compressed.size());
+    offset += pending.compressed.size();
+    entry.compressed_size += pending.compressed.size();
+    in_flight.pop_front();
+  };
+
+  try {
+    for (size_t i = 0; i < file_names.size(); i++) {
+      file.reset(new MappedFile(file_names[i]));
+      const char *data = file->data();
+      size_t size = file->size();
+      ArchiveEntry &entry = entries[i];
+      entry.name = file_names[i];
+      entry.offset = 0;
+      entry.compressed_size = 0;
+      entry.original_size = size;
+      std::vector<size_t> chunk_sizes, chunk_offsets;
+      Chunker::Split(data, size, chunk_sizes);
+      for (size_t j = 0, chunk_offset = 0; j < chunk_sizes.size(); j++) {
+        chunk_offsets.push_back(chunk_offset);
+        chunk_offset += chunk_sizes[j];
+      }
+
+      // The CRC and the hashes of stripes of chunks all at once
+      std::vector<std::string> hashes(chunk_sizes.size());
+      hashing.clear();
+      hashing.push_back(pool.Submit([&]() {
+        entry.crc = Checksum::Crc32(data, size);
+      }));
+      for (size_t stripe = 0; stripe < pool.Size(); stripe++) {
+        hashing.push_back(pool.Submit([&, stripe]() {
+          for (size_t j = stripe; j < chunk_sizes.size(); j += pool.Size())
+            hashes[j] =
+                Checksum::Sha256(data + chunk_offsets[j], chunk_sizes[j]);
+        }));
+      }
+      for (size_t j = 0; j < hashing.size(); j++)
+        hashing[j].wait();
+      for (size_t j = 0; j < hashing.size(); j++)
+        hashing[j].get();
+
+      for (size_t j = 0; j < chunk_sizes.size(); j++) {
+        auto found = chunk_index.find(hashes[j]);
+        if (found != chunk_index.end()) {
+          entry.chunks.push_back(found->second);
+          continue;
+        }
+        uint32_t index = chunks.size();
+        ArchiveChunk chunk = {0, 0, chunk_sizes[j]};
+        chunks.push_back(chunk);
+        chunk_index[hashes[j]] = index;
+        entry.chunks.push_back(index);
+
+        in_flight.push_back(PendingChunk());
+        PendingChunk &pending = in_flight.back();
+        pending.index = index;
+        const char *chunk_data = data + chunk_offsets[j];
+        size_t chunk_size = chunk_sizes[j];
+        pending.done = pool.Submit([&options, &pending, chunk_data,
+                                    chunk_size]() {
+          Huffman::Compress(std::string(chunk_data, chunk_size),
+                            pending.compressed, options);
+        });
+        if (in_flight.size() >= 2 * pool.Size())
+          write_oldest(entry);
+      }
+      // Before the file is unmapped
+      while (!in_flight.empty())
+        write_oldest(entry);
+    }
+  } catch (...) {
+    for (size_t i = 0; i < in_flight.size(); i++) {
+      if (in_flight[i].done.valid())
+        in_flight[i].done.wait();
+    }
+    throw;
+  }
+}
+
+bool Archive::ReadDirectory(int fd, std::vector<ArchiveEntry> &entries,
+                            std::vector<ArchiveChunk> &chunks) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !IsArchive(fd) ||
+      static_cast<size_t>(st.st_size) < sizeof(kMagic) + 1 + kTrailerSize)
+    throw std::runtime_error("Not a zap archive");
+  char version;
+  ReadFully(fd, &version, 1, sizeof(kMagic));
+  if (version != kVersion && version != kDedupVersion)
+    throw std::runtime_error("Unknown zap archive version");
+
+  // The trailer says where the directory starts
+  std::string trailer(kTrailerSize, '\0');
+  ReadFully(fd, &trailer[0], kTrailerSize, st.st_size - kTrailerSize);
+  if (trailer.compare(8, 4, kTrailerMagic, sizeof(kTrailerMagic)) != 0)
+    throw std::runtime_error("Zap archive has no directory");
+  BasicBinaryInputStream<MemorySource> trailer_bis(trailer);
+  uint64_t directory_offset = trailer_bis.GetInt64();
+  if (directory_offset > static_cast<uint64_t>(st.st_size) - kTrailerSize)
+    throw std::runtime_error("Zap archive directory is out of bounds");
+
+  std::string directory(st.st_size - kTrailerSize - directory_offset, '\0');
+  ReadFully(fd, &directory[0], directory.size(), directory_offset);
+  BasicBinaryInputStream<MemorySource> bis(directory);
+  chunks.clear();
+  if (version == kDedupVersion) {
+    uint32_t num_chunks = bis.GetInt();
+    if (num_chunks > directory.size())
+      throw std::runtime_error("Zap archive directory is corrupt");
+    chunks.resize(num_chunks);
+    for (size_t i = 0; i < chunks.size(); i++) {
+      chunks[i].offset = bis.GetInt64();
+      chunks[i].compressed_size = bis.GetInt64();
+      chunks[i].original_size = bis.GetInt64();
+      if (chunks[i].offset > directory_offset ||
+          chunks[i].compressed_size > directory_offset - chunks[i].offset)
+        throw std::runtime_error("Zap archive chunk is out of bounds");
+    }
+  }
+  entries.resize(static_cast<uint32_t>(bis.GetInt()));
+  for (size_t i = 0; i < entries.size(); i++) {
+    entries[i].name.resize(static_cast<uint32_t>(bis.GetInt()));
+    for (size_t j = 0; j < entries[i].name.size(); j++)
+      entries[i].name[j] = bis.GetChar();
+    entries[i].offset = bis.GetInt64();
+    entries[i].compressed_size = bis.GetInt64();
+    entries[i].original_size = bis.GetInt64();
+    entries[i].crc = bis.GetInt();
+    entries[i].chunks.clear();
+    if (version == kDedupVersion) {
+      uint32_t num_chunks = bis.GetInt();
+      if (num_chunks > directory.size())
+        throw std::runtime_error("Zap archive directory is corrupt");
+      entries[i].chunks.resize(num_chunks);
+      for (size_t j = 0; j < entries[i].chunks.size(); j++) {
+        entries[i].chunks[j] = bis.GetInt();
+        if (entries[i].chunks[j] >= chunks.size())
+          throw std::runtime_error("Zap archive directory is corrupt");
+      }
+    }
+  }
+  return version == kDedupVersion;
+}
+
+std::vector<ArchiveEntry> Archive::List(const std::string &archive_name) {
+  int fd = open(archive_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open archive " + archive_name);
+
+  std::vector<ArchiveEntry> entries;
+  std::vector<ArchiveChunk> chunks;
+  try {
+    ReadDirectory(fd, entries, chunks);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return entries;
+}
+
+void Archive::Extract(const std::string &archive_name,
+                      const std::string &member_name,
+                      const std::string &output_name) {
+  int fd = open(archive_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open archive " + archive_name);
+
+  // Only the directory and the member's own stream or chunks are read
+  std::vector<ArchiveEntry> entries;
+  std::vector<ArchiveChunk> chunks;
+  std::string compressed, output;
+  try {
+    bool dedup = ReadDirectory(fd, entries, chunks);
+    size_t i = 0;
+    while (i < entries.size() && entries[i].name != member_name)
+      i++;
+    if (i == entries.size())
+      throw std::runtime_error("No member " + member_name + " in archive");
+
+    // A plain member is a single stream, as if it were one chunk
+    std::vector<ArchiveChunk> pieces;
+    if (!dedup) {
+      ArchiveChunk whole = {entries[i].offset, entries[i].compressed_size,
+                            entries[i].original_size};
+      pieces.push_back(whole);
+    }
+    for (size_t j = 0; j < entries[i].chunks.size(); j++)
+      pieces.push_back(chunks[entries[i].chunks[j]]);
+    StringSink sink(output);
+    for (size_t j = 0; j < pieces.size(); j++) {
+      compressed.resize(pieces[j].compressed_size);
+      ReadFully(fd, &compressed[0], compressed.size(), pieces[j].offset);
+      BasicBinaryInputStream<MemorySource> bis(compressed);
+      Huffman::Decompress(bis, sink);
+    }
+    if (output.size() != entries[i].original_size ||
+        Checksum::Crc32(output.data(), output.size()) != entries[i].crc)
+      throw std::runtime_error("Checksum mismatch for " + member_name);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+
+  int out_fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0)
+    throw std::runtime_error("Cannot open output file " + output_name);
+  WriteFully(out_fd, output.data(), output.size());
+  close(out_fd);
+}
+
+#endif  // ARCHIVE_H_
@@ -0,0 +1,121 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "huffman.h"
+#include "pqueue.h"
+#include "radix_heap.h"
+
+// Times PQueue against RadixHeap on monotone workloads of 10^3 elements up
+// to 10^max_exponent:
+//
+//   merge   n random weights, merged two at a time as in BuildHuffmanTree
+//   events  n pending events, each popped and rescheduled a bit later, as
+//           in an event simulation
+//
+// and BuildHuffmanTree itself on byte histograms
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+template <typename Queue>
+uint64_t Merge(const std::vector<uint64_t> &weights) {
+  Queue queue;
+  for (size_t i = 0; i < weights.size(); i++)
+    queue.Push(weights[i]);
+  uint64_t total = 0;
+  while (queue.Size() > 1) {
+    uint64_t weight = queue.Top();
+    queue.Pop();
+    weight += queue.Top();
+    queue.Pop();
+    total += weight;
+    queue.Push(weight);
+  }
+  return total;
+}
+
+template <typename Queue>
+uint64_t Events(const std::vector<uint64_t> &delays) {
+  Queue queue;
+  for (size_t i = 0; i < delays.size(); i++)
+    queue.Push(delays[i]);
+  uint64_t total = 0;
+  for (size_t i = 0; i < delays.size(); i++) {
+    uint64_t time = queue.Top();
+    queue.Pop();
+    total += time;
+    queue.Push(time + delays[i]);
+  }
+  return total;
+}
+
+// Runs both queues on the same input and checks they agree
+template <uint64_t (*PQueueRun)(const std::vector<uint64_t> &),
+          uint64_t (*RadixRun)(const std::vector<uint64_t> &)>
+void Compare(const char *name, const std::vector<uint64_t> &input) {
+  auto start = std::chrono::steady_clock::now();
+  uint64_t pqueue_result = PQueueRun(input);
+  double pqueue_seconds = Seconds(start);
+  start = std::chrono::steady_clock::now();
+  uint64_t radix_result = RadixRun(input);
+  double radix_seconds = Seconds(start);
+
+  std::cout << std::setw(8) << name << std::setw(12) << input.size()
+            << std::setw(12) << pqueue_seconds * 1000 << std::setw(12)
+            << radix_seconds * 1000 << std::setw(10)
+            << pqueue_seconds / radix_seconds << "x"
+            << (pqueue_result == radix_result ? "" : "  MISMATCH") << '\n';
+}
+
+int main(int argc, char *argv[]) {
+  int max_exponent = argc > 1 ? std::atoi(argv[1]) : 7;
+  if (max_exponent < 3 || max_exponent > 9) {
+    std::cerr << "Usage: " << argv[0] << " [max exponent, 3 to 9]\n";
+    exit(1);
+  }
+
+  std::mt19937_64 random(5);
+  std::cout << std::fixed << std::setprecision(2) << std::setw(8)
+            << "workload" << std::setw(12) << "n" << std::setw(12)
+            << "pqueue ms" << std::setw(12) << "radix ms" << std::setw(11)
+            << "speedup" << '\n';
+  for (int exponent = 3; exponent <= max_exponent; exponent++) {
+    size_t n = 1;
+    for (int i = 0; i < exponent; i++)
+      n *= 10;
+    std::vector<uint64_t> input(n);
+    for (size_t i = 0; i < n; i++)
+      input[i] = 1 + random() % 1000;
+    Compare<Merge<PQueue<uint64_t>>, Merge<RadixHeap<uint64_t>>>("merge",
+                                                                 input);
+    Compare<Events<PQueue<uint64_t>>, Events<RadixHeap<uint64_t>>>("events",
+                                                                   input);
+  }
+
+  // Trees for 10000 byte histograms of 1 KiB blocks
+  std::vector<std::vector<int>> histograms(10000, std::vector<int>(256));
+  for (size_t i = 0; i < histograms.size(); i++) {
+    for (int j = 0; j < 1024; j++)
+      histograms[i][random() % 256]++;
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < histograms.size(); i++)
+    Huffman::BuildHuffmanTree(histograms[i]);
+  double pqueue_seconds = Seconds(start);
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < histograms.size(); i++)
+    Huffman::BuildHuffmanTree<Huffman::RadixQueue>(histograms[i]);
+  double radix_seconds = Seconds(start);
+  std::cout << std::setw(8) << "trees" << std::setw(12) << histograms.size()
+            << std::setw(12) << pqueue_seconds * 1000 << std::setw(12)
+            << radix_seconds * 1000 << std::setw(10)
+            << pqueue_seconds / radix_seconds << "x\n";
+}
@@ -1,47 +1,347 @@
 #ifndef BSTREAM_H_
 #define BSTREAM_H_
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <climits>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Byte sinks and sources the bit streams are templated on. A sink has
+// Write(data, size), Flush() and Reserve(size), a hint that size more bytes
+// are coming. A source has Read(data, size) returning how many bytes it read,
+// 0 once it is exhausted. All calls are non-virtual so
+// they inline into the bit stream hot paths
+
+// Appends to a string in memory
+class StringSink {
+ public:
+  explicit StringSink(std::string &str) : str_(str) {}
+  void Write(const char *data, size_t size) { str_.append(data, size); }
+  void Flush() {}
+  // Still grows geometrically, so reserving block after block stays linear
+  void Reserve(size_t size) {
+    size_t needed = str_.size() + size;
+    if (needed > str_.capacity())
+      str_.reserve(std::max(needed, 2 * str_.capacity()));
+  }
+
+ private:
+  std::string &str_;
+};
 
-class BinaryInputStream {
+// Collects writes in a large buffer before handing them to the subclass'
+// WriteOut(data, size)
+template <typename Derived, size_t kBufferSize = 1 << 16>
+class BufferedSink {
  public:
-  explicit BinaryInputStream(std::ifstream &ifs);
+  BufferedSink() : buffer_(kBufferSize) {}
+
+  void Write(const char *data, size_t size) {
+    if (size > kBufferSize - used_) {
+      Flush();
+      if (size >= kBufferSize) {
+        static_cast<Derived *>(this)->WriteOut(data, size);
+        return;
+      }
+    }
+    std::memcpy(buffer_.data() + used_, data, size);
+    used_ += size;
+  }
+
+  void Flush() {
+    if (used_)
+      static_cast<Derived *>(this)->WriteOut(buffer_.data(), used_);
+    used_ = 0;
+  }
+  void Reserve(size_t size) {}
+
+ private:
+  std::vector<char> buffer_;
+  size_t used_ = 0;
+};
+
+// Writes to an ostream in large chunks instead of byte by byte
+class OstreamSink : public BufferedSink<OstreamSink> {
+ public:
+  explicit OstreamSink(std::ostream &os) : os_(os) {}
+  // Flush() first to learn whether the data made it
+  ~OstreamSink() {
+    try {
+      Flush();
+    } catch (...) {
+    }
+  }
+  void WriteOut(const char *data, size_t size) { os_.write(data, size); }
+
+ private:
+  std::ostream &os_;
+};
+
+// Writes to a raw file descriptor, such as a file or a socket
+class FdSink : public BufferedSink<FdSink> {
+ public:
+  explicit FdSink(int fd) : fd_(fd) {}
+  // Flush() first to learn whether the data made it
+  ~FdSink() {
+    try {
+      Flush();
+    } catch (...) {
+    }
+  }
+  void WriteOut(const char *data, size_t size) {
+    while (size) {
+      ssize_t written = ::write(fd_, data, size);
+      if (written < 0)
+        throw std::runtime_error("Cannot write to file descriptor");
+      data += written;
+      size -= written;
+    }
+  }
+
+ private:
+  int fd_;
+};
+
+// Writes through stdio, which does its own buffering
+class FileSink {
+ public:
+  explicit FileSink(FILE *file) : file_(file) {}
+  void Write(const char *data, size_t size) {
+    if (std::fwrite(data, 1, size, file_) != size)
+      throw std::runtime_error("Cannot write to file");
+  }
+  void Flush() { std::fflush(file_); }
+  void Reserve(size_t size) {}
+
+ private:
+  FILE *file_;
+};
+
+// Reads from a region of memory, such as a string or a MappedFile
+class MemorySource {
+ public:
+  MemorySource(const char *data, size_t size) : data_(data), size_(size) {}
+  explicit MemorySource(const std::string &str)
+      : data_(str.data()), size_(str.size()) {}
+
+  size_t Read(char *data, size_t size) {
+    if (size > size_ - pos_)
+      size = size_ - pos_;
+    std::memcpy(data, data_ + pos_, size);
+    pos_ += size;
+    return size;
+  }
+
+ private:
+  const char *data_;
+  size_t size_;
+  size_t pos_ = 0;
+};
+
+// Fills a large buffer at a time from the subclass' ReadIn(data, size)
+template <typename Derived, size_t kBufferSize = 1 << 16>
+class BufferedSource {
+ public:
+  BufferedSource() : buffer_(kBufferSize) {}
+
+  size_t Read(char *data, size_t size) {
+    if (pos_ == end_) {
+      pos_ = 0;
+      end_ = static_cast<Derived *>(this)->ReadIn(buffer_.data(), kBufferSize);
+    }
+    if (size > end_ - pos_)
+      size = end_ - pos_;
+    std::memcpy(data, buffer_.data() + pos_, size);
+    pos_ += size;
+    return size;
+  }
+
+ private:
+  std::vector<char> buffer_;
+  size_t pos_ = 0, end_ = 0;
+};
+
+// Reads from an istream in large chunks instead of byte by byte
+class IstreamSource : public BufferedSource<IstreamSource> {
+ public:
+  explicit IstreamSource(std::istream &is) : is_(is) {}
+  size_t ReadIn(char *data, size_t size) {
+    is_.read(data, size);
+    return is_.gcount();
+  }
+
+ private:
+  std::istream &is_;
+};
+
+// Reads from a raw file descriptor, such as a file or a socket
+class FdSource : public BufferedSource<FdSource> {
+ public:
+  explicit FdSource(int fd) : fd_(fd) {}
+  size_t ReadIn(char *data, size_t size) {
+    ssize_t num_read;
+    do {
+      num_read = ::read(fd_, data, size);
+    } while (num_read < 0 && errno == EINTR);
+    if (num_read < 0)
+      throw std::runtime_error("Cannot read from file descriptor");
+    return num_read;
+  }
+
+ private:
+  int fd_;
+};
+
+// Reads through stdio, which does its own buffering
+class FileSource {
+ public:
+  explicit FileSource(FILE *file) : file_(file) {}
+  size_t Read(char *data, size_t size) {
+    return std::fread(data, 1, size, file_);
+  }
+
+ private:
+  FILE *file_;
+};
+
+// Read-only memory map of a whole file, to be read through a MemorySource
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &filename);
+  // Maps a file already open for reading, leaving fd open
+  explicit MappedFile(int fd);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() { return data_; }
+  size_t size() { return size_; }
+
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+
+  // Returns false if the file cannot be mapped
+  bool Map(int fd);
+};
+
+MappedFile::MappedFile(const std::string &filename) {
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open " + filename);
+  bool mapped = Map(fd);
+  ::close(fd);
+  if (!mapped)
+    throw std::runtime_error("Cannot map " + filename);
+}
+
+MappedFile::MappedFile(int fd) {
+  if (!Map(fd))
+    throw std::runtime_error("Cannot map file");
+}
+
+bool MappedFile::Map(int fd) {
+  struct stat st;
+  if (::fstat(fd, &st) < 0)
+    return false;
+  size_ = st.st_size;
+
+  // Empty files cannot be mapped, but there is nothing to read anyway
+  if (size_) {
+    void *map = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+      return false;
+    ::madvise(map, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char *>(map);
+  }
+  return true;
+}
+
+MappedFile::~MappedFile() {
+  if (data_)
+    ::munmap(const_cast<char *>(data_), size_);
+}
+
+// Bits are kept in an Accumulator and moved to or from the Source a whole
+// accumulator at a time. kMsbFirst fills each byte from its most significant
+// bit, otherwise from its least significant bit
+template <typename Source, bool kMsbFirst = true,
+          typename Accumulator = uint64_t>
+class BasicBinaryInputStream {
+ public:
+  template <typename... Args>
+  explicit BasicBinaryInputStream(Args &&... args)
+      : source(std::forward<Args>(args)...) {}
 
   bool GetBit();
   char GetChar();
   int GetInt();
+  uint64_t GetInt64();
+  // Reads the num_bits low bits of a value, most significant first
+  unsigned GetBits(int num_bits);
+  // Reads size bytes, straight from the source when on a byte boundary
+  void GetBytes(char *data, size_t size);
+  // Skips what is left of the current byte
+  void Align();
 
  private:
-  std::ifstream &ifs;
-  char buffer = 0;
-  size_t avail = 0;
+  static const int kAccumulatorBits = sizeof(Accumulator) * CHAR_BIT;
+
+  Source source;
+  Accumulator buffer = 0;
+  int avail = 0;
 
   // Helpers
   void RefillBuffer();
 };
 
-BinaryInputStream::BinaryInputStream(std::ifstream &ifs) : ifs(ifs) {}
-
-void BinaryInputStream::RefillBuffer() {
-  // Read the next byte from the input stream
-  ifs.get(buffer);
-  if (ifs.gcount() != 1)
+template <typename Source, bool kMsbFirst, typename Accumulator>
+void BasicBinaryInputStream<Source, kMsbFirst, Accumulator>::RefillBuffer() {
+  // Read as many of the next bytes as fit in the accumulator
+  unsigned char bytes[sizeof(Accumulator)];
+  size_t num_read = source.Read(reinterpret_cast<char *>(bytes), sizeof(bytes));
+  if (!num_read)
     throw std::underflow_error("No more characters to read");
-  avail = 8;
+
+  buffer = 0;
+  for (size_t i = 0; i < num_read; i++) {
+    if (kMsbFirst)
+      buffer = buffer << CHAR_BIT | bytes[i];
+    else
+      buffer |= static_cast<Accumulator>(bytes[i]) << (CHAR_BIT * i);
+  }
+  avail = num_read * CHAR_BIT;
 }
 
-bool BinaryInputStream::GetBit() {
+template <typename Source, bool kMsbFirst, typename Accumulator>
+bool BasicBinaryInputStream<Source, kMsbFirst, Accumulator>::GetBit() {
   bool bit;
 
   if (!avail)
     RefillBuffer();
 
   avail--;
-  // Check if bit is 0 or 1, doesn't shift buffer
-  bit = ((buffer >> avail) & 1) == 1;
+  if (kMsbFirst) {
+    // Check if bit is 0 or 1, doesn't shift buffer
+    bit = (buffer >> avail & 1) == 1;
+  } else {
+    bit = (buffer & 1) == 1;
+    buffer >>= 1;
+  }
 
 #if 0  // Switch to 1 for debug purposes
   if (bit)
@@ -53,100 +353,240 @@ bool BinaryInputStream::GetBit() {
   return bit;
 }
 
-char BinaryInputStream::GetChar() {
-  // To be completed
-  char read_char = 0x0;
+template <typename Source, bool kMsbFirst, typename Accumulator>
+unsigned BasicBinaryInputStream<Source, kMsbFirst, Accumulator>::GetBits(
+    int num_bits) {
+  unsigned read_bits = 0x0;
+
+  // Take whole chunks out of the accumulator, refilling in between
+  while (num_bits) {
+    if (!avail)
+      RefillBuffer();
+    int take = num_bits < avail ? num_bits : avail;
+    avail -= take;
+    unsigned chunk;
+    if (kMsbFirst) {
+      chunk = static_cast<unsigned>(buffer >> avail) & ((1ull << take) - 1);
+    } else {
+      // Least significant first means the chunk comes out bit reversed
+      chunk = 0;
+      for (int i = 0; i < take; i++) {
+        chunk = chunk << 1 | (buffer & 1);
+        buffer >>= 1;
+      }
+    }
+    read_bits = static_cast<unsigned>(
+        static_cast<unsigned long long>(read_bits) << take | chunk);
+    num_bits -= take;
+  }
 
-  for (int i = 0; i < CHAR_BIT; i++)
-    read_char = read_char << 1 | GetBit();
+  return read_bits;
+}
 
-  return read_char;
+template <typename Source, bool kMsbFirst, typename Accumulator>
+void BasicBinaryInputStream<Source, kMsbFirst, Accumulator>::GetBytes(
+    char *data, size_t size) {
+  // Empty the accumulator first. Off a byte boundary it never runs dry
+  // between chars, so everything goes through it
+  size_t i = 0;
+  for (; i < size && avail; i++)
+    data[i] = GetChar();
+
+  while (i < size) {
+    size_t num_read = source.Read(data + i, size - i);
+    if (!num_read)
+      throw std::underflow_error("No more characters to read");
+    i += num_read;
+  }
 }
 
-int BinaryInputStream::GetInt() {
-  // To be completed
-  int read_int = 0x0;
+template <typename Source, bool kMsbFirst, typename Accumulator>
+void BasicBinaryInputStream<Source, kMsbFirst, Accumulator>::Align() {
+  // Whole bytes are read in, so the bits left over past a byte boundary are
+  // the rest of the current byte
+  int skip = avail % CHAR_BIT;
+  if (!kMsbFirst)
+    buffer >>= skip;
+  avail -= skip;
+}
 
-  // Gets the int byte by byte
-  for (size_t i = 0; i < sizeof(int); i++)
-    // Need to mask the bits to the left of the char
-    read_int = read_int << CHAR_BIT | (GetChar() & 0xFF);
+template <typename Source, bool kMsbFirst, typename Accumulator>
+char BasicBinaryInputStream<Source, kMsbFirst, Accumulator>::GetChar() {
+  return static_cast<char>(GetBits(CHAR_BIT));
+}
 
-  return read_int;
+template <typename Source, bool kMsbFirst, typename Accumulator>
+int BasicBinaryInputStream<Source, kMsbFirst, Accumulator>::GetInt() {
+  // Gets the int most significant byte first
+  return static_cast<int>(GetBits(sizeof(int) * CHAR_BIT));
 }
 
-class BinaryOutputStream {
- public:
-  explicit BinaryOutputStream(std::ofstream &ofs);
-  ~BinaryOutputStream();
+template <typename Source, bool kMsbFirst, typename Accumulator>
+uint64_t BasicBinaryInputStream<Source, kMsbFirst, Accumulator>::GetInt64() {
+  // High half first, GetBits only takes up to 32 bits
+  uint64_t high = GetBits(32);
+  return high << 32 | GetBits(32);
+}
 
+template <typename Sink, bool kMsbFirst = true,
+          typename Accumulator = uint64_t>
+class BasicBinaryOutputStream {
+ public:
+  template <typename... Args>
+  explicit BasicBinaryOutputStream(Args &&... args)
+      : sink(std::forward<Args>(args)...) {}
+  // Closes as a last resort, dropping any error, since throwing while an
+  // exception unwinds the stack would end the program
+  ~BasicBinaryOutputStream();
+
+  // Writes out the bits left and flushes the sink, throwing if the sink
+  // cannot take them. Call it to know the stream was written
   void Close();
 
   void PutBit(bool bit);
   void PutChar(char byte);
   void PutInt(int word);
+  void PutInt64(uint64_t word);
+  // Writes the num_bits low bits of value, most significant first
+  void PutBits(unsigned value, int num_bits);
+  // Writes size bytes, straight to the sink when on a byte boundary
+  void PutBytes(const char *data, size_t size);
+  // Lets the sink make room for num_bits more bits up front
+  void Reserve(size_t num_bits) {
+    sink.Reserve((count + num_bits + CHAR_BIT - 1) / CHAR_BIT);
+  }
+  // Pads the current byte with 0s
+  void Align();
 
  private:
-  std::ofstream &ofs;
-  char buffer = 0;
-  size_t count = 0;
+  static const int kAccumulatorBits = sizeof(Accumulator) * CHAR_BIT;
+
+  Sink sink;
+  Accumulator buffer = 0;
+  int count = 0;
 
   // Helpers
   void FlushBuffer();
 };
 
-BinaryOutputStream::BinaryOutputStream(std::ofstream &ofs) : ofs(ofs) {}
-
-BinaryOutputStream::~BinaryOutputStream() { Close(); }
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::
+    ~BasicBinaryOutputStream() {
+  try {
+    Close();
+  } catch (...) {
+  }
+}
 
-void BinaryOutputStream::Close() { FlushBuffer(); }
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::Close() {
+  FlushBuffer();
+  sink.Flush();
+}
 
-void BinaryOutputStream::FlushBuffer() {
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::FlushBuffer() {
   // Nothing to flush
   if (!count)
     return;
 
-  // If buffer isn't complete, pad with 0s before writing
-  if (count > 0)
-    buffer <<= (8 - count);
-
-  // Write to output stream
-  ofs.put(buffer);
+  // Write whole bytes, padding the last one with 0s if it isn't complete
+  unsigned char bytes[sizeof(Accumulator)];
+  int num_bytes = (count + CHAR_BIT - 1) / CHAR_BIT;
+  for (int i = 0; i < num_bytes; i++) {
+    if (kMsbFirst) {
+      int shift = count - CHAR_BIT * (i + 1);
+      bytes[i] = shift >= 0 ? buffer >> shift : buffer << -shift;
+    } else {
+      bytes[i] = buffer >> (CHAR_BIT * i);
+    }
+  }
+  sink.Write(reinterpret_cast<char *>(bytes), num_bytes);
 
   // Reset buffer
   buffer = 0;
   count = 0;
 }
 
-void BinaryOutputStream::PutBit(bool bit) {
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::PutBit(bool bit) {
   // Make some space and add bit to buffer
-  buffer <<= 1;
-  if (bit)
-    buffer |= 1;
+  if (kMsbFirst)
+    buffer = buffer << 1 | bit;
+  else
+    buffer |= static_cast<Accumulator>(bit) << count;
 
   // If buffer is full, write it
-  if (++count == 8)
+  if (++count == kAccumulatorBits)
     FlushBuffer();
 }
 
-// The & 0x1 masks the byte shifted i to the right so that only the rightmost
-// bit is kept and all other bits are cleared
-void BinaryOutputStream::PutChar(char byte) {
-  // To be completed
-  for (int i = CHAR_BIT - 1; i >= 0; i--) {
-    bool bit = byte >> i & 0x1;
-    PutBit(bit);
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::PutBits(
+    unsigned value, int num_bits) {
+  // Put as much as fits in the accumulator, then flush and put the rest
+  while (num_bits) {
+    int take = kAccumulatorBits - count;
+    if (take > num_bits)
+      take = num_bits;
+    num_bits -= take;
+    Accumulator chunk = (value >> num_bits) & ((1ull << take) - 1);
+    if (kMsbFirst) {
+      // Shifting by the full width is undefined, which only an empty
+      // accumulator can need
+      buffer = take == kAccumulatorBits ? chunk : buffer << take | chunk;
+      count += take;
+    } else {
+      // Least significant first means the chunk goes in bit reversed
+      for (int i = take - 1; i >= 0; i--)
+        buffer |= (chunk >> i & 1) << count++;
+    }
+    if (count == kAccumulatorBits)
+      FlushBuffer();
   }
 }
 
-void BinaryOutputStream::PutInt(int word) {
-  // To be completed
-  // Puts the int byte by byte
-  for (int i = sizeof(int) - 1; i >= 0; i--) {
-    // Need to mask the bits to the left of the char
-    char byte = word >> (CHAR_BIT * i) & 0xFF;
-    PutChar(byte);
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::PutBytes(
+    const char *data, size_t size) {
+  if (count % CHAR_BIT) {
+    for (size_t i = 0; i < size; i++)
+      PutChar(data[i]);
+    return;
   }
+  // The accumulator only holds whole bytes, so it can go first
+  FlushBuffer();
+  sink.Write(data, size);
+}
+
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::Align() {
+  PutBits(0, (CHAR_BIT - count % CHAR_BIT) % CHAR_BIT);
 }
 
+// The & 0xFF masks the bits to the left of the char so that only the byte
+// itself is written
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::PutChar(
+    char byte) {
+  PutBits(byte & 0xFF, CHAR_BIT);
+}
+
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::PutInt(int word) {
+  // Puts the int most significant byte first
+  PutBits(static_cast<unsigned>(word), sizeof(int) * CHAR_BIT);
+}
+
+template <typename Sink, bool kMsbFirst, typename Accumulator>
+void BasicBinaryOutputStream<Sink, kMsbFirst, Accumulator>::PutInt64(
+    uint64_t word) {
+  PutBits(static_cast<unsigned>(word >> 32), 32);
+  PutBits(static_cast<unsigned>(word), 32);
+}
+
+// Streams over files opened with iostreams
+typedef BasicBinaryInputStream<IstreamSource> BinaryInputStream;
+typedef BasicBinaryOutputStream<OstreamSink> BinaryOutputStream;
+
 #endif  // BSTREAM_H_
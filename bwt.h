@@ -0,0 +1,337 @@
+#ifndef BWT_H_
+#define BWT_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Symbols produced by EncodeZeroRuns. Runs of zeros are written as a
+// bijective base 2 number of kRunA/kRunB digits and every other move-to-front
+// index i becomes i + 1
+enum ZeroRunSymbol {
+  kRunA = 0,
+  kRunB = 1,
+  kNumZeroRunSymbols = 257,
+};
+
+class BurrowsWheeler {
+ public:
+  // Transforms a block, primary_index is the row the original block ends up
+  // in and is needed to invert it
+  static void Transform(const char *block, size_t block_size,
+                        std::string &output, int &primary_index);
+  static void Inverse(const std::string &bwt, int primary_index,
+                      std::string &output);
+  // Transforms consecutive blocks of file_contents on all available cores
+  static void TransformBlocks(const std::string &file_contents,
+                              size_t block_size,
+                              std::vector<std::string> &outputs,
+                              std::vector<int> &primary_indices);
+
+  static void MoveToFront(std::string &data);
+  static void InverseMoveToFront(std::string &data);
+
+  static void EncodeZeroRuns(const std::string &mtf,
+                             std::vector<int> &symbols);
+  // Returns false, with mtf cut short, when the symbols make more than
+  // max_size bytes
+  static bool DecodeZeroRuns(const std::vector<int> &symbols,
+                             size_t max_size, std::string &mtf);
+
+ private:
+  // SA-IS suffix array construction (Nong, Zhang and Chan). s must end with
+  // a unique smallest symbol 0 and all symbols must be at most max_symbol
+  static void SuffixArray(const int *s, int *sa, int n, int max_symbol);
+  static void GetBuckets(const int *s, std::vector<int> &buckets, int n,
+                         bool end);
+  static void InduceL(const std::vector<bool> &stype, int *sa, const int *s,
+                      std::vector<int> &buckets, int n);
+  static void InduceS(const std::vector<bool> &stype, int *sa, const int *s,
+                      std::vector<int> &buckets, int n);
+  static bool IsLms(const std::vector<bool> &stype, int i) {
+    return i > 0 && stype[i] && !stype[i - 1];
+  }
+};
+
+void BurrowsWheeler::GetBuckets(const int *s, std::vector<int> &buckets,
+                                int n, bool end) {
+  std::fill(buckets.begin(), buckets.end(), 0);
+  for (int i = 0; i < n; i++)
+    buckets[s[i]]++;
+
+  // Buckets point either at their start or one past their end
+  int sum = 0;
+  for (size_t i = 0; i < buckets.size(); i++) {
+    sum += buckets[i];
+    buckets[i] = end ? sum : sum - buckets[i];
+  }
+}
+
+void BurrowsWheeler::InduceL(const std::vector<bool> &stype, int *sa,
+                             const int *s, std::vector<int> &buckets, int n) {
+  GetBuckets(s, buckets, n, false);
+  for (int i = 0; i < n; i++) {
+    int j = sa[i] - 1;
+    if (j >= 0 && !stype[j])
+      sa[buckets[s[j]]++] = j;
+  }
+}
+
+void BurrowsWheeler::InduceS(const std::vector<bool> &stype, int *sa,
+                             const int *s, std::vector<int> &buckets, int n) {
+  GetBuckets(s, buckets, n, true);
+  for (int i = n - 1; i >= 0; i--) {
+    int j = sa[i] - 1;
+    if (j >= 0 && stype[j])
+      sa[--buckets[s[j]]] = j;
+  }
+}
+
+void BurrowsWheeler::SuffixArray(const int *s, int *sa, int n,
+                                 int max_symbol) {
+  // Classify suffixes, S-type suffixes are smaller than the next one
+  std::vector<bool> stype(n);
+  stype[n - 1] = true;
+  for (int i = n - 2; i >= 0; i--)
+    stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+
+  // Sort the LMS substrings by inducing from their bucket ends
+  std::vector<int> buckets(max_symbol + 1);
+  GetBuckets(s, buckets, n, true);
+  std::fill(sa, sa + n, -1);
+  for (int i = 1; i < n; i++) {
+    if (IsLms(stype, i))
+      sa[--buckets[s[i]]] = i;
+  }
+  InduceL(stype, sa, s, buckets, n);
+  InduceS(stype, sa, s, buckets, n);
+
+  // Move the sorted LMS substrings to the front
+  int n1 = 0;
+  for (int i = 0; i < n; i++) {
+    if (IsLms(stype, sa[i]))
+      sa[n1++] = sa[i];
+  }
+
+  // Name the LMS substrings, equal substrings share a name
+  std::fill(sa + n1, sa + n, -1);
+  int name = 0, prev = -1;
+  for (int i = 0; i < n1; i++) {
+    int pos = sa[i];
+    bool diff = false;
+    for (int d = 0; d < n; d++) {
+      if (prev == -1 || s[pos + d] != s[prev + d] ||
+          stype[pos + d] != stype[prev + d]) {
+        diff = true;
+        break;
+      } else if (d > 0 && (IsLms(stype, pos + d) || IsLms(stype, prev + d))) {
+        break;
+      }
+    }
+    if (diff) {
+      name++;
+      prev = pos;
+    }
+    sa[n1 + pos / 2] = name - 1;
+  }
+  for (int i = n - 1, j = n - 1; i >= n1; i--) {
+    if (sa[i] >= 0)
+      sa[j--] = sa[i];
+  }
+
+  // Sort the reduced string, recursing only if some names repeat
+  int *s1 = sa + n - n1;
+  if (name < n1) {
+    SuffixArray(s1, sa, n1, name - 1);
+  } else {
+    for (int i = 0; i < n1; i++)
+      sa[s1[i]] = i;
+  }
+
+  // Induce the full suffix array from the sorted LMS suffixes
+  GetBuckets(s, buckets, n, true);
+  for (int i = 1, j = 0; i < n; i++) {
+    if (IsLms(stype, i))
+      s1[j++] = i;
+  }
+  for (int i = 0; i < n1; i++)
+    sa[i] = s1[sa[i]];
+  std::fill(sa + n1, sa + n, -1);
+  for (int i = n1 - 1; i >= 0; i--) {
+    int j = sa[i];
+    sa[i] = -1;
+    sa[--buckets[s[j]]] = j;
+  }
+  InduceL(stype, sa, s, buckets, n);
+  InduceS(stype, sa, s, buckets, n);
+}
+
+void BurrowsWheeler::Transform(const char *block, size_t block_size,
+                               std::string &output, int &primary_index) {
+  int n = static_cast<int>(block_size);
+  // Shift bytes up by one to make room for the sentinel
+  std::vector<int> s(n + 1), sa(n + 1);
+  for (int i = 0; i < n; i++)
+    s[i] = static_cast<unsigned char>(block[i]) + 1;
+  s[n] = 0;
+  SuffixArray(s.data(), sa.data(), n + 1, 256);
+
+  // Last column of the sorted rotations, leaving out the sentinel
+  output.clear();
+  output.reserve(n);
+  primary_index = 0;
+  for (int i = 0; i <= n; i++) {
+    if (sa[i] == 0)
+      primary_index = i;
+    else
+      output += block[sa[i] - 1];
+  }
+}
+
+void BurrowsWheeler::Inverse(const std::string &bwt, int primary_index,
+                             std::string &output) {
+  int n = static_cast<int>(bwt.size());
+  // Row 0 belongs to the sentinel, so every byte's rows start after it
+  std::array<int, 256> base = {0};
+  for (int i = 0; i < n; i++)
+    base[static_cast<unsigned char>(bwt[i])]++;
+  int sum = 1;
+  for (int c = 0; c < 256; c++) {
+    int count = base[c];
+    base[c] = sum;
+    sum += count;
+  }
+
+  // Last-to-first mapping over the n + 1 rows, with the sentinel re-inserted
+  // at primary_index
+  std::vector<int> lf(n + 1);
+  for (int i = 0; i <= n; i++) {
+    if (i == primary_index)
+      lf[i] = 0;
+    else
+      lf[i] = base[static_cast<unsigned char>(bwt[i - (i > primary_index)])]++;
+  }
+
+  // Walk backwards from the row starting with the sentinel
+  output.resize(n);
+  int row = 0;
+  for (int k = n - 1; k >= 0; k--) {
+    output[k] = bwt[row - (row > primary_index)];
+    row = lf[row];
+  }
+}
+
+void BurrowsWheeler::TransformBlocks(const std::string &file_contents,
+                                     size_t block_size,
+                                     std::vector<std::string> &outputs,
+                                     std::vector<int> &primary_indices) {
+  size_t num_blocks = (file_contents.size() + block_size - 1) / block_size;
+  outputs.resize(num_blocks);
+  primary_indices.resize(num_blocks);
+
+  // Blocks are independent, so each thread takes every num_threads-th block
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  num_threads = std::min(num_threads, num_blocks);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; t++) {
+    threads.push_back(std::thread([&, t]() {
+      for (size_t b = t; b < num_blocks; b += num_threads) {
+        size_t start = b * block_size;
+        size_t size = std::min(block_size, file_contents.size() - start);
+        Transform(file_contents.data() + start, size, outputs[b],
+                  primary_indices[b]);
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+}
+
+void BurrowsWheeler::MoveToFront(std::string &data) {
+  std::array<unsigned char, 256> order;
+  for (int i = 0; i < 256; i++)
+    order[i] = i;
+
+  for (size_t i = 0; i < data.size(); i++) {
+    unsigned char ch = data[i];
+    int index = 0;
+    while (order[index] != ch)
+      index++;
+    // Shift everything in front of ch back by one
+    std::copy_backward(order.begin(), order.begin() + index,
+                       order.begin() + index + 1);
+    order[0] = ch;
+    data[i] = static_cast<char>(index);
+  }
+}
+
+void BurrowsWheeler::InverseMoveToFront(std::string &data) {
+  std::array<unsigned char, 256> order;
+  for (int i = 0; i < 256; i++)
+    order[i] = i;
+
+  for (size_t i = 0; i < data.size(); i++) {
+    int index = static_cast<unsigned char>(data[i]);
+    unsigned char ch = order[index];
+    std::copy_backward(order.begin(), order.begin() + index,
+                       order.begin() + index + 1);
+    order[0] = ch;
+    data[i] = static_cast<char>(ch);
+  }
+}
+
+void BurrowsWheeler::EncodeZeroRuns(const std::string &mtf,
+                                    std::vector<int> &symbols) {
+  size_t i = 0;
+  while (i < mtf.size()) {
+    if (mtf[i]) {
+      symbols.push_back(static_cast<unsigned char>(mtf[i]) + 1);
+      i++;
+      continue;
+    }
+
+    size_t run_length = 0;
+    while (i < mtf.size() && !mtf[i]) {
+      run_length++;
+      i++;
+    }
+    // Least significant digit first, kRunA is 1 and kRunB is 2
+    while (run_length) {
+      if (run_length & 1) {
+        symbols.push_back(kRunA);
+        run_length = (run_length - 1) / 2;
+      } else {
+        symbols.push_back(kRunB);
+        run_length = (run_length - 2) / 2;
+      }
+    }
+  }
+}
+
+bool BurrowsWheeler::DecodeZeroRuns(const std::vector<int> &symbols,
+                                    size_t max_size, std::string &mtf) {
+  // Checking each digit keeps weight from overflowing as well
+  size_t run_length = 0, weight = 1;
+  for (size_t i = 0; i < symbols.size(); i++) {
+    if (symbols[i] == kRunA || symbols[i] == kRunB) {
+      run_length += (symbols[i] == kRunA ? 1 : 2) * weight;
+      weight <<= 1;
+      if (run_length > max_size - mtf.size())
+        return false;
+      continue;
+    }
+    if (run_length + 1 > max_size - mtf.size())
+      return false;
+    mtf.append(run_length, '\0');
+    run_length = 0;
+    weight = 1;
+    mtf += static_cast<char>(symbols[i] - 1);
+  }
+  mtf.append(run_length, '\0');
+  return true;
+}
+
+#endif  // BWT_H_
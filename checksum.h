@@ -0,0 +1,134 @@
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+class Checksum {
+ public:
+  // CRC-32 as used by gzip and zip, pass the previous result to continue it
+  // over more data
+  static uint32_t Crc32(const char *data, size_t size, uint32_t crc = 0);
+  // 64-bit FNV-1a, a quick hash for lookups, not for detecting errors
+  static uint64_t Fnv1a64(const char *data, size_t size);
+  // The 32 byte SHA-256 digest, for telling data apart by its hash alone
+  static std::string Sha256(const char *data, size_t size);
+
+ private:
+  static std::array<uint32_t, 256> BuildCrc32Table();
+  // Mixes one 64 byte block into the SHA-256 state
+  static void Sha256Block(const unsigned char *block, uint32_t state[8]);
+};
+
+std::array<uint32_t, 256> Checksum::BuildCrc32Table() {
+  std::array<uint32_t, 256> table;
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    table[i] = c;
+  }
+  return table;
+}
+
+uint32_t Checksum::Crc32(const char *data, size_t size, uint32_t crc) {
+  // Function statics are initialized once, even with several threads
+  static const std::array<uint32_t, 256> table = BuildCrc32Table();
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^
+          (crc >> 8);
+  return ~crc;
+}
+
+uint64_t Checksum::Fnv1a64(const char *data, size_t size) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001B3ull;
+  }
+  return hash;
+}
+
+void Checksum::Sha256Block(const unsigned char *block, uint32_t state[8]) {
+  static const uint32_t kRound[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+  auto rotate = [](uint32_t x, int n) { return x >> n | x << (32 - n); };
+
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = static_cast<uint32_t>(block[4 * i]) << 24 | block[4 * i + 1] << 16 |
+           block[4 * i + 2] << 8 | block[4 * i + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^
+                  w[i - 15] >> 3;
+    uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ w[i - 2] >> 10;
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) +
+                  ((e & f) ^ (~e & g)) + kRound[i] + w[i];
+    uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) +
+                  ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+std::string Checksum::Sha256(const char *data, size_t size) {
+  uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64)
+    Sha256Block(bytes + i, state);
+
+  // The rest, a 1 bit, zeros and the length in bits fill one or two blocks
+  unsigned char last[128] = {};
+  size_t rest = size - i;
+  std::memcpy(last, bytes + i, rest);
+  last[rest] = 0x80;
+  size_t last_size = rest < 56 ? 64 : 128;
+  uint64_t bits = static_cast<uint64_t>(size) * 8;
+  for (int b = 0; b < 8; b++)
+    last[last_size - 1 - b] = static_cast<unsigned char>(bits >> (8 * b));
+  for (size_t j = 0; j < last_size; j += 64)
+    Sha256Block(last + j, state);
+
+  std::string digest(32, '\0');
+  for (int j = 0; j < 32; j++)
+    digest[j] = static_cast<char>(state[j / 4] >> (24 - 8 * (j % 4)));
+  return digest;
+}
+
+#endif  // CHECKSUM_H_
@@ -0,0 +1,95 @@
+#ifndef CHUNKER_H_
+#define CHUNKER_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "huffman.h"
+
+// Cuts data into chunks where its content says to, so that bytes inserted or
+// removed only move the cuts near them and the same data always comes out as
+// the same chunks, wherever it is.
+//
+// A gear hash rolls over the last 64 bytes and a cut goes where its top bits
+// are all zero. Like FastCDC, more bits have to be zero before
+// kAverageChunk than after, which keeps chunk sizes close to the average
+class Chunker {
+ public:
+  static const size_t kMinChunk = 1 << 14;
+  static const size_t kAverageChunk = 1 << 16;
+  // Chunks are coded as one block each
+  static const size_t kMaxChunk = Huffman::kBlockSize;
+
+  // Sizes of the chunks of data, in order
+  static void Split(const char *data, size_t size,
+                    std::vector<size_t> &chunk_sizes);
+
+ private:
+  static const uint64_t kStrictMask = 0x3FFFFull << 46;
+  static const uint64_t kLooseMask = 0x3FFFull << 50;
+
+  static std::array<uint64_t, 256> BuildGearTable();
+  // Size of the chunk at the start of data
+  static size_t NextCut(const unsigned char *data, size_t size);
+};
+
+const size_t Chunker::kMinChunk;
+const size_t Chunker::kAverageChunk;
+const size_t Chunker::kMaxChunk;
+const uint64_t Chunker::kStrictMask;
+const uint64_t Chunker::kLooseMask;
+
+// Fixed pseudo-random values, so that chunks stay the same from run to run
+std::array<uint64_t, 256> Chunker::BuildGearTable() {
+  std::array<uint64_t, 256> table;
+  uint64_t seed = 0x5A4150u;
+  for (size_t i = 0; i < table.size(); i++) {
+    // splitmix64
+    uint64_t z = seed += 0x9E3779B97F4A7C15ull;
+    z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ z >> 27) * 0x94D049BB133111EBull;
+    table[i] = z ^ z >> 31;
+  }
+  return table;
+}
+
+void Chunker::Split(const char *data, size_t size,
+                    std::vector<size_t> &chunk_sizes) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+  for (size_t offset = 0; offset < size;) {
+    size_t chunk_size = NextCut(bytes + offset, size - offset);
+    chunk_sizes.push_back(chunk_size);
+    offset += chunk_size;
+  }
+}
+
+size_t Chunker::NextCut(const unsigned char *data, size_t size) {
+  static const std::array<uint64_t, 256> gear = BuildGearTable();
+  if (size <= kMinChunk)
+    return size;
+  size_t limit = std::min(size, kMaxChunk);
+  size_t normal = std::min(limit, kAverageChunk);
+
+  // The bytes before kMinChunk never end a chunk, and the hash forgets them
+  // after 64 bytes anyway
+  uint64_t hash = 0;
+  size_t i = kMinChunk - 64;
+  for (; i < kMinChunk; i++)
+    hash = (hash << 1) + gear[data[i]];
+  for (; i < normal; i++) {
+    hash = (hash << 1) + gear[data[i]];
+    if (!(hash & kStrictMask))
+      return i + 1;
+  }
+  for (; i < limit; i++) {
+    hash = (hash << 1) + gear[data[i]];
+    if (!(hash & kLooseMask))
+      return i + 1;
+  }
+  return limit;
+}
+
+#endif  // CHUNKER_H_
@@ -0,0 +1,135 @@
+#ifndef ENCODE_KERNEL_H_
+#define ENCODE_KERNEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ENCODE_KERNEL_X86 1
+#endif
+
+// Writes the Huffman codes of a block of bytes to a bit stream. codes and
+// lengths hold the code of every byte value right-aligned and its length.
+// The AVX2 version looks up 8 bytes at a time and merges their codes into
+// two words before writing them, it is picked at runtime when the CPU has it
+class EncodeKernel {
+ public:
+  template <typename BitOutput>
+  static void Encode(BitOutput &bos, const char *block, size_t block_size,
+                     const uint32_t *codes, const uint32_t *lengths,
+                     int max_length);
+
+  // Longest code the AVX2 version can merge, four of them fill 64 bits
+  static const int kMaxVectorLength = 16;
+
+  // The two versions Encode picks from, on their own so that they can be
+  // checked against each other. EncodeAvx2 must only run when HasAvx2()
+  static bool HasAvx2();
+  template <typename BitOutput>
+  static void EncodeScalar(BitOutput &bos, const unsigned char *block,
+                           size_t block_size, const uint32_t *codes,
+                           const uint32_t *lengths);
+  // Returns the number of bytes encoded, always a multiple of 8
+  template <typename BitOutput>
+  static size_t EncodeAvx2(BitOutput &bos, const unsigned char *block,
+                           size_t block_size, const uint32_t *codes,
+                           const uint32_t *lengths);
+
+ private:
+  // Writes up to 64 bits, PutBits only takes up to 32
+  template <typename BitOutput>
+  static void PutWord(BitOutput &bos, uint64_t word, int num_bits) {
+    if (num_bits > 32) {
+      bos.PutBits(static_cast<unsigned>(word >> 32), num_bits - 32);
+      num_bits = 32;
+    }
+    bos.PutBits(static_cast<unsigned>(word), num_bits);
+  }
+};
+
+bool EncodeKernel::HasAvx2() {
+#ifdef ENCODE_KERNEL_X86
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+#else
+  return false;
+#endif
+}
+
+template <typename BitOutput>
+void EncodeKernel::Encode(BitOutput &bos, const char *block,
+                          size_t block_size, const uint32_t *codes,
+                          const uint32_t *lengths, int max_length) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(block);
+  size_t done = 0;
+  if (max_length <= kMaxVectorLength && HasAvx2())
+    done = EncodeAvx2(bos, bytes, block_size, codes, lengths);
+  EncodeScalar(bos, bytes + done, block_size - done, codes, lengths);
+}
+
+template <typename BitOutput>
+void EncodeKernel::EncodeScalar(BitOutput &bos, const unsigned char *block,
+                                size_t block_size, const uint32_t *codes,
+                                const uint32_t *lengths) {
+  for (size_t i = 0; i < block_size; i++)
+    bos.PutBits(codes[block[i]], lengths[block[i]]);
+}
+
+#ifdef ENCODE_KERNEL_X86
+template <typename BitOutput>
+__attribute__((target("avx2"))) size_t EncodeKernel::EncodeAvx2(
+    BitOutput &bos, const unsigned char *block, size_t block_size,
+    const uint32_t *codes, const uint32_t *lengths) {
+  const __m256i low_half = _mm256_set1_epi64x(0xFFFFFFFF);
+  // Moves the odd 64-bit lanes down onto the even ones
+  const int kOddToEven = _MM_SHUFFLE(3, 3, 1, 1);
+  alignas(32) uint64_t quads[4], quad_lengths[4];
+
+  size_t i = 0;
+  for (; i + 8 <= block_size; i += 8) {
+    // Look up the codes and lengths of 8 bytes at once
+    __m128i bytes =
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(block + i));
+    __m256i index = _mm256_cvtepu8_epi32(bytes);
+    __m256i code = _mm256_i32gather_epi32(
+        reinterpret_cast<const int *>(codes), index, 4);
+    __m256i length = _mm256_i32gather_epi32(
+        reinterpret_cast<const int *>(lengths), index, 4);
+
+    // Each 64-bit lane holds two codes, the first in its low half. Shift the
+    // first left by the length of the second and merge them
+    __m256i first = _mm256_and_si256(code, low_half);
+    __m256i second = _mm256_srli_epi64(code, 32);
+    __m256i first_length = _mm256_and_si256(length, low_half);
+    __m256i second_length = _mm256_srli_epi64(length, 32);
+    __m256i pair =
+        _mm256_or_si256(_mm256_sllv_epi64(first, second_length), second);
+    __m256i pair_length = _mm256_add_epi64(first_length, second_length);
+
+    // Same again with neighbouring lanes, leaving two merged quads of up to
+    // 64 bits in lanes 0 and 2
+    __m256i next_pair = _mm256_permute4x64_epi64(pair, kOddToEven);
+    __m256i next_length = _mm256_permute4x64_epi64(pair_length, kOddToEven);
+    __m256i quad =
+        _mm256_or_si256(_mm256_sllv_epi64(pair, next_length), next_pair);
+    __m256i quad_length = _mm256_add_epi64(pair_length, next_length);
+
+    _mm256_store_si256(reinterpret_cast<__m256i *>(quads), quad);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(quad_lengths),
+                       quad_length);
+    PutWord(bos, quads[0], static_cast<int>(quad_lengths[0]));
+    PutWord(bos, quads[2], static_cast<int>(quad_lengths[2]));
+  }
+  return i;
+}
+#else
+template <typename BitOutput>
+size_t EncodeKernel::EncodeAvx2(BitOutput &bos, const unsigned char *block,
+                                size_t block_size, const uint32_t *codes,
+                                const uint32_t *lengths) {
+  return 0;
+}
+#endif
+
+#endif  // ENCODE_KERNEL_H_
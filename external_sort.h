@@ -0,0 +1,169 @@
+#ifndef EXTERNAL_SORT_H_
+#define EXTERNAL_SORT_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bstream.h"
+#include "merge.h"
+
+// Optional settings selected on the extsort command line
+struct SortOptions {
+  // Bytes of lines sorted in memory for each run
+  size_t run_size = 64 << 20;
+  // Runs merged at once, more than this take several passes
+  size_t fan_in = 256;
+  // Merge with a loser tree instead of a heap
+  bool loser_tree = false;
+};
+
+// Sorts the lines of a file larger than memory: sorted runs of it are
+// written to temporary files next to the output, then merged k at a time
+// until one is left
+class ExternalSort {
+ public:
+  static void Sort(const std::string &input_name,
+                   const std::string &output_name,
+                   const SortOptions &options = SortOptions());
+  // Merges run files, each sorted already, into the output
+  static void Merge(const std::vector<std::string> &run_names,
+                    const std::string &output_name, bool loser_tree);
+
+ private:
+  // Helpers
+  static void WriteLines(const std::vector<Line> &lines,
+                         const std::string &output_name);
+  template <typename Merger>
+  static void WriteMerge(Merger &merger, const std::string &output_name);
+  static void RemoveRuns(const std::vector<std::string> &run_names);
+};
+
+void ExternalSort::Sort(const std::string &input_name,
+                        const std::string &output_name,
+                        const SortOptions &options) {
+  if (options.fan_in < 2)
+    throw std::invalid_argument("Cannot merge fewer than 2 runs at a time");
+
+  // Lines point into the mapped input, so only they are sorted, not copied
+  std::vector<std::string> run_names;
+  try {
+    MappedRun input(input_name);
+    std::vector<Line> lines;
+    size_t run_bytes = 0;
+    bool more = !input.Done();
+    while (more) {
+      lines.push_back(input.Current());
+      run_bytes += input.Current().size + 1;
+      input.Next();
+      more = !input.Done();
+      if (run_bytes < options.run_size && more)
+        continue;
+
+      std::stable_sort(lines.begin(), lines.end());
+      // Input that fits in one run needs no merge
+      if (run_names.empty() && !more) {
+        WriteLines(lines, output_name);
+        return;
+      }
+      run_names.push_back(output_name + ".run" +
+                          std::to_string(run_names.size()));
+      WriteLines(lines, run_names.back());
+      lines.clear();
+      run_bytes = 0;
+    }
+    if (run_names.empty()) {
+      WriteLines(lines, output_name);
+      return;
+    }
+
+    // Earlier passes merge fan_in runs into one, keeping their order
+    size_t pass = 0;
+    while (run_names.size() > options.fan_in) {
+      std::vector<std::string> merged_names;
+      for (size_t i = 0; i < run_names.size(); i += options.fan_in) {
+        std::vector<std::string> group(
+            run_names.begin() + i,
+            run_names.begin() + std::min(i + options.fan_in,
+                                         run_names.size()));
+        merged_names.push_back(output_name + ".pass" + std::to_string(pass) +
+                               "." + std::to_string(merged_names.size()));
+        Merge(group, merged_names.back(), options.loser_tree);
+        RemoveRuns(group);
+      }
+      run_names.swap(merged_names);
+      pass++;
+    }
+    Merge(run_names, output_name, options.loser_tree);
+  } catch (...) {
+    RemoveRuns(run_names);
+    throw;
+  }
+  RemoveRuns(run_names);
+}
+
+void ExternalSort::Merge(const std::vector<std::string> &run_names,
+                         const std::string &output_name, bool loser_tree) {
+  std::vector<MappedRun> runs;
+  for (size_t i = 0; i < run_names.size(); i++)
+    runs.emplace_back(run_names[i]);
+
+  if (loser_tree) {
+    LoserTree<MappedRun> merger(runs);
+    WriteMerge(merger, output_name);
+  } else {
+    HeapMerge<MappedRun> merger(runs);
+    WriteMerge(merger, output_name);
+  }
+}
+
+void ExternalSort::WriteLines(const std::vector<Line> &lines,
+                              const std::string &output_name) {
+  int fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open output file " + output_name);
+  try {
+    FdSink sink(fd);
+    for (size_t i = 0; i < lines.size(); i++) {
+      sink.Write(lines[i].data, lines[i].size);
+      sink.Write("\n", 1);
+    }
+    sink.Flush();
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
+
+template <typename Merger>
+void ExternalSort::WriteMerge(Merger &merger, const std::string &output_name) {
+  int fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open output file " + output_name);
+  try {
+    FdSink sink(fd);
+    for (; !merger.Done(); merger.Next()) {
+      const Line &line = merger.Current();
+      sink.Write(line.data, line.size);
+      sink.Write("\n", 1);
+    }
+    sink.Flush();
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
+
+void ExternalSort::RemoveRuns(const std::vector<std::string> &run_names) {
+  for (size_t i = 0; i < run_names.size(); i++)
+    unlink(run_names[i].c_str());
+}
+
+#endif  // EXTERNAL_SORT_H_
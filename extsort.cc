@@ -0,0 +1,55 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "external_sort.h"
+
+int main(int argc, char *argv[]) {
+  SortOptions options;
+
+  // Options come before the file names
+  int arg = 1;
+  for (; arg < argc && std::string(argv[arg]).compare(0, 2, "--") == 0;
+       arg++) {
+    std::string option(argv[arg]);
+    if (option == "--loser") {
+      options.loser_tree = true;
+    } else if (option.compare(0, 6, "--run=") == 0) {
+      long run_size = std::atol(option.c_str() + 6);
+      if (run_size <= 0) {
+        std::cerr << "Error: run size must be positive\n";
+        exit(1);
+      }
+      options.run_size = run_size;
+    } else if (option.compare(0, 8, "--fanin=") == 0) {
+      long fan_in = std::atol(option.c_str() + 8);
+      if (fan_in < 2) {
+        std::cerr << "Error: fan-in must be at least 2\n";
+        exit(1);
+      }
+      options.fan_in = fan_in;
+    } else {
+      std::cerr << "Error: unknown option " << option << '\n';
+      exit(1);
+    }
+  }
+
+  if (argc - arg != 2) {
+    std::cerr << "Usage: " << argv[0] << " [options] <inputfile> <outputfile>\n"
+              << "Options:\n"
+              << "  --run=BYTES     sort runs of BYTES bytes in memory\n"
+              << "  --fanin=K       merge K runs at a time\n"
+              << "  --loser         merge with a loser tree, not a heap\n";
+    exit(1);
+  }
+
+  try {
+    ExternalSort::Sort(argv[arg], argv[arg + 1], options);
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    exit(1);
+  }
+
+  std::cout << "Sorted lines of " << argv[arg] << " into " << argv[arg + 1]
+            << '\n';
+}
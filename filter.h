@@ -0,0 +1,273 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// How each value is replaced before coding
+enum FilterTransform {
+  kNoTransform = 0,
+  // The difference from the value before, for counters and timestamps
+  kDeltaTransform = 1,
+  // The bits that changed from the value before, for floats
+  kXorTransform = 2,
+};
+
+// Reversible pre-filters for arrays of fixed-width little-endian numbers,
+// which order-0 coding otherwise sees as near-random bytes. Values that
+// change slowly turn into small deltas, and shuffling them into byte planes
+// gathers their mostly zero high bytes into long runs.
+//
+// A filter fits in one byte: the transform in the low 2 bits, kShuffle, and
+// log2 of the value width in the high 4 bits. 0 is no filter. Each call
+// starts from a previous value of 0, and bytes after the last whole value
+// pass through as is
+class Filter {
+ public:
+  // Byte planes after the transform
+  static const int kShuffle = 1 << 2;
+
+  static int Make(FilterTransform transform, bool shuffle, int width);
+  static int Width(int filter) { return 1 << (filter >> 4); }
+  static bool Valid(int filter);
+  // Reads the zap command line form, such as delta4, xor8+shuffle or
+  // shuffle2, throwing std::invalid_argument on anything else
+  static int Parse(const std::string &spec);
+
+  // Replaces output with the filtered size bytes of data
+  static void Apply(int filter, const char *data, size_t size,
+                    std::string &output);
+  // Undoes Apply in place
+  static void Invert(int filter, char *data, size_t size);
+
+ private:
+  static const int kTransformMask = 3;
+
+  // Values are little-endian whatever the host
+  template <typename T>
+  static T Load(const char *data);
+  template <typename T>
+  static void Store(char *data, T value);
+
+  // Plain loops over whole values, which the compiler vectorizes
+  template <typename T>
+  static void Transform(FilterTransform transform, const char *data,
+                        size_t count, char *output);
+  template <typename T>
+  static void Untransform(FilterTransform transform, char *data,
+                          size_t count);
+  static void Transform(FilterTransform transform, int width,
+                        const char *data, size_t count, char *output);
+  static void Untransform(FilterTransform transform, int width, char *data,
+                          size_t count);
+  static void Shuffle(const char *data, size_t count, int width,
+                      char *output);
+  static void Unshuffle(const char *data, size_t count, int width,
+                        char *output);
+};
+
+const int Filter::kShuffle;
+const int Filter::kTransformMask;
+
+int Filter::Make(FilterTransform transform, bool shuffle, int width) {
+  int log_width = 0;
+  while (log_width < 4 && 1 << log_width != width)
+    log_width++;
+  int filter = log_width << 4 | (shuffle ? kShuffle : 0) | transform;
+  if (!Valid(filter))
+    throw std::invalid_argument("Bad filter");
+  return filter;
+}
+
+bool Filter::Valid(int filter) {
+  return filter > 0 && filter < 0x40 && (filter & kTransformMask) != 3 &&
+         !(filter & 0x08) && (filter & (kTransformMask | kShuffle));
+}
+
+int Filter::Parse(const std::string &spec) {
+  std::string name = spec;
+  bool shuffle = false;
+  size_t plus = spec.find('+');
+  if (plus != std::string::npos) {
+    if (spec.substr(plus) != "+shuffle")
+      throw std::invalid_argument("Bad filter " + spec);
+    name = spec.substr(0, plus);
+    shuffle = true;
+  }
+
+  FilterTransform transform;
+  size_t digits;
+  if (name.compare(0, 5, "delta") == 0) {
+    transform = kDeltaTransform;
+    digits = 5;
+  } else if (name.compare(0, 3, "xor") == 0) {
+    transform = kXorTransform;
+    digits = 3;
+  } else if (name.compare(0, 7, "shuffle") == 0 && !shuffle) {
+    transform = kNoTransform;
+    shuffle = true;
+    digits = 7;
+  } else {
+    throw std::invalid_argument("Bad filter " + spec);
+  }
+
+  std::string width = name.substr(digits);
+  if (width != "1" && width != "2" && width != "4" && width != "8")
+    throw std::invalid_argument("Filter width must be 1, 2, 4 or 8");
+  return Make(transform, shuffle, width[0] - '0');
+}
+
+void Filter::Apply(int filter, const char *data, size_t size,
+                   std::string &output) {
+  if (!Valid(filter))
+    throw std::invalid_argument("Bad filter");
+  int width = Width(filter);
+  size_t count = size / width;
+  FilterTransform transform =
+      static_cast<FilterTransform>(filter & kTransformMask);
+  output.resize(size);
+  // The tail goes through untouched
+  std::memcpy(&output[count * width], data + count * width,
+              size - count * width);
+
+  if (!(filter & kShuffle)) {
+    Transform(transform, width, data, count, &output[0]);
+    return;
+  }
+  if (transform == kNoTransform) {
+    Shuffle(data, count, width, &output[0]);
+    return;
+  }
+  std::string transformed(count * width, '\0');
+  Transform(transform, width, data, count, &transformed[0]);
+  Shuffle(transformed.data(), count, width, &output[0]);
+}
+
+void Filter::Invert(int filter, char *data, size_t size) {
+  if (!Valid(filter))
+    throw std::invalid_argument("Bad filter");
+  int width = Width(filter);
+  size_t count = size / width;
+  if (filter & kShuffle) {
+    std::string shuffled(data, count * width);
+    Unshuffle(shuffled.data(), count, width, data);
+  }
+  Untransform(static_cast<FilterTransform>(filter & kTransformMask), width,
+              data, count);
+}
+
+template <typename T>
+T Filter::Load(const char *data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  T swapped = 0;
+  for (size_t i = 0; i < sizeof(T); i++)
+    swapped = swapped << 8 | (value >> (8 * i) & 0xFF);
+  value = swapped;
+#endif
+  return value;
+}
+
+template <typename T>
+void Filter::Store(char *data, T value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  T swapped = 0;
+  for (size_t i = 0; i < sizeof(T); i++)
+    swapped = swapped << 8 | (value >> (8 * i) & 0xFF);
+  value = swapped;
+#endif
+  std::memcpy(data, &value, sizeof(T));
+}
+
+// Each output value only depends on two input values, so there is no chain
+// from one to the next
+template <typename T>
+void Filter::Transform(FilterTransform transform, const char *data,
+                       size_t count, char *output) {
+  const size_t kWidth = sizeof(T);
+  if (transform == kNoTransform) {
+    std::memcpy(output, data, count * kWidth);
+    return;
+  }
+  if (!count)
+    return;
+  Store<T>(output, Load<T>(data));
+  if (transform == kDeltaTransform) {
+    for (size_t i = 1; i < count; i++)
+      Store<T>(output + i * kWidth, static_cast<T>(
+                                        Load<T>(data + i * kWidth) -
+                                        Load<T>(data + (i - 1) * kWidth)));
+  } else {
+    for (size_t i = 1; i < count; i++)
+      Store<T>(output + i * kWidth,
+               Load<T>(data + i * kWidth) ^ Load<T>(data + (i - 1) * kWidth));
+  }
+}
+
+// Running sums are a chain, the decoder is where the cost is
+template <typename T>
+void Filter::Untransform(FilterTransform transform, char *data,
+                         size_t count) {
+  const size_t kWidth = sizeof(T);
+  T previous = 0;
+  if (transform == kDeltaTransform) {
+    for (size_t i = 0; i < count; i++) {
+      previous = static_cast<T>(previous + Load<T>(data + i * kWidth));
+      Store<T>(data + i * kWidth, previous);
+    }
+  } else if (transform == kXorTransform) {
+    for (size_t i = 0; i < count; i++) {
+      previous ^= Load<T>(data + i * kWidth);
+      Store<T>(data + i * kWidth, previous);
+    }
+  }
+}
+
+void Filter::Transform(FilterTransform transform, int width, const char *data,
+                       size_t count, char *output) {
+  if (width == 1)
+    Transform<uint8_t>(transform, data, count, output);
+  else if (width == 2)
+    Transform<uint16_t>(transform, data, count, output);
+  else if (width == 4)
+    Transform<uint32_t>(transform, data, count, output);
+  else
+    Transform<uint64_t>(transform, data, count, output);
+}
+
+void Filter::Untransform(FilterTransform transform, int width, char *data,
+                         size_t count) {
+  if (width == 1)
+    Untransform<uint8_t>(transform, data, count);
+  else if (width == 2)
+    Untransform<uint16_t>(transform, data, count);
+  else if (width == 4)
+    Untransform<uint32_t>(transform, data, count);
+  else
+    Untransform<uint64_t>(transform, data, count);
+}
+
+// Byte b of every value goes to plane b, the planes one after the other
+void Filter::Shuffle(const char *data, size_t count, int width,
+                     char *output) {
+  for (int b = 0; b < width; b++) {
+    char *plane = output + b * count;
+    for (size_t i = 0; i < count; i++)
+      plane[i] = data[i * width + b];
+  }
+}
+
+void Filter::Unshuffle(const char *data, size_t count, int width,
+                       char *output) {
+  for (int b = 0; b < width; b++) {
+    const char *plane = data + b * count;
+    for (size_t i = 0; i < count; i++)
+      output[i * width + b] = plane[i];
+  }
+}
+
+#endif  // FILTER_H_
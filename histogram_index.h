@@ -0,0 +1,168 @@
+#ifndef HISTOGRAM_INDEX_H_
+#define HISTOGRAM_INDEX_H_
+
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bstream.h"
+#include "huffman.h"
+#include "sync_index.h"
+
+// How often each byte value occurs in one block of a zap stream
+struct BlockHistogram {
+  // Offset of the block in the uncompressed data
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  std::vector<uint32_t> counts = std::vector<uint32_t>(1 << CHAR_BIT);
+};
+
+// The byte histograms of the blocks of a zap stream, stored after its end of
+// stream marker and before any sync index, with a trailer of their own:
+//
+//   zap stream | count, histograms | index offset "ZAPH" | sync index
+//
+// Each histogram is a bitmap of the byte values present followed by their
+// counts, so that byte and line counts or the entropy of a file can be had
+// without decoding it
+class HistogramIndex {
+ public:
+  // Counts the bytes of a block into histogram, leaving its offset alone
+  static void Count(const char *block, size_t block_size,
+                    BlockHistogram &histogram);
+  // Appends the histograms of a zap stream of index_offset bytes
+  static void Write(const std::vector<BlockHistogram> &histograms,
+                    uint64_t index_offset, std::string &output);
+  // Finds where the histograms in a zap file start from their trailer alone,
+  // returns false if it has none
+  static bool Locate(const char *zap, size_t zap_size, uint64_t &index_offset);
+  // Reads the histograms of a zap file, returns false if it has none
+  static bool Read(const char *zap, size_t zap_size,
+                   std::vector<BlockHistogram> &histograms);
+
+  // Bits per byte of an order-0 code for the counts
+  template <typename T>
+  static double Entropy(const std::vector<T> &counts);
+
+ private:
+  static const char kTrailerMagic[4];
+  // Index offset and magic
+  static const size_t kTrailerSize = 12;
+  static const size_t kBitmapSize = (1 << CHAR_BIT) / CHAR_BIT;
+};
+
+const char HistogramIndex::kTrailerMagic[4] = {'Z', 'A', 'P', 'H'};
+const size_t HistogramIndex::kTrailerSize;
+const size_t HistogramIndex::kBitmapSize;
+
+// Four tables so that runs of the same byte do not wait on each other's
+// increments
+void HistogramIndex::Count(const char *block, size_t block_size,
+                           BlockHistogram &histogram) {
+  uint32_t counts[4][1 << CHAR_BIT] = {};
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(block);
+  size_t i = 0;
+  for (; i + 4 <= block_size; i += 4) {
+    counts[0][bytes[i]]++;
+    counts[1][bytes[i + 1]]++;
+    counts[2][bytes[i + 2]]++;
+    counts[3][bytes[i + 3]]++;
+  }
+  for (; i < block_size; i++)
+    counts[0][bytes[i]]++;
+  for (size_t b = 0; b < histogram.counts.size(); b++)
+    histogram.counts[b] = counts[0][b] + counts[1][b] + counts[2][b] +
+                          counts[3][b];
+  histogram.size = block_size;
+}
+
+void HistogramIndex::Write(const std::vector<BlockHistogram> &histograms,
+                           uint64_t index_offset, std::string &output) {
+  BasicBinaryOutputStream<StringSink> bos(output);
+  bos.PutInt(histograms.size());
+  for (size_t i = 0; i < histograms.size(); i++) {
+    const std::vector<uint32_t> &counts = histograms[i].counts;
+    for (size_t b = 0; b < counts.size(); b += CHAR_BIT) {
+      unsigned char present = 0;
+      for (int bit = 0; bit < CHAR_BIT; bit++)
+        present |= (counts[b + bit] != 0) << bit;
+      bos.PutChar(static_cast<char>(present));
+    }
+    for (size_t b = 0; b < counts.size(); b++) {
+      if (counts[b])
+        bos.PutInt(counts[b]);
+    }
+  }
+  bos.PutInt64(index_offset);
+  for (size_t i = 0; i < sizeof(kTrailerMagic); i++)
+    bos.PutChar(kTrailerMagic[i]);
+}
+
+bool HistogramIndex::Locate(const char *zap, size_t zap_size,
+                            uint64_t &index_offset) {
+  // The histograms end where the sync index starts, if there is one
+  uint64_t end = zap_size;
+  SyncIndex::Locate(zap, zap_size, end);
+  if (end < kTrailerSize ||
+      std::memcmp(zap + end - sizeof(kTrailerMagic), kTrailerMagic,
+                  sizeof(kTrailerMagic)) != 0)
+    return false;
+
+  BasicBinaryInputStream<MemorySource> trailer_bis(zap + end - kTrailerSize,
+                                                   kTrailerSize);
+  index_offset = trailer_bis.GetInt64();
+  if (index_offset > end - kTrailerSize)
+    throw std::runtime_error("Histogram index is out of bounds");
+  return true;
+}
+
+bool HistogramIndex::Read(const char *zap, size_t zap_size,
+                          std::vector<BlockHistogram> &histograms) {
+  uint64_t index_offset;
+  if (!Locate(zap, zap_size, index_offset))
+    return false;
+  uint64_t end = zap_size;
+  SyncIndex::Locate(zap, zap_size, end);
+
+  size_t index_size = end - kTrailerSize - index_offset;
+  BasicBinaryInputStream<MemorySource> bis(zap + index_offset, index_size);
+  uint32_t num_histograms = bis.GetInt();
+  if (num_histograms > index_size / kBitmapSize)
+    throw std::runtime_error("Histogram index is corrupt");
+  histograms.assign(num_histograms, BlockHistogram());
+  uint64_t offset = 0;
+  for (size_t i = 0; i < histograms.size(); i++) {
+    BlockHistogram &histogram = histograms[i];
+    unsigned char bitmap[kBitmapSize];
+    bis.GetBytes(reinterpret_cast<char *>(bitmap), kBitmapSize);
+    histogram.offset = offset;
+    for (size_t b = 0; b < histogram.counts.size(); b++) {
+      if (bitmap[b / CHAR_BIT] >> b % CHAR_BIT & 1)
+        histogram.counts[b] = bis.GetInt();
+      histogram.size += histogram.counts[b];
+    }
+    if (histogram.size > Huffman::kBlockSize)
+      throw std::runtime_error("Histogram index is corrupt");
+    offset += histogram.size;
+  }
+  return true;
+}
+
+template <typename T>
+double HistogramIndex::Entropy(const std::vector<T> &counts) {
+  double total = 0;
+  for (size_t b = 0; b < counts.size(); b++)
+    total += counts[b];
+  double bits = 0;
+  for (size_t b = 0; b < counts.size(); b++) {
+    if (counts[b])
+      bits -= counts[b] * std::log2(counts[b] / total);
+  }
+  return total ? bits / total : 0;
+}
+
+#endif  // HISTOGRAM_INDEX_H_
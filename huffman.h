@@ -1,24 +1,36 @@
 #ifndef HUFFMAN_H_
 #define HUFFMAN_H_
 
+#include <algorithm>
 #include <array>
+#include <bitset>
+#include <cstdint>
 #include <cctype>
+#include <cmath>
 #include <cstddef>
 #include <fstream>
 #include <iostream>
 #include <memory>
 #include <queue>
 #include <sstream>
+#include <stdexcept>
 #include <streambuf>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "bstream.h"
+#include "bwt.h"
+#include "encode_kernel.h"
+#include "filter.h"
+#include "lz77.h"
 #include "pqueue.h"
+#include "radix_heap.h"
+#include "tree_cache.h"
 
 class HuffmanNode {
  public:
-  explicit HuffmanNode(char ch, size_t freq,
+  explicit HuffmanNode(int ch, size_t freq,
                        std::unique_ptr<HuffmanNode> left = nullptr,
                        std::unique_ptr<HuffmanNode> right = nullptr)
       : ch_(ch), freq_(freq) {
@@ -45,21 +57,160 @@ class HuffmanNode {
   HuffmanNode *right() { return right_.get(); }
 
  private:
-  char ch_;
+  int ch_;
   size_t freq_;
   std::unique_ptr<HuffmanNode> left_, right_;
 };
 
+// Orders HuffmanNodes by frequency alone in a RadixHeap
+class HuffmanNodeFreq {
+ public:
+  uint64_t operator()(const std::unique_ptr<HuffmanNode> &node) {
+    return node->freq();
+  }
+};
+
+// Every block of a zap file starts with one of these as a char and ends on a
+// byte boundary
+enum BlockType {
+  kHuffmanBlock = 0,
+  kRunLengthBlock = 1,
+  kBwtBlock = 2,
+  kLz77Block = 3,
+  kStoredBlock = 4,
+  // Plain Huffman blocks coded with the code of the previous one, as is or
+  // with some code lengths changed
+  kReusedHuffmanBlock = 5,
+  kDeltaHuffmanBlock = 6,
+  // A filter byte and the size of the block, then the blocks its filtered
+  // bytes were coded as, which decode only as a whole
+  kFilteredBlock = 7,
+  kEndOfStream = 0xFF,
+};
+
+// Optional stages selected on the zap command line
+struct CompressOptions {
+  // Run each block through Burrows-Wheeler, move-to-front and zero-run
+  // coding, keeping it only when it beats plain Huffman and run-lengths
+  bool bwt = false;
+  // Lz77::kMinLevel to Lz77::kMaxLevel to also try coding each block as
+  // literals and matches, 0 to skip it
+  int lz77_level = 0;
+  // Also record a sync point every this many bytes inside plain Huffman
+  // blocks, on top of one at the start of every block. 0 records none
+  size_t sync_interval = 0;
+  // Store a block as is unless coding it saves at least this percentage
+  int store_margin = 1;
+  // Build the plain Huffman tree of each block from a sample of it instead
+  // of counting every byte. Codes come out slightly longer
+  bool sampled = false;
+  // Bytes per block, up to Huffman::kBlockSize. 0 means kBlockSize
+  size_t block_size = 0;
+  // Let plain Huffman blocks reuse the code of the previous one, or send
+  // only the code lengths that changed. Reuse is picked even when up to
+  // reuse_threshold percent larger, since it saves the decoder rebuilding
+  // its tree. Blocks then depend on the ones before them, so this is off
+  // when sync points are recorded
+  bool reuse_tables = false;
+  int reuse_threshold = 2;
+  // Split each block further where its statistics change, so that every
+  // part gets its own tree
+  bool split_blocks = false;
+  // Run each block through a Filter first, for arrays of numbers. 0 for none
+  int filter = 0;
+  // Keep the byte histogram of every block in a HistogramIndex after the
+  // stream
+  bool histograms = false;
+};
+
+// A place decoding can start from without decoding what comes before it.
+// Every block start is one, and so is any byte inside a plain Huffman block,
+// given that block's tree
+struct SyncPoint {
+  // Offset of the byte in the uncompressed data
+  uint64_t offset;
+  // Byte offset in the zap stream of the block holding it
+  uint64_t block_offset;
+  // How far into that block the byte is, uncompressed and in coded bits.
+  // Both are 0 at the start of a block
+  uint32_t block_skip;
+  uint32_t bit_skip;
+};
+
+// The code of one symbol, right-aligned in bits and written most significant
+// bit first
+struct PackedCode {
+  uint32_t bits;
+  uint8_t length;
+};
+
+// A Huffman code over an alphabet of freq_array.size() symbols, with leaves
+// written using symbol_bits bits
+struct HuffmanCode {
+  explicit HuffmanCode(int alphabet_size, int symbol_bits = CHAR_BIT)
+      : freq_array(alphabet_size, 0),
+        code_table(alphabet_size, PackedCode()),
+        symbol_bits(symbol_bits) {}
+
+  std::vector<int> freq_array;
+  std::vector<PackedCode> code_table;
+  std::unique_ptr<HuffmanNode> huffman_tree;
+  int symbol_bits;
+};
+
 class Huffman {
  public:
-  static void Compress(std::ifstream &ifs, std::ofstream &ofs);
+  // Number of input bytes coded together with one tree
+  static const size_t kBlockSize = 1 << 18;
+
+  static void Compress(std::ifstream &ifs, std::ofstream &ofs,
+                       const CompressOptions &options = CompressOptions());
 
   static void Decompress(std::ifstream &ifs, std::ofstream &ofs);
 
- private:
-  // Helper methods...
+  // The same coder over any bit stream from bstream.h, such as one writing to
+  // a string, a file descriptor or a FILE *. Decompress writes the output to
+  // a sink from bstream.h
+  template <typename BitOutput>
+  static void Compress(const std::string &file_contents, BitOutput &bos,
+                       const CompressOptions &options = CompressOptions());
+  template <typename BitInput, typename Sink>
+  static void Decompress(BitInput &bis, Sink &sink);
+
+  // In-memory versions of the above
+  static void Compress(const std::string &input, std::string &output,
+                       const CompressOptions &options = CompressOptions());
+  static void Decompress(const std::string &input, std::string &output);
+
+  // Codes a single block of at most kBlockSize bytes. Coded blocks can be
+  // concatenated in order and closed with EndStream() to make a zap stream.
+  // With options.sync_interval set, the sync points of the block are added to
+  // sync_points, with offsets relative to the block
+  //
+  // With options.reuse_tables set, previous_code carries the plain Huffman
+  // code from block to block, so blocks have to be coded in order
+  template <typename BitOutput>
+  static void CompressBlock(BitOutput &bos, const char *block,
+                            size_t block_size,
+                            const CompressOptions &options,
+                            std::vector<SyncPoint> *sync_points = nullptr,
+                            std::vector<PackedCode> *previous_code = nullptr);
+  template <typename BitOutput>
+  static void EndStream(BitOutput &bos);
+  static size_t BlockSize(const CompressOptions &options) {
+    return options.block_size ? options.block_size : kBlockSize;
+  }
+
+  // Estimated size of the zap stream from the histogram and code lengths of
+  // every block, without coding anything. Only plain Huffman and stored
+  // blocks are considered, the other modes are only picked when smaller.
+  // It is not a bound though: with options.reuse_tables a block may reuse a
+  // code up to options.reuse_threshold percent larger than its own. The
+  // sync index and histograms written after the stream are not counted
+  static size_t EstimateSize(const char *input, size_t input_size,
+                             const CompressOptions &options =
+                                 CompressOptions());
 
-  // Compress Helpers
   // Compares HuffmanNode pointers
   class CompareHuffmanNodes {
    public:
@@ -68,38 +219,293 @@ class Huffman {
       return *node1 < *node2;
     }
   };
-  static void CountFrequency(std::string &file_contents,
-                             std::array<int, 128> &freq_array);
+  // Builds the tree for the counts of each symbol on a PQueue or any queue
+  // with its interface. Frequencies only ever grow as the tree is built, so
+  // a RadixHeap also works, with ties broken differently
+  template <typename Queue = PQueue<std::unique_ptr<HuffmanNode>,
+                                    CompareHuffmanNodes>>
   static std::unique_ptr<HuffmanNode> BuildHuffmanTree(
-      std::array<int, 128> &freq_array);
-  static void Encoding(HuffmanNode *node,
-                       std::array<std::string, 128> &code_table,
-                       std::string path, std::string &encoded_string);
+      std::vector<int> &freq_array);
+  typedef RadixHeap<std::unique_ptr<HuffmanNode>, HuffmanNodeFreq> RadixQueue;
+
+  // Cuts a block into parts wherever giving each part its own tree is
+  // expected to save more than the extra block headers cost. All parts but
+  // the last are multiples of kSplitSegment bytes
+  static void SplitBlock(const char *block, size_t block_size,
+                         std::vector<size_t> &part_sizes);
+
+  // Decodes length bytes starting skip bytes after the sync point, with bis
+  // at the start of the block holding the sync point. Stops early at the end
+  // of the stream
+  template <typename BitInput>
+  static void DecompressRange(BitInput &bis, const SyncPoint &sync,
+                              size_t skip, size_t length,
+                              std::string &output);
+
+  // Decodes the block after its type onto output, for callers that walk the
+  // blocks of a stream themselves. previous_tree is the last plain Huffman
+  // tree, for blocks reusing it
+  template <typename BitInput>
+  static void ReadBlock(BitInput &bis, unsigned char block_type,
+                        std::string &output,
+                        std::shared_ptr<HuffmanNode> &previous_tree);
+  // The byte values the block after its type may hold, from the trees in its
+  // header alone. Blocks whose header does not tell claim all of them
+  template <typename BitInput>
+  static void BlockSymbols(BitInput &bis, unsigned char block_type,
+                           std::bitset<1 << CHAR_BIT> &symbols);
+
+ private:
+  // Decodes with the same trees and symbols, a step at a time
+  friend class StreamDecoder;
+
+  // Number of byte values, all of which can appear in the input
+  static const int kAlphabetSize = 256;
+  // Sampling reads kSampleSize bytes out of every kSampleStride, whole pages
+  // so the rest are not even read in
+  static const size_t kSampleSize = 1 << 12;
+  static const size_t kSampleStride = 1 << 15;
+  // Code lengths in a delta go up to 32
+  static const int kLengthBits = 6;
+  // Block splits only fall between segments of this many bytes
+  static const size_t kSplitSegment = 1 << 12;
+
+  // Helper methods...
+
+  // Compress Helpers
+  static void CountFrequency(const char *block, size_t block_size,
+                             std::vector<int> &freq_array);
+  static void SampleFrequency(const char *block, size_t block_size,
+                              std::vector<int> &freq_array);
+  static size_t StoredBits(size_t block_size);
+  static double PartCost(const std::vector<size_t> &prefix_freq,
+                         size_t begin, size_t end);
+  static void SplitParts(const std::vector<size_t> &prefix_freq,
+                         size_t begin, size_t end, size_t block_size,
+                         std::vector<size_t> &part_sizes);
+  template <typename BitOutput>
+  static void CompressPart(BitOutput &bos, const char *block,
+                           size_t block_size, const CompressOptions &options,
+                           std::vector<SyncPoint> *sync_points,
+                           std::vector<PackedCode> *previous_code);
+  static bool ShouldStore(size_t coded_bits, size_t block_size,
+                          const CompressOptions &options);
+  static void Encoding(HuffmanNode *node, std::vector<PackedCode> &code_table,
+                       uint32_t bits, int length);
+  static size_t TreeSize(HuffmanNode *node, int symbol_bits);
+  static size_t BuildCode(HuffmanCode &code);
+  template <typename BitOutput>
+  static void WriteTree(BitOutput &bos, HuffmanNode *node,
+                        int symbol_bits);
+  template <typename BitOutput>
+  static void WriteCode(BitOutput &bos, const PackedCode &code);
+  // Reuse and delta helpers
+  static BlockType PickHuffmanType(const HuffmanCode &code,
+                                   const std::vector<PackedCode> &previous,
+                                   const CompressOptions &options,
+                                   size_t &huffman_bits);
+  static void CanonicalCodes(std::vector<PackedCode> &code_table);
+  static std::unique_ptr<HuffmanNode> CanonicalTree(
+      const std::vector<PackedCode> &code_table);
+  static std::unique_ptr<HuffmanNode> CanonicalNode(
+      const std::vector<PackedCode> &code_table,
+      const std::vector<int> &symbols, size_t begin, size_t end, int depth);
+  static size_t LengthDeltaSize(const std::vector<PackedCode> &previous,
+                                const std::vector<PackedCode> &code_table);
+  template <typename BitOutput>
+  static void WriteLengthDelta(BitOutput &bos,
+                               const std::vector<PackedCode> &previous,
+                               const std::vector<PackedCode> &code_table);
+  template <typename BitOutput>
+  static void WriteBlock(BitOutput &bos, const char *block,
+                         size_t block_size, const std::string *bwt,
+                         int primary_index, const CompressOptions &options,
+                         std::vector<SyncPoint> *sync_points,
+                         std::vector<PackedCode> *previous_code);
+  // Run-length Helpers
+  static int LengthClass(size_t run_length);
+  static void CountRuns(const char *block, size_t block_size,
+                        std::string &run_chars,
+                        std::vector<size_t> &run_lengths);
   // Decompress Helpers
-  static std::unique_ptr<HuffmanNode> MakeNode(BinaryInputStream &bis);
-  static std::unique_ptr<HuffmanNode> RebuildTree(BinaryInputStream &bis);
-  static void WriteEncodedString(BinaryInputStream &bis, std::ofstream &ofs,
+  // Trees of symbol_bits symbols have at most this many nodes, and no node
+  // deeper than one less than the number of symbols
+  static size_t MaxTreeNodes(int symbol_bits) {
+    return (static_cast<size_t>(2) << symbol_bits) - 1;
+  }
+  template <typename BitInput>
+  static std::unique_ptr<HuffmanNode> MakeNode(BitInput &bis, int symbol_bits,
+                                               int depth, size_t &num_nodes);
+  template <typename BitInput>
+  static std::unique_ptr<HuffmanNode> RebuildTree(BitInput &bis,
+                                                  int symbol_bits = CHAR_BIT);
+  template <typename BitInput>
+  static size_t ScanTree(BitInput &bis, int symbol_bits, std::string &header);
+  // RebuildTree through the TreeCache, when it is on
+  template <typename BitInput>
+  static std::shared_ptr<HuffmanNode> ReadTree(BitInput &bis,
+                                               int symbol_bits = CHAR_BIT);
+  template <typename BitInput>
+  static int ReadSymbol(BitInput &bis, HuffmanNode *huffman_tree);
+  template <typename BitInput>
+  static void WriteEncodedString(BitInput &bis, std::string &output,
                                  HuffmanNode *huffman_tree);
+  template <typename BitInput>
+  static void WriteRunLengths(BitInput &bis, std::string &output);
+  template <typename BitInput>
+  static void WriteBwtSymbols(BitInput &bis, std::string &output);
+  // Throws on Burrows-Wheeler headers no encoder writes, before anything is
+  // sized or indexed by them
+  static void CheckBwtHeader(int num_chars, int primary_index,
+                             int num_symbols);
+  // Undoes the stages of a Burrows-Wheeler block in reverse order
+  static void InverseBwt(const std::vector<int> &symbols, int num_chars,
+                         int primary_index, std::string &output);
+  template <typename BitInput>
+  static void WriteLz77Tokens(BitInput &bis, std::string &output);
+  template <typename BitInput>
+  static void WriteStoredBytes(BitInput &bis, std::string &output);
+  template <typename BitInput>
+  static std::unique_ptr<HuffmanNode> ReadDeltaTree(
+      BitInput &bis, HuffmanNode *previous_tree);
+  template <typename BitInput>
+  static void ReadFilteredBlock(BitInput &bis, std::string &output,
+                                std::shared_ptr<HuffmanNode> &previous_tree);
 };
 
+const size_t Huffman::kBlockSize;
+const int Huffman::kAlphabetSize;
+const size_t Huffman::kSampleSize;
+const size_t Huffman::kSampleStride;
+const int Huffman::kLengthBits;
+const size_t Huffman::kSplitSegment;
+
 // To be completed below
-void Huffman::CountFrequency(std::string &file_contents,
-                             std::array<int, 128> &freq_array) {
-  for (size_t i = 0; i < file_contents.size(); i++)
-    freq_array[file_contents[i]]++;
+void Huffman::CountFrequency(const char *block, size_t block_size,
+                             std::vector<int> &freq_array) {
+  for (size_t i = 0; i < block_size; i++)
+    freq_array[static_cast<unsigned char>(block[i])]++;
+}
+
+// Scales the counts of the sample up to the whole block, then adds one of
+// every byte value so that bytes the sample missed still get a code
+void Huffman::SampleFrequency(const char *block, size_t block_size,
+                              std::vector<int> &freq_array) {
+  // Too small for sampling to save anything
+  if (block_size < 2 * kSampleStride) {
+    CountFrequency(block, block_size, freq_array);
+    return;
+  }
+
+  size_t sample_size = 0;
+  for (size_t i = 0; i < block_size; i += kSampleStride) {
+    size_t size = std::min(kSampleSize, block_size - i);
+    CountFrequency(block + i, size, freq_array);
+    sample_size += size;
+  }
+  for (size_t i = 0; i < freq_array.size(); i++)
+    freq_array[i] = static_cast<int>(static_cast<uint64_t>(freq_array[i]) *
+                                     block_size / sample_size) +
+                    1;
+}
+
+// Block type, size and the bytes themselves
+size_t Huffman::StoredBits(size_t block_size) {
+  return (1 + sizeof(int) + block_size) * CHAR_BIT;
+}
+
+// Whether coding a block in coded_bits, type included, saves less than the
+// margin over storing it
+bool Huffman::ShouldStore(size_t coded_bits, size_t block_size,
+                          const CompressOptions &options) {
+  return coded_bits * 100 >=
+         StoredBits(block_size) * (100 - options.store_margin);
+}
+
+// Expected bits for segments begin to end as one plain Huffman block: the
+// block header with half a byte of padding, a tree of 2n - 1 node bits and
+// n symbols, and the entropy of the bytes, which Huffman codes come close to
+double Huffman::PartCost(const std::vector<size_t> &prefix_freq,
+                         size_t begin, size_t end) {
+  const size_t *low = &prefix_freq[begin * kAlphabetSize];
+  const size_t *high = &prefix_freq[end * kAlphabetSize];
+  size_t total = 0;
+  int num_symbols = 0;
+  double entropy = 0;
+  for (int i = 0; i < kAlphabetSize; i++) {
+    size_t freq = high[i] - low[i];
+    if (!freq)
+      continue;
+    total += freq;
+    num_symbols++;
+    entropy -= freq * std::log2(static_cast<double>(freq));
+  }
+  if (num_symbols > 1)
+    entropy += total * std::log2(static_cast<double>(total));
+  else
+    entropy = 0;
+  return CHAR_BIT + sizeof(int) * CHAR_BIT + CHAR_BIT / 2 +
+         (2 * num_symbols - 1) + num_symbols * CHAR_BIT + entropy;
+}
+
+// Splits segments begin to end in two where that saves the most, then tries
+// the same on both halves
+void Huffman::SplitParts(const std::vector<size_t> &prefix_freq,
+                         size_t begin, size_t end, size_t block_size,
+                         std::vector<size_t> &part_sizes) {
+  double best_cost = PartCost(prefix_freq, begin, end);
+  size_t best_split = begin;
+  for (size_t split = begin + 1; split < end; split++) {
+    double cost = PartCost(prefix_freq, begin, split) +
+                  PartCost(prefix_freq, split, end);
+    if (cost < best_cost) {
+      best_cost = cost;
+      best_split = split;
+    }
+  }
+
+  if (best_split == begin) {
+    part_sizes.push_back(std::min(end * kSplitSegment, block_size) -
+                         begin * kSplitSegment);
+    return;
+  }
+  SplitParts(prefix_freq, begin, best_split, block_size, part_sizes);
+  SplitParts(prefix_freq, best_split, end, block_size, part_sizes);
+}
+
+void Huffman::SplitBlock(const char *block, size_t block_size,
+                         std::vector<size_t> &part_sizes) {
+  part_sizes.clear();
+  size_t num_segments = (block_size + kSplitSegment - 1) / kSplitSegment;
+  if (num_segments < 2) {
+    part_sizes.push_back(block_size);
+    return;
+  }
+
+  // Histograms of the first i segments, so any range is a subtraction away
+  std::vector<size_t> prefix_freq((num_segments + 1) * kAlphabetSize, 0);
+  for (size_t i = 0; i < num_segments; i++) {
+    size_t *freq = &prefix_freq[(i + 1) * kAlphabetSize];
+    std::copy(freq - kAlphabetSize, freq, freq);
+    size_t end = std::min((i + 1) * kSplitSegment, block_size);
+    for (size_t j = i * kSplitSegment; j < end; j++)
+      freq[static_cast<unsigned char>(block[j])]++;
+  }
+  SplitParts(prefix_freq, 0, num_segments, block_size, part_sizes);
 }
 
+template <typename Queue>
 std::unique_ptr<HuffmanNode> Huffman::BuildHuffmanTree(
-    std::array<int, 128> &freq_array) {
-  PQueue<std::unique_ptr<HuffmanNode>, CompareHuffmanNodes> huffman_tree;
+    std::vector<int> &freq_array) {
+  Queue huffman_tree;
   // Add Nodes
-  for (int i = 0; i < 128; i++) {
+  for (size_t i = 0; i < freq_array.size(); i++) {
     if (!freq_array[i])
       continue;
 
     std::unique_ptr<HuffmanNode> node(std::unique_ptr<HuffmanNode>(
-        new HuffmanNode(static_cast<char>(i), freq_array[i])));
-    huffman_tree.Push<HuffmanNode>(std::move(node));
+        new HuffmanNode(static_cast<int>(i), freq_array[i])));
+    huffman_tree.template Push<HuffmanNode>(std::move(node));
   }
 
   // Tree building algorithm
@@ -111,120 +517,985 @@ std::unique_ptr<HuffmanNode> Huffman::BuildHuffmanTree(
     std::swap(node2, huffman_tree.Top());
     huffman_tree.Pop();
 
-    std::unique_ptr<HuffmanNode> internal_node(new HuffmanNode(
-        0, node1->freq() + node2->freq(), std::move(node1), std::move(node2)));
-    huffman_tree.Push<HuffmanNode>(std::move(internal_node));
+    // Sum before the moves, argument evaluation order is unspecified
+    size_t freq = node1->freq() + node2->freq();
+    std::unique_ptr<HuffmanNode> internal_node(
+        new HuffmanNode(0, freq, std::move(node1), std::move(node2)));
+    huffman_tree.template Push<HuffmanNode>(std::move(internal_node));
   }
   assert(huffman_tree.Size() == 1);
 
   return std::move(huffman_tree.Top());
 }
 
-void Huffman::Encoding(HuffmanNode *node,
-                       std::array<std::string, 128> &code_table,
-                       std::string path, std::string &encoded_string) {
+// Left is a 0 and right a 1, appended below the bits of the path so far
+void Huffman::Encoding(HuffmanNode *node, std::vector<PackedCode> &code_table,
+                       uint32_t bits, int length) {
   if (node->IsLeaf()) {
-    code_table[node->data()] = path;
-    encoded_string += '1';
-    encoded_string += static_cast<char>(node->data());
+    code_table[node->data()].bits = bits;
+    code_table[node->data()].length = length;
   } else {
-    encoded_string += '0';
+    // Blocks are small enough that this never happens
+    if (length == 32)
+      throw std::length_error("Huffman code longer than 32 bits");
     if (node->left())
-      Encoding(node->left(), code_table, path + '0', encoded_string);
+      Encoding(node->left(), code_table, bits << 1, length + 1);
     if (node->right())
-      Encoding(node->right(), code_table, path + '1', encoded_string);
+      Encoding(node->right(), code_table, bits << 1 | 1, length + 1);
+  }
+}
+
+// Internal nodes take one bit, leaves take one bit plus the symbol
+size_t Huffman::TreeSize(HuffmanNode *node, int symbol_bits) {
+  if (node->IsLeaf())
+    return 1 + symbol_bits;
+  return 1 + TreeSize(node->left(), symbol_bits) +
+         TreeSize(node->right(), symbol_bits);
+}
+
+// Builds the tree and code table from the counted symbols and returns the
+// number of bits needed for the tree and those symbols
+size_t Huffman::BuildCode(HuffmanCode &code) {
+  code.huffman_tree = BuildHuffmanTree(code.freq_array);
+  Encoding(code.huffman_tree.get(), code.code_table, 0, 0);
+
+  size_t num_bits = TreeSize(code.huffman_tree.get(), code.symbol_bits);
+  for (size_t i = 0; i < code.freq_array.size(); i++)
+    num_bits += static_cast<size_t>(code.freq_array[i]) *
+                code.code_table[i].length;
+  return num_bits;
+}
+
+// Pre-order, a 1 and the symbol for leaves and a 0 for internal nodes
+template <typename BitOutput>
+void Huffman::WriteTree(BitOutput &bos, HuffmanNode *node,
+                        int symbol_bits) {
+  if (node->IsLeaf()) {
+    bos.PutBit(1);
+    bos.PutBits(node->data(), symbol_bits);
+  } else {
+    bos.PutBit(0);
+    WriteTree(bos, node->left(), symbol_bits);
+    WriteTree(bos, node->right(), symbol_bits);
+  }
+}
+
+template <typename BitOutput>
+void Huffman::WriteCode(BitOutput &bos, const PackedCode &code) {
+  bos.PutBits(code.bits, code.length);
+}
+
+// Picks between a new tree, the previous code as is and the changes to the
+// previous code lengths, and updates huffman_bits to match
+BlockType Huffman::PickHuffmanType(const HuffmanCode &code,
+                                   const std::vector<PackedCode> &previous,
+                                   const CompressOptions &options,
+                                   size_t &huffman_bits) {
+  size_t code_bits = 0, reuse_bits = sizeof(int) * CHAR_BIT;
+  bool reusable = true;
+  for (size_t i = 0; i < code.freq_array.size(); i++) {
+    size_t freq = code.freq_array[i];
+    code_bits += freq * code.code_table[i].length;
+    reuse_bits += freq * previous[i].length;
+    // The previous code has to cover every byte in the block
+    if (freq && !previous[i].length)
+      reusable = false;
+  }
+  size_t delta_bits = sizeof(int) * CHAR_BIT +
+                      LengthDeltaSize(previous, code.code_table) + code_bits;
+
+  size_t best_bits = std::min(huffman_bits, delta_bits);
+  if (reusable &&
+      reuse_bits * 100 <= best_bits * (100 + options.reuse_threshold)) {
+    huffman_bits = reuse_bits;
+    return kReusedHuffmanBlock;
+  }
+  if (delta_bits < huffman_bits) {
+    huffman_bits = delta_bits;
+    return kDeltaHuffmanBlock;
+  }
+  return kHuffmanBlock;
+}
+
+// Codes that follow from their lengths alone: shorter codes first, then by
+// symbol, each one more than the one before
+void Huffman::CanonicalCodes(std::vector<PackedCode> &code_table) {
+  uint32_t next = 0;
+  for (int length = 1; length <= 32; length++) {
+    for (size_t i = 0; i < code_table.size(); i++) {
+      if (code_table[i].length == length)
+        code_table[i].bits = next++;
+    }
+    next <<= 1;
+  }
+}
+
+// Sorted by length then symbol, canonical codes are also in lexicographic
+// order, so every subtree is a contiguous range of them
+std::unique_ptr<HuffmanNode> Huffman::CanonicalTree(
+    const std::vector<PackedCode> &code_table) {
+  std::vector<int> symbols;
+  for (int length = 1; length <= 32; length++) {
+    for (size_t i = 0; i < code_table.size(); i++) {
+      if (code_table[i].length == length)
+        symbols.push_back(i);
+    }
+  }
+  return CanonicalNode(code_table, symbols, 0, symbols.size(), 0);
+}
+
+std::unique_ptr<HuffmanNode> Huffman::CanonicalNode(
+    const std::vector<PackedCode> &code_table,
+    const std::vector<int> &symbols, size_t begin, size_t end, int depth) {
+  if (begin == end)
+    throw std::runtime_error("Bad code lengths in zap file");
+  const PackedCode &first = code_table[symbols[begin]];
+  if (end - begin == 1 && first.length == depth)
+    return std::unique_ptr<HuffmanNode>(new HuffmanNode(symbols[begin], 0));
+  if (first.length <= depth)
+    throw std::runtime_error("Bad code lengths in zap file");
+
+  // Codes with a 0 at this depth go left
+  size_t split = begin;
+  while (split < end) {
+    const PackedCode &code = code_table[symbols[split]];
+    if (code.bits >> (code.length - 1 - depth) & 1)
+      break;
+    split++;
+  }
+  std::unique_ptr<HuffmanNode> left =
+      CanonicalNode(code_table, symbols, begin, split, depth + 1);
+  std::unique_ptr<HuffmanNode> right =
+      CanonicalNode(code_table, symbols, split, end, depth + 1);
+  return std::unique_ptr<HuffmanNode>(
+      new HuffmanNode(0, 0, std::move(left), std::move(right)));
+}
+
+// A 0 for every symbol whose length stayed, a 1 and the new length otherwise
+size_t Huffman::LengthDeltaSize(const std::vector<PackedCode> &previous,
+                                const std::vector<PackedCode> &code_table) {
+  size_t num_bits = code_table.size();
+  for (size_t i = 0; i < code_table.size(); i++) {
+    if (code_table[i].length != previous[i].length)
+      num_bits += kLengthBits;
+  }
+  return num_bits;
+}
+
+template <typename BitOutput>
+void Huffman::WriteLengthDelta(BitOutput &bos,
+                               const std::vector<PackedCode> &previous,
+                               const std::vector<PackedCode> &code_table) {
+  for (size_t i = 0; i < code_table.size(); i++) {
+    bool changed = code_table[i].length != previous[i].length;
+    bos.PutBit(changed);
+    if (changed)
+      bos.PutBits(code_table[i].length, kLengthBits);
+  }
+}
+
+// Run lengths are coded as the number of significant bits of the length,
+// which goes through a Huffman tree, followed by the bits below the top one
+int Huffman::LengthClass(size_t run_length) {
+  int length_class = 0;
+  while (run_length) {
+    length_class++;
+    run_length >>= 1;
+  }
+  return length_class;
+}
+
+void Huffman::CountRuns(const char *block, size_t block_size,
+                        std::string &run_chars,
+                        std::vector<size_t> &run_lengths) {
+  size_t i = 0;
+  while (i < block_size) {
+    size_t j = i + 1;
+    while (j < block_size && block[j] == block[i])
+      j++;
+    run_chars += block[i];
+    run_lengths.push_back(j - i);
+    i = j;
+  }
+}
+
+// Writes one block as plain Huffman codes, as Huffman coded runs, as Huffman
+// coded zero-run symbols of its Burrows-Wheeler transform when given one, or
+// as Huffman coded literals and matches when given a level, whichever comes
+// out smaller. Blocks none of these shrink enough are stored as is. Only
+// plain Huffman blocks get sync points inside them, and only they can reuse
+// the code of the plain Huffman block before them
+template <typename BitOutput>
+void Huffman::WriteBlock(BitOutput &bos, const char *block,
+                         size_t block_size, const std::string *bwt,
+                         int primary_index, const CompressOptions &options,
+                         std::vector<SyncPoint> *sync_points,
+                         std::vector<PackedCode> *previous_code) {
+  // With sync points every block has to decode on its own
+  if (!options.reuse_tables || options.sync_interval)
+    previous_code = nullptr;
+
+  HuffmanCode code(kAlphabetSize);
+  if (options.sampled)
+    SampleFrequency(block, block_size, code.freq_array);
+  else
+    CountFrequency(block, block_size, code.freq_array);
+  // Sizes below are exact apart from the block type
+  size_t huffman_bits = sizeof(int) * CHAR_BIT + BuildCode(code);
+  // Lone leaves are never reused, their code is empty
+  BlockType huffman_type = kHuffmanBlock;
+  if (previous_code && !previous_code->empty() &&
+      !code.huffman_tree->IsLeaf())
+    huffman_type =
+        PickHuffmanType(code, *previous_code, options, huffman_bits);
+  size_t best_bits = huffman_bits;
+
+  // Only bother with runs when they are long enough on average to pay off
+  std::string run_chars;
+  std::vector<size_t> run_lengths;
+  CountRuns(block, block_size, run_chars, run_lengths);
+
+  HuffmanCode run_code(kAlphabetSize), class_code(CHAR_BIT * 8);
+  size_t run_bits = SIZE_MAX;
+  if (run_lengths.size() * 2 <= block_size) {
+    CountFrequency(run_chars.data(), run_chars.size(), run_code.freq_array);
+    for (size_t i = 0; i < run_lengths.size(); i++)
+      class_code.freq_array[LengthClass(run_lengths[i])]++;
+
+    run_bits = 2 * sizeof(int) * CHAR_BIT + BuildCode(run_code) +
+               BuildCode(class_code);
+    for (size_t i = 0; i < run_lengths.size(); i++)
+      run_bits += LengthClass(run_lengths[i]) - 1;
+    best_bits = std::min(best_bits, run_bits);
+  }
+
+  // Zero-run symbols need one more bit than a char
+  std::vector<int> bwt_symbols;
+  HuffmanCode bwt_code(kNumZeroRunSymbols, CHAR_BIT + 1);
+  size_t bwt_bits = SIZE_MAX;
+  if (bwt) {
+    std::string mtf = *bwt;
+    BurrowsWheeler::MoveToFront(mtf);
+    BurrowsWheeler::EncodeZeroRuns(mtf, bwt_symbols);
+    for (size_t i = 0; i < bwt_symbols.size(); i++)
+      bwt_code.freq_array[bwt_symbols[i]]++;
+
+    bwt_bits = 3 * sizeof(int) * CHAR_BIT + BuildCode(bwt_code);
+    best_bits = std::min(best_bits, bwt_bits);
+  }
+
+  // Literals and lengths share one alphabet, distances get their own
+  std::vector<Lz77Token> tokens;
+  HuffmanCode literal_code(kNumLiteralSymbols, CHAR_BIT + 1),
+      distance_code(kNumDistanceSymbols, 5);
+  size_t lz77_bits = SIZE_MAX;
+  if (options.lz77_level) {
+    Lz77::FindMatches(block, block_size, options.lz77_level, tokens);
+
+    size_t extra_bits = 0;
+    for (size_t i = 0; i < tokens.size(); i++) {
+      if (!tokens[i].length) {
+        literal_code.freq_array[tokens[i].literal]++;
+        continue;
+      }
+      int length_symbol = Lz77::LengthSymbol(tokens[i].length);
+      int distance_symbol = Lz77::DistanceSymbol(tokens[i].distance);
+      literal_code.freq_array[length_symbol]++;
+      distance_code.freq_array[distance_symbol]++;
+      extra_bits += Lz77::LengthExtraBits(length_symbol) +
+                    Lz77::DistanceExtraBits(distance_symbol);
+    }
+    literal_code.freq_array[kEndOfBlock]++;
+    // The tree needs a leaf even when nothing matched
+    if (std::count(distance_code.freq_array.begin(),
+                   distance_code.freq_array.end(), 0) == kNumDistanceSymbols)
+      distance_code.freq_array[0] = 1;
+
+    lz77_bits = sizeof(int) * CHAR_BIT + BuildCode(literal_code) +
+                BuildCode(distance_code) + extra_bits;
+    best_bits = std::min(best_bits, lz77_bits);
+  }
+
+  // Stored blocks copy straight through on both ends. Either way the size is
+  // known, so the output only has to grow once
+  bool store = ShouldStore(CHAR_BIT + best_bits, block_size, options);
+  bos.Reserve(store ? StoredBits(block_size) : CHAR_BIT + best_bits);
+  if (store) {
+    bos.PutChar(kStoredBlock);
+    bos.PutInt(block_size);
+    bos.PutBytes(block, block_size);
+    return;
+  }
+
+  if (lz77_bits == best_bits) {
+    bos.PutChar(kLz77Block);
+    bos.PutInt(block_size);
+    WriteTree(bos, literal_code.huffman_tree.get(), literal_code.symbol_bits);
+    WriteTree(bos, distance_code.huffman_tree.get(),
+              distance_code.symbol_bits);
+    for (size_t i = 0; i < tokens.size(); i++) {
+      if (!tokens[i].length) {
+        WriteCode(bos, literal_code.code_table[tokens[i].literal]);
+        continue;
+      }
+      int length_symbol = Lz77::LengthSymbol(tokens[i].length);
+      int distance_symbol = Lz77::DistanceSymbol(tokens[i].distance);
+      WriteCode(bos, literal_code.code_table[length_symbol]);
+      bos.PutBits(tokens[i].length - Lz77::LengthBase(length_symbol),
+                  Lz77::LengthExtraBits(length_symbol));
+      WriteCode(bos, distance_code.code_table[distance_symbol]);
+      bos.PutBits(tokens[i].distance - Lz77::DistanceBase(distance_symbol),
+                  Lz77::DistanceExtraBits(distance_symbol));
+    }
+    WriteCode(bos, literal_code.code_table[kEndOfBlock]);
+    return;
+  }
+
+  if (bwt_bits == best_bits) {
+    bos.PutChar(kBwtBlock);
+    bos.PutInt(block_size);
+    bos.PutInt(primary_index);
+    bos.PutInt(bwt_symbols.size());
+    WriteTree(bos, bwt_code.huffman_tree.get(), bwt_code.symbol_bits);
+    for (size_t i = 0; i < bwt_symbols.size(); i++)
+      WriteCode(bos, bwt_code.code_table[bwt_symbols[i]]);
+    return;
+  }
+
+  if (run_bits == best_bits) {
+    bos.PutChar(kRunLengthBlock);
+    bos.PutInt(block_size);
+    bos.PutInt(run_lengths.size());
+    WriteTree(bos, run_code.huffman_tree.get(), CHAR_BIT);
+    WriteTree(bos, class_code.huffman_tree.get(), CHAR_BIT);
+    for (size_t i = 0; i < run_lengths.size(); i++) {
+      int length_class = LengthClass(run_lengths[i]);
+      WriteCode(bos, run_code.code_table[static_cast<unsigned char>(
+                         run_chars[i])]);
+      WriteCode(bos, class_code.code_table[length_class]);
+      // The top bit is implied by the class
+      bos.PutBits(run_lengths[i], length_class - 1);
+    }
+    return;
   }
+
+  bos.PutChar(huffman_type);
+  if (huffman_type == kHuffmanBlock) {
+    // Write encoded tree
+    WriteTree(bos, code.huffman_tree.get(), CHAR_BIT);
+  } else if (huffman_type == kDeltaHuffmanBlock) {
+    // Only the lengths are sent, so the codes have to follow from them
+    WriteLengthDelta(bos, *previous_code, code.code_table);
+    CanonicalCodes(code.code_table);
+  }
+  // Write number of characters
+  bos.PutInt(block_size);
+  // Write encoded characters, a lone leaf has an empty code
+  if (code.huffman_tree->IsLeaf())
+    return;
+
+  if (previous_code && huffman_type != kReusedHuffmanBlock)
+    *previous_code = code.code_table;
+  const std::vector<PackedCode> &code_table =
+      previous_code ? *previous_code : code.code_table;
+
+  // The kernel gathers bits and lengths from separate 32-bit tables
+  uint32_t codes[kAlphabetSize], lengths[kAlphabetSize];
+  int max_length = 0;
+  for (int i = 0; i < kAlphabetSize; i++) {
+    codes[i] = code_table[i].bits;
+    lengths[i] = code_table[i].length;
+    max_length = std::max(max_length, static_cast<int>(lengths[i]));
+  }
+
+  // The codes start after the block type, tree and count
+  if (options.sync_interval && sync_points) {
+    size_t bits = CHAR_BIT + TreeSize(code.huffman_tree.get(), CHAR_BIT) +
+                  sizeof(int) * CHAR_BIT;
+    for (size_t i = 0; i < block_size; i++) {
+      if (i && i % options.sync_interval == 0) {
+        SyncPoint sync = {i, 0, static_cast<uint32_t>(i),
+                          static_cast<uint32_t>(bits)};
+        sync_points->push_back(sync);
+      }
+      bits += lengths[static_cast<unsigned char>(block[i])];
+    }
+  }
+  EncodeKernel::Encode(bos, block, block_size, codes, lengths, max_length);
 }
 
-std::unique_ptr<HuffmanNode> Huffman::MakeNode(BinaryInputStream &bis) {
+template <typename BitInput>
+std::unique_ptr<HuffmanNode> Huffman::MakeNode(BitInput &bis, int symbol_bits,
+                                               int depth, size_t &num_nodes) {
+  // A corrupt tree could otherwise nest deep enough to overflow the stack
+  if (++num_nodes > MaxTreeNodes(symbol_bits) || depth >= 1 << symbol_bits)
+    throw std::runtime_error("Bad Huffman tree in zap file");
   bool cur_bit = bis.GetBit();
-  if (cur_bit)
+  if (cur_bit) {
     // Character node
-    return std::unique_ptr<HuffmanNode>(new HuffmanNode(bis.GetChar(), 0));
-  else
-    // Internal node with next two nodes as its left and right children
-    return std::unique_ptr<HuffmanNode>(
-        new HuffmanNode(0, 0, MakeNode(bis), MakeNode(bis)));
+    int ch = bis.GetBits(symbol_bits);
+    return std::unique_ptr<HuffmanNode>(new HuffmanNode(ch, 0));
+  }
+  // Internal node with next two nodes as its left and right children.
+  // Children are built in order since argument evaluation order is
+  // unspecified
+  std::unique_ptr<HuffmanNode> left =
+      MakeNode(bis, symbol_bits, depth + 1, num_nodes);
+  std::unique_ptr<HuffmanNode> right =
+      MakeNode(bis, symbol_bits, depth + 1, num_nodes);
+  return std::unique_ptr<HuffmanNode>(
+      new HuffmanNode(0, 0, std::move(left), std::move(right)));
 }
 
-std::unique_ptr<HuffmanNode> Huffman::RebuildTree(BinaryInputStream &bis) {
-  if (bis.GetBit())
-    // If only one unique character, no internal node
-    return std::unique_ptr<HuffmanNode>(new HuffmanNode(bis.GetChar(), 0));
-  else
-    // Root will always be internal node otherwise
-    return std::unique_ptr<HuffmanNode>(
-        new HuffmanNode(0, 0, MakeNode(bis), MakeNode(bis)));
+template <typename BitInput>
+std::unique_ptr<HuffmanNode> Huffman::RebuildTree(BitInput &bis,
+                                                  int symbol_bits) {
+  // If only one unique character, the root is the leaf itself, otherwise the
+  // root will always be an internal node
+  size_t num_nodes = 0;
+  return MakeNode(bis, symbol_bits, 0, num_nodes);
+}
+
+// Copies the bits of a tree to header, after its symbol size, without
+// building it. Returns the number of nodes
+template <typename BitInput>
+size_t Huffman::ScanTree(BitInput &bis, int symbol_bits,
+                         std::string &header) {
+  header.assign(1, static_cast<char>(symbol_bits));
+  BasicBinaryOutputStream<StringSink> bos(header);
+  // Every internal node adds a pending node, every leaf takes one away
+  size_t num_nodes = 0;
+  for (size_t pending = 1; pending; num_nodes++) {
+    if (num_nodes == MaxTreeNodes(symbol_bits))
+      throw std::runtime_error("Bad Huffman tree in zap file");
+    if (bis.GetBit()) {
+      bos.PutBit(1);
+      bos.PutBits(bis.GetBits(symbol_bits), symbol_bits);
+      pending--;
+    } else {
+      bos.PutBit(0);
+      pending++;
+    }
+  }
+  return num_nodes;
+}
+
+template <typename BitInput>
+void Huffman::BlockSymbols(BitInput &bis, unsigned char block_type,
+                           std::bitset<1 << CHAR_BIT> &symbols) {
+  // Run-length blocks only repeat the chars of their runs, and LZ77 blocks
+  // only copy their own literals
+  int symbol_bits;
+  if (block_type == kHuffmanBlock) {
+    symbol_bits = CHAR_BIT;
+  } else if (block_type == kRunLengthBlock) {
+    bis.GetInt();
+    bis.GetInt();
+    symbol_bits = CHAR_BIT;
+  } else if (block_type == kLz77Block) {
+    bis.GetInt();
+    symbol_bits = CHAR_BIT + 1;
+  } else {
+    symbols.set();
+    return;
+  }
+
+  // The leaves of the first tree, walked like ScanTree
+  symbols.reset();
+  for (size_t pending = 1, num_nodes = 0; pending; num_nodes++) {
+    if (num_nodes == MaxTreeNodes(symbol_bits))
+      throw std::runtime_error("Bad Huffman tree in zap file");
+    if (bis.GetBit()) {
+      unsigned symbol = bis.GetBits(symbol_bits);
+      if (symbol < symbols.size())
+        symbols.set(symbol);
+      pending--;
+    } else {
+      pending++;
+    }
+  }
+}
+
+template <typename BitInput>
+std::shared_ptr<HuffmanNode> Huffman::ReadTree(BitInput &bis,
+                                               int symbol_bits) {
+  TreeCache &cache = TreeCache::Instance();
+  if (!cache.Capacity())
+    return RebuildTree(bis, symbol_bits);
+
+  std::string header;
+  size_t num_nodes = ScanTree(bis, symbol_bits, header);
+  std::shared_ptr<HuffmanNode> tree = cache.Find(header);
+  if (!tree) {
+    BasicBinaryInputStream<MemorySource> header_bis(header.data() + 1,
+                                                    header.size() - 1);
+    tree = RebuildTree(header_bis, symbol_bits);
+    cache.Insert(header, tree, num_nodes * sizeof(HuffmanNode));
+  }
+  return tree;
+}
+
+template <typename BitInput>
+int Huffman::ReadSymbol(BitInput &bis, HuffmanNode *huffman_tree) {
+  HuffmanNode *cur_node = huffman_tree;
+
+  while (!cur_node->IsLeaf()) {
+    if (bis.GetBit())
+      cur_node = cur_node->right();
+    else
+      cur_node = cur_node->left();
+  }
+  return cur_node->data();
 }
 
-void Huffman::WriteEncodedString(BinaryInputStream &bis, std::ofstream &ofs,
+template <typename BitInput>
+void Huffman::WriteEncodedString(BitInput &bis, std::string &output,
                                  HuffmanNode *huffman_tree) {
   // Get number of encoded characters
   int num_chars = bis.GetInt();
 
-  // Write characters to output file
-  for (int i = 0; i < num_chars; i++) {
-    HuffmanNode *cur_node = huffman_tree;
+  // A lone leaf has no bits to read, the block is just a single character
+  if (huffman_tree->IsLeaf()) {
+    output.append(num_chars, static_cast<char>(huffman_tree->data()));
+    return;
+  }
+
+  // Write characters to output buffer
+  output.reserve(output.size() + num_chars);
+  for (int i = 0; i < num_chars; i++)
+    output += static_cast<char>(ReadSymbol(bis, huffman_tree));
+}
 
-    while (!cur_node->IsLeaf()) {
-      if (bis.GetBit())
-        cur_node = cur_node->right();
-      else
-        cur_node = cur_node->left();
+template <typename BitInput>
+void Huffman::WriteRunLengths(BitInput &bis, std::string &output) {
+  int num_chars = bis.GetInt();
+  int num_runs = bis.GetInt();
+  std::shared_ptr<HuffmanNode> run_tree = ReadTree(bis);
+  std::shared_ptr<HuffmanNode> class_tree = ReadTree(bis);
+
+  output.reserve(output.size() + num_chars);
+  for (int i = 0; i < num_runs; i++) {
+    char ch = static_cast<char>(ReadSymbol(bis, run_tree.get()));
+    int length_class = ReadSymbol(bis, class_tree.get());
+    size_t run_length = 1;
+    for (int j = 0; j < length_class - 1; j++)
+      run_length = run_length << 1 | bis.GetBit();
+    output.append(run_length, ch);
+  }
+}
+
+template <typename BitInput>
+void Huffman::WriteBwtSymbols(BitInput &bis, std::string &output) {
+  int num_chars = bis.GetInt();
+  int primary_index = bis.GetInt();
+  int num_symbols = bis.GetInt();
+  CheckBwtHeader(num_chars, primary_index, num_symbols);
+  std::shared_ptr<HuffmanNode> bwt_tree = ReadTree(bis, CHAR_BIT + 1);
+
+  std::vector<int> bwt_symbols(num_symbols);
+  for (int i = 0; i < num_symbols; i++)
+    bwt_symbols[i] = ReadSymbol(bis, bwt_tree.get());
+  InverseBwt(bwt_symbols, num_chars, primary_index, output);
+}
+
+void Huffman::CheckBwtHeader(int num_chars, int primary_index,
+                             int num_symbols) {
+  // A zero run never takes more symbols than it has bytes, and the sentinel
+  // makes num_chars + 1 rows
+  if (num_chars < 0 || static_cast<size_t>(num_chars) > kBlockSize ||
+      num_symbols <= 0 || num_symbols > num_chars || primary_index < 0 ||
+      primary_index > num_chars)
+    throw std::runtime_error("Bad Burrows-Wheeler block in zap file");
+}
+
+void Huffman::InverseBwt(const std::vector<int> &symbols, int num_chars,
+                         int primary_index, std::string &output) {
+  std::string bwt, block;
+  bwt.reserve(num_chars);
+  if (!BurrowsWheeler::DecodeZeroRuns(symbols, num_chars, bwt) ||
+      bwt.size() != static_cast<size_t>(num_chars))
+    throw std::runtime_error("Bad Burrows-Wheeler block in zap file");
+  BurrowsWheeler::InverseMoveToFront(bwt);
+  BurrowsWheeler::Inverse(bwt, primary_index, block);
+  output += block;
+}
+
+template <typename BitInput>
+void Huffman::WriteLz77Tokens(BitInput &bis, std::string &output) {
+  int num_chars = bis.GetInt();
+  if (num_chars < 0 || static_cast<size_t>(num_chars) > kBlockSize)
+    throw std::runtime_error("Bad LZ77 block in zap file");
+  std::shared_ptr<HuffmanNode> literal_tree = ReadTree(bis, CHAR_BIT + 1);
+  std::shared_ptr<HuffmanNode> distance_tree = ReadTree(bis, 5);
+
+  // Matches only reach back within the block, and nothing goes past its end
+  size_t block_start = output.size(), block_end = block_start + num_chars;
+  output.reserve(block_end);
+  while (true) {
+    int symbol = ReadSymbol(bis, literal_tree.get());
+    if (symbol < kEndOfBlock) {
+      if (output.size() == block_end)
+        throw std::runtime_error("Bad LZ77 block in zap file");
+      output += static_cast<char>(symbol);
+      continue;
+    }
+    if (symbol == kEndOfBlock) {
+      if (output.size() != block_end)
+        throw std::runtime_error("Bad LZ77 block in zap file");
+      break;
     }
-    ofs << static_cast<char>(cur_node->data());
+
+    // The trees can hold symbols past the ends of the tables
+    if (symbol >= kNumLiteralSymbols)
+      throw std::runtime_error("Bad LZ77 symbol in zap file");
+    int length =
+        Lz77::LengthBase(symbol) + bis.GetBits(Lz77::LengthExtraBits(symbol));
+    int distance_symbol = ReadSymbol(bis, distance_tree.get());
+    if (distance_symbol >= kNumDistanceSymbols)
+      throw std::runtime_error("Bad LZ77 symbol in zap file");
+    size_t distance = Lz77::DistanceBase(distance_symbol) +
+                      bis.GetBits(Lz77::DistanceExtraBits(distance_symbol));
+    if (distance > output.size() - block_start)
+      throw std::runtime_error("Match distance before start of block");
+    if (static_cast<size_t>(length) > block_end - output.size())
+      throw std::runtime_error("Bad LZ77 block in zap file");
+
+    // Byte at a time since the match may overlap what it produces
+    size_t from = output.size() - distance;
+    for (int i = 0; i < length; i++)
+      output += output[from + i];
   }
 }
 
-void Huffman::Compress(std::ifstream &ifs, std::ofstream &ofs) {
-  std::string file_contents;
-  std::array<int, 128> freq_array = {0};
-  std::string encoded_tree;
-  std::array<std::string, 128> code_table = {""};
+template <typename BitInput>
+void Huffman::WriteStoredBytes(BitInput &bis, std::string &output) {
+  int num_chars = bis.GetInt();
+  size_t block_start = output.size();
+  output.resize(block_start + num_chars);
+  bis.GetBytes(&output[block_start], num_chars);
+}
 
-  // Read data into string (taken from website given)
-  file_contents = std::string(std::istreambuf_iterator<char>(ifs),
-                              std::istreambuf_iterator<char>());
-  // Gather necessary data
-  CountFrequency(file_contents, freq_array);
-  std::unique_ptr<HuffmanNode> huffman_tree = BuildHuffmanTree(freq_array);
-  Encoding(huffman_tree.get(), code_table, "", encoded_tree);
+// Applies the changed lengths to the lengths of the previous tree
+template <typename BitInput>
+std::unique_ptr<HuffmanNode> Huffman::ReadDeltaTree(
+    BitInput &bis, HuffmanNode *previous_tree) {
+  std::vector<PackedCode> code_table(kAlphabetSize, PackedCode());
+  Encoding(previous_tree, code_table, 0, 0);
+  for (int i = 0; i < kAlphabetSize; i++) {
+    if (bis.GetBit())
+      code_table[i].length = bis.GetBits(kLengthBits);
+  }
+  CanonicalCodes(code_table);
+  return CanonicalTree(code_table);
+}
 
-  // Write to file (not in a function to not have to pass so many parameters)
-  BinaryOutputStream bos(ofs);
-  // Write encoded tree
-  for (size_t i = 0; i < encoded_tree.size(); i++) {
-    if (encoded_tree[i] == '0') {
-      bos.PutBit(0);
-    } else {
-      bos.PutBit(1);
-      bos.PutChar(encoded_tree[++i]);
+template <typename BitInput>
+void Huffman::ReadBlock(BitInput &bis, unsigned char block_type,
+                        std::string &output,
+                        std::shared_ptr<HuffmanNode> &previous_tree) {
+  if (block_type == kHuffmanBlock) {
+    // Rebuild tree
+    std::shared_ptr<HuffmanNode> huffman_tree = ReadTree(bis);
+    WriteEncodedString(bis, output, huffman_tree.get());
+    if (!huffman_tree->IsLeaf())
+      previous_tree = std::move(huffman_tree);
+  } else if (block_type == kReusedHuffmanBlock ||
+             block_type == kDeltaHuffmanBlock) {
+    if (!previous_tree)
+      throw std::runtime_error("No Huffman tree to reuse in zap file");
+    if (block_type == kDeltaHuffmanBlock)
+      previous_tree = ReadDeltaTree(bis, previous_tree.get());
+    WriteEncodedString(bis, output, previous_tree.get());
+  } else if (block_type == kRunLengthBlock) {
+    WriteRunLengths(bis, output);
+  } else if (block_type == kBwtBlock) {
+    WriteBwtSymbols(bis, output);
+  } else if (block_type == kLz77Block) {
+    WriteLz77Tokens(bis, output);
+  } else if (block_type == kStoredBlock) {
+    WriteStoredBytes(bis, output);
+  } else if (block_type == kFilteredBlock) {
+    ReadFilteredBlock(bis, output, previous_tree);
+  } else {
+    throw std::runtime_error("Unknown block type in zap file");
+  }
+  bis.Align();
+}
+
+template <typename BitInput>
+void Huffman::ReadFilteredBlock(BitInput &bis, std::string &output,
+                                std::shared_ptr<HuffmanNode> &previous_tree) {
+  int filter = static_cast<unsigned char>(bis.GetChar());
+  int block_size = bis.GetInt();
+  if (!Filter::Valid(filter) || block_size < 0 ||
+      static_cast<size_t>(block_size) > kBlockSize)
+    throw std::runtime_error("Bad filtered block in zap file");
+
+  size_t start = output.size();
+  while (output.size() - start < static_cast<size_t>(block_size)) {
+    unsigned char block_type = bis.GetChar();
+    if (block_type == kFilteredBlock || block_type == kEndOfStream)
+      throw std::runtime_error("Bad filtered block in zap file");
+    ReadBlock(bis, block_type, output, previous_tree);
+  }
+  if (output.size() - start != static_cast<size_t>(block_size))
+    throw std::runtime_error("Bad filtered block in zap file");
+  Filter::Invert(filter, &output[start], block_size);
+}
+
+template <typename BitOutput>
+void Huffman::CompressBlock(BitOutput &bos, const char *block,
+                            size_t block_size,
+                            const CompressOptions &options,
+                            std::vector<SyncPoint> *sync_points,
+                            std::vector<PackedCode> *previous_code) {
+  // The filtered bytes are coded as usual behind a header. Only the start of
+  // the block can be a sync point, the bytes inside depend on those before
+  if (options.filter && block_size) {
+    std::string filtered;
+    Filter::Apply(options.filter, block, block_size, filtered);
+    if (options.sync_interval && sync_points) {
+      SyncPoint block_start = {0, 0, 0, 0};
+      sync_points->push_back(block_start);
     }
+    bos.PutChar(kFilteredBlock);
+    bos.PutChar(static_cast<char>(options.filter));
+    bos.PutInt(block_size);
+
+    CompressOptions inner_options = options;
+    inner_options.filter = 0;
+    inner_options.sync_interval = 0;
+    CompressBlock(bos, filtered.data(), block_size, inner_options, nullptr,
+                  options.sync_interval ? nullptr : previous_code);
+    return;
   }
-  // Write number of characters
-  bos.PutInt(file_contents.size());
-  // Write encoded characters
-  for (size_t i = 0; i < file_contents.size(); i++) {
-    char cur_char = file_contents[i];
-    std::string compressed_char = code_table[cur_char];
-    for (size_t j = 0; j < compressed_char.size(); j++) {
-      if (compressed_char[j] == '0')
-        bos.PutBit(0);
-      else
-        bos.PutBit(1);
+
+  std::vector<size_t> part_sizes;
+  if (options.split_blocks)
+    SplitBlock(block, block_size, part_sizes);
+  if (part_sizes.size() < 2) {
+    CompressPart(bos, block, block_size, options, sync_points, previous_code);
+    return;
+  }
+
+  // Code the parts apart to learn where each one starts for its sync points
+  size_t offset = 0;
+  uint64_t coded_offset = 0;
+  for (size_t i = 0; i < part_sizes.size(); i++) {
+    std::string coded;
+    std::vector<SyncPoint> part_sync_points;
+    {
+      BasicBinaryOutputStream<StringSink> part_bos(coded);
+      CompressPart(part_bos, block + offset, part_sizes[i], options,
+                   &part_sync_points, previous_code);
     }
+    if (sync_points) {
+      for (size_t j = 0; j < part_sync_points.size(); j++) {
+        SyncPoint sync = part_sync_points[j];
+        sync.offset += offset;
+        sync.block_offset += coded_offset;
+        sync_points->push_back(sync);
+      }
+    }
+    bos.PutBytes(coded.data(), coded.size());
+    offset += part_sizes[i];
+    coded_offset += coded.size();
+  }
+}
+
+template <typename BitOutput>
+void Huffman::CompressPart(BitOutput &bos, const char *block,
+                           size_t block_size, const CompressOptions &options,
+                           std::vector<SyncPoint> *sync_points,
+                           std::vector<PackedCode> *previous_code) {
+  std::string bwt;
+  int primary_index = 0;
+  if (options.bwt)
+    BurrowsWheeler::Transform(block, block_size, bwt, primary_index);
+  if (options.sync_interval && sync_points) {
+    SyncPoint block_start = {0, 0, 0, 0};
+    sync_points->push_back(block_start);
   }
+  WriteBlock(bos, block, block_size, options.bwt ? &bwt : nullptr,
+             primary_index, options, sync_points, previous_code);
+  bos.Align();
+}
+
+template <typename BitOutput>
+void Huffman::EndStream(BitOutput &bos) {
+  bos.PutChar(static_cast<char>(kEndOfStream));
+}
+
+template <typename BitOutput>
+void Huffman::Compress(const std::string &file_contents, BitOutput &bos,
+                       const CompressOptions &options) {
+  std::vector<std::string> bwt_blocks;
+  std::vector<int> primary_indices;
+  size_t max_block_size = BlockSize(options);
+
+  // The transform dominates, so do all blocks up front in parallel. Split
+  // and filtered blocks transform each part as it comes instead
+  bool by_parts = options.split_blocks || options.filter;
+  if (options.bwt && !by_parts)
+    BurrowsWheeler::TransformBlocks(file_contents, max_block_size, bwt_blocks,
+                                    primary_indices);
+
+  // Write one block at a time, each with its own tree or the one before
+  std::vector<PackedCode> previous_code;
+  for (size_t i = 0; i < file_contents.size(); i += max_block_size) {
+    size_t block_size = std::min(max_block_size, file_contents.size() - i);
+    size_t block_index = i / max_block_size;
+    if (by_parts)
+      CompressBlock(bos, file_contents.data() + i, block_size, options,
+                    nullptr, &previous_code);
+    else if (options.bwt)
+      WriteBlock(bos, file_contents.data() + i, block_size,
+                 &bwt_blocks[block_index], primary_indices[block_index],
+                 options, nullptr, &previous_code);
+    else
+      WriteBlock(bos, file_contents.data() + i, block_size, nullptr, 0,
+                 options, nullptr, &previous_code);
+    bos.Align();
+  }
+  EndStream(bos);
 
   bos.Close();
 }
 
+template <typename BitInput, typename Sink>
+void Huffman::Decompress(BitInput &bis, Sink &sink) {
+  std::string output;
+  std::shared_ptr<HuffmanNode> previous_tree;
+
+  while (true) {
+    unsigned char block_type = bis.GetChar();
+    if (block_type == kEndOfStream)
+      break;
+
+    output.clear();
+    ReadBlock(bis, block_type, output, previous_tree);
+    // Write to sink
+    sink.Write(output.data(), output.size());
+  }
+  sink.Flush();
+}
+
+size_t Huffman::EstimateSize(const char *input, size_t input_size,
+                             const CompressOptions &options) {
+  // The end of stream marker
+  size_t num_bytes = 1;
+  size_t max_block_size = BlockSize(options);
+  std::vector<size_t> part_sizes;
+  std::string filtered;
+  for (size_t i = 0; i < input_size; i += max_block_size) {
+    size_t block_size = std::min(max_block_size, input_size - i);
+    const char *block = input + i;
+    // Filtered blocks cost their type, filter and size on top
+    if (options.filter) {
+      Filter::Apply(options.filter, block, block_size, filtered);
+      block = filtered.data();
+      num_bytes += 2 + sizeof(int);
+    }
+    part_sizes.assign(1, block_size);
+    if (options.split_blocks)
+      SplitBlock(block, block_size, part_sizes);
+
+    const char *part = block;
+    for (size_t j = 0; j < part_sizes.size(); part += part_sizes[j++]) {
+      HuffmanCode code(kAlphabetSize);
+      if (options.sampled)
+        SampleFrequency(part, part_sizes[j], code.freq_array);
+      else
+        CountFrequency(part, part_sizes[j], code.freq_array);
+
+      size_t part_bits = CHAR_BIT + sizeof(int) * CHAR_BIT + BuildCode(code);
+      if (ShouldStore(part_bits, part_sizes[j], options))
+        part_bits = StoredBits(part_sizes[j]);
+      num_bytes += (part_bits + CHAR_BIT - 1) / CHAR_BIT;
+    }
+  }
+  return num_bytes;
+}
+
+template <typename BitInput>
+void Huffman::DecompressRange(BitInput &bis, const SyncPoint &sync,
+                              size_t skip, size_t length,
+                              std::string &output) {
+  // Ranges running past the end of what size_t can count end there, so that
+  // skip + length cannot wrap
+  length = std::min<uint64_t>(length, SIZE_MAX - skip);
+  std::string decoded;
+  // Streams with sync points never reuse trees, this only guards against
+  // corrupt ones
+  std::shared_ptr<HuffmanNode> previous_tree;
+
+  // Inside a block, read its tree and count and jump over the codes before
+  // the sync point
+  if (sync.bit_skip) {
+    if (static_cast<unsigned char>(bis.GetChar()) != kHuffmanBlock)
+      throw std::runtime_error("Sync point inside a non-Huffman block");
+    std::shared_ptr<HuffmanNode> huffman_tree = ReadTree(bis);
+    int num_chars = bis.GetInt();
+    size_t header_bits = CHAR_BIT +
+                         TreeSize(huffman_tree.get(), CHAR_BIT) +
+                         sizeof(int) * CHAR_BIT;
+    if (sync.bit_skip < header_bits ||
+        sync.block_skip > static_cast<uint32_t>(num_chars))
+      throw std::runtime_error("Sync point out of its block");
+    size_t bits = sync.bit_skip - header_bits;
+    for (; bits >= 32; bits -= 32)
+      bis.GetBits(32);
+    bis.GetBits(bits);
+
+    // Only decode what the range needs, the rest of the block is skipped
+    size_t wanted = skip + length;
+    for (int i = sync.block_skip; i < num_chars && decoded.size() < wanted;
+         i++)
+      decoded += static_cast<char>(ReadSymbol(bis, huffman_tree.get()));
+    if (decoded.size() < wanted)
+      bis.Align();
+  }
+
+  // Whole blocks from here on
+  while (decoded.size() < skip + length) {
+    unsigned char block_type = bis.GetChar();
+    if (block_type == kEndOfStream)
+      break;
+    ReadBlock(bis, block_type, decoded, previous_tree);
+  }
+
+  if (skip < decoded.size())
+    output.append(decoded, skip, length);
+}
+
+void Huffman::Compress(std::ifstream &ifs, std::ofstream &ofs,
+                       const CompressOptions &options) {
+  std::string file_contents;
+
+  // Read data into string (taken from website given)
+  file_contents = std::string(std::istreambuf_iterator<char>(ifs),
+                              std::istreambuf_iterator<char>());
+
+  BinaryOutputStream bos(ofs);
+  Compress(file_contents, bos, options);
+}
+
 void Huffman::Decompress(std::ifstream &ifs, std::ofstream &ofs) {
   BinaryInputStream bis(ifs);
+  OstreamSink sink(ofs);
+  Decompress(bis, sink);
+}
+
+void Huffman::Compress(const std::string &input, std::string &output,
+                       const CompressOptions &options) {
+  BasicBinaryOutputStream<StringSink> bos(output);
+  Compress(input, bos, options);
+}
 
-  // Rebuild tree
-  std::unique_ptr<HuffmanNode> huffman_tree = RebuildTree(bis);
-  // Write to file
-  WriteEncodedString(bis, ofs, huffman_tree.get());
+void Huffman::Decompress(const std::string &input, std::string &output) {
+  BasicBinaryInputStream<MemorySource> bis(input);
+  StringSink sink(output);
+  Decompress(bis, sink);
 }
 
 #endif  // HUFFMAN_H_
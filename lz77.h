@@ -0,0 +1,194 @@
+#ifndef LZ77_H_
+#define LZ77_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Symbols of the literal/length alphabet, laid out as in deflate. Literals
+// take 0 to 255, then come the end of block and the length codes
+enum Lz77Symbol {
+  kEndOfBlock = 256,
+  kFirstLengthSymbol = 257,
+  kNumLiteralSymbols = 286,
+  kNumDistanceSymbols = 30,
+};
+
+// Either a literal (length 0) or a match of length bytes starting distance
+// bytes back
+struct Lz77Token {
+  int length;
+  int distance;
+  unsigned char literal;
+};
+
+class Lz77 {
+ public:
+  static const int kMinMatch = 3;
+  static const int kMaxMatch = 258;
+  static const int kWindowSize = 1 << 15;
+  static const int kMinLevel = 1;
+  static const int kMaxLevel = 9;
+
+  // Parses a block into literals and matches, higher levels search longer
+  // hash chains and look one byte ahead before taking a match
+  static void FindMatches(const char *block, size_t block_size, int level,
+                          std::vector<Lz77Token> &tokens);
+
+  // Map lengths and distances to their symbol, the remainder goes into
+  // ExtraBits() raw bits
+  static int LengthSymbol(int length);
+  static int DistanceSymbol(int distance);
+  static int LengthExtraBits(int symbol) {
+    return kLengthExtra[symbol - kFirstLengthSymbol];
+  }
+  static int LengthBase(int symbol) {
+    return kLengthBase[symbol - kFirstLengthSymbol];
+  }
+  static int DistanceExtraBits(int symbol) { return kDistanceExtra[symbol]; }
+  static int DistanceBase(int symbol) { return kDistanceBase[symbol]; }
+
+ private:
+  static const int kHashBits = 15;
+  static const int kLengthBase[29];
+  static const int kLengthExtra[29];
+  static const int kDistanceBase[30];
+  static const int kDistanceExtra[30];
+
+  // Search effort per level: hash chain links followed, the match length
+  // that ends the search early and whether to try a lazy match
+  struct LevelConfig {
+    int max_chain;
+    int nice_length;
+    bool lazy;
+  };
+  static const LevelConfig kLevels[kMaxLevel + 1];
+
+  static size_t Hash(const char *block, size_t pos);
+  static int LongestMatch(const char *block, size_t block_size, size_t pos,
+                          const std::vector<int> &head,
+                          const std::vector<int> &prev,
+                          const LevelConfig &config, int &distance);
+};
+
+const int Lz77::kLengthBase[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                   15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                   67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int Lz77::kLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                    1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                    4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int Lz77::kDistanceBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,    25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513,   769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+const int Lz77::kDistanceExtra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                      4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                      9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const Lz77::LevelConfig Lz77::kLevels[kMaxLevel + 1] = {
+    {0, 0, false},      {4, 8, false},     {8, 16, false},
+    {16, 32, false},    {16, 32, true},    {32, 64, true},
+    {128, 128, true},   {256, 258, true},  {1024, 258, true},
+    {4096, 258, true},
+};
+
+int Lz77::LengthSymbol(int length) {
+  // The last base is 258 alone, otherwise find the last base <= length
+  int i = std::upper_bound(kLengthBase, kLengthBase + 28, length) -
+          kLengthBase - 1;
+  if (length == kMaxMatch)
+    i = 28;
+  return kFirstLengthSymbol + i;
+}
+
+int Lz77::DistanceSymbol(int distance) {
+  return std::upper_bound(kDistanceBase, kDistanceBase + 30, distance) -
+         kDistanceBase - 1;
+}
+
+size_t Lz77::Hash(const char *block, size_t pos) {
+  size_t h = static_cast<unsigned char>(block[pos]) << 10 ^
+             static_cast<unsigned char>(block[pos + 1]) << 5 ^
+             static_cast<unsigned char>(block[pos + 2]);
+  return (h * 2654435761u) >> (32 - kHashBits) & ((1 << kHashBits) - 1);
+}
+
+int Lz77::LongestMatch(const char *block, size_t block_size, size_t pos,
+                       const std::vector<int> &head,
+                       const std::vector<int> &prev,
+                       const LevelConfig &config, int &distance) {
+  int max_length = std::min<size_t>(kMaxMatch, block_size - pos);
+  int best_length = 0;
+  int candidate = head[Hash(block, pos)];
+
+  for (int chain = 0; candidate >= 0 && chain < config.max_chain; chain++) {
+    if (pos - candidate > static_cast<size_t>(kWindowSize))
+      break;
+
+    // Only a candidate that extends the best match so far can win
+    if (block[candidate + best_length] == block[pos + best_length]) {
+      int length = 0;
+      while (length < max_length &&
+             block[candidate + length] == block[pos + length])
+        length++;
+      if (length > best_length) {
+        best_length = length;
+        distance = pos - candidate;
+        if (length >= config.nice_length || length == max_length)
+          break;
+      }
+    }
+    candidate = prev[candidate & (kWindowSize - 1)];
+  }
+  return best_length;
+}
+
+void Lz77::FindMatches(const char *block, size_t block_size, int level,
+                       std::vector<Lz77Token> &tokens) {
+  const LevelConfig &config = kLevels[level];
+  // Most recent position per hash and the previous one with the same hash
+  std::vector<int> head(1 << kHashBits, -1), prev(kWindowSize, -1);
+
+  size_t pos = 0, inserted = 0;
+  // Links every position before end into the hash chains
+  auto insert_up_to = [&](size_t end) {
+    for (; inserted < end && inserted + kMinMatch <= block_size; inserted++) {
+      size_t h = Hash(block, inserted);
+      prev[inserted & (kWindowSize - 1)] = head[h];
+      head[h] = inserted;
+    }
+    inserted = std::max(inserted, end);
+  };
+
+  while (pos < block_size) {
+    int length = 0, distance = 0;
+    if (pos + kMinMatch <= block_size)
+      length = LongestMatch(block, block_size, pos, head, prev, config,
+                            distance);
+
+    // Emit a literal instead if the next position has a longer match
+    if (length >= kMinMatch && config.lazy && length < config.nice_length &&
+        pos + 1 + kMinMatch <= block_size) {
+      insert_up_to(pos + 1);
+      int next_distance = 0;
+      int next_length = LongestMatch(block, block_size, pos + 1, head, prev,
+                                     config, next_distance);
+      if (next_length > length)
+        length = 0;
+    }
+
+    if (length >= kMinMatch) {
+      Lz77Token token = {length, distance, 0};
+      tokens.push_back(token);
+      insert_up_to(pos + length);
+      pos += length;
+    } else {
+      Lz77Token token = {0, 0, static_cast<unsigned char>(block[pos])};
+      tokens.push_back(token);
+      insert_up_to(pos + 1);
+      pos++;
+    }
+  }
+}
+
+#endif  // LZ77_H_
@@ -0,0 +1,198 @@
+#ifndef MERGE_H_
+#define MERGE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bstream.h"
+#include "pqueue.h"
+
+// Merges of k sorted sources into one sorted sequence. A source has
+//
+//   typedef ... Record;
+//   bool Done();
+//   const Record &Current();
+//   void Next();
+//
+// and so do the merges, so that merges can feed other merges. Equal records
+// come out in the order of their sources, which keeps merge sorts stable.
+//
+// HeapMerge keeps the sources in a PQueue and replaces its top after each
+// record, a single percolate down of about 2 log k comparisons. LoserTree
+// replays one path of a tournament instead, exactly log k comparisons, which
+// pays off once k reaches the hundreds
+
+template <typename Source, typename C = std::less<typename Source::Record>>
+class HeapMerge {
+ public:
+  typedef typename Source::Record Record;
+
+  // The sources have to outlive the merge
+  explicit HeapMerge(std::vector<Source> &sources);
+  bool Done() { return !heap.Size(); }
+  const Record &Current() { return heap.Top()->Current(); }
+  void Next();
+
+ private:
+  // Orders sources by their current record, then by where they are in the
+  // vector
+  class CompareSources {
+   public:
+    bool operator()(Source *source1, Source *source2) {
+      if (cmp(source1->Current(), source2->Current()))
+        return true;
+      if (cmp(source2->Current(), source1->Current()))
+        return false;
+      return source1 < source2;
+    }
+
+   private:
+    C cmp;
+  };
+
+  PQueue<Source *, CompareSources> heap;
+};
+
+template <typename Source, typename C = std::less<typename Source::Record>>
+class LoserTree {
+ public:
+  typedef typename Source::Record Record;
+
+  // The sources have to outlive the merge
+  explicit LoserTree(std::vector<Source> &sources);
+  // Finished sources lose every match, so the winner is the last to finish
+  bool Done() { return sources.empty() || sources[winner].Done(); }
+  const Record &Current() { return sources[winner].Current(); }
+  void Next();
+
+ private:
+  std::vector<Source> &sources;
+  // Loser of the match at each node, node 1 being the final and the leaves
+  // for sources i at nodes k + i, as in a heap
+  std::vector<size_t> losers;
+  size_t winner = 0;
+  C cmp;
+
+  // Helpers
+  // Whether source i wins against source j
+  bool Beats(size_t i, size_t j);
+  // Plays all matches below node and returns its winner
+  size_t Play(size_t node);
+};
+
+template <typename Source, typename C>
+HeapMerge<Source, C>::HeapMerge(std::vector<Source> &sources) {
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (!sources[i].Done())
+      heap.Push(&sources[i]);
+  }
+}
+
+template <typename Source, typename C>
+void HeapMerge<Source, C>::Next() {
+  Source *top = heap.Top();
+  top->Next();
+  if (top->Done())
+    heap.Pop();
+  else
+    heap.ReplaceTop(top);
+}
+
+template <typename Source, typename C>
+LoserTree<Source, C>::LoserTree(std::vector<Source> &sources)
+    : sources(sources), losers(sources.size()) {
+  if (!sources.empty())
+    winner = Play(1);
+}
+
+template <typename Source, typename C>
+bool LoserTree<Source, C>::Beats(size_t i, size_t j) {
+  if (sources[i].Done())
+    return false;
+  if (sources[j].Done())
+    return true;
+  if (cmp(sources[i].Current(), sources[j].Current()))
+    return true;
+  if (cmp(sources[j].Current(), sources[i].Current()))
+    return false;
+  return i < j;
+}
+
+template <typename Source, typename C>
+size_t LoserTree<Source, C>::Play(size_t node) {
+  size_t k = sources.size();
+  if (node >= k)
+    return node - k;
+  size_t left = Play(2 * node), right = Play(2 * node + 1);
+  if (Beats(left, right)) {
+    losers[node] = right;
+    return left;
+  }
+  losers[node] = left;
+  return right;
+}
+
+// Only the matches on the winner's path can change
+template <typename Source, typename C>
+void LoserTree<Source, C>::Next() {
+  sources[winner].Next();
+  for (size_t node = (winner + sources.size()) / 2; node; node /= 2) {
+    if (Beats(losers[node], winner))
+      std::swap(losers[node], winner);
+  }
+}
+
+// A line without its newline, pointing into the buffer it came from
+struct Line {
+  const char *data;
+  size_t size;
+
+  bool operator<(const Line &line) const {
+    int order = std::memcmp(data, line.data, std::min(size, line.size));
+    return order < 0 || (order == 0 && size < line.size);
+  }
+};
+
+// Reads the lines of a sorted run file straight from a memory map, so
+// records are never copied on their way through a merge
+class MappedRun {
+ public:
+  typedef Line Record;
+
+  explicit MappedRun(const std::string &filename)
+      : file(new MappedFile(filename)) {
+    Next();
+  }
+  bool Done() { return done; }
+  const Line &Current() { return line; }
+  void Next();
+
+ private:
+  // Kept behind a pointer so runs can sit in a vector
+  std::unique_ptr<MappedFile> file;
+  size_t pos = 0;
+  Line line = {nullptr, 0};
+  bool done = false;
+};
+
+void MappedRun::Next() {
+  if (pos == file->size()) {
+    done = true;
+    return;
+  }
+  const char *start = file->data() + pos;
+  const char *end = static_cast<const char *>(
+      std::memchr(start, '\n', file->size() - pos));
+  // The last line may have no newline
+  line.data = start;
+  line.size = end ? end - start : file->size() - pos;
+  pos += line.size + (end ? 1 : 0);
+}
+
+#endif  // MERGE_H_
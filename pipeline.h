@@ -0,0 +1,729 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bstream.h"
+#include "histogram_index.h"
+#include "huffman.h"
+#include "sync_index.h"
+#include "thread_pool.h"
+
+// Blocking queue with room for a fixed number of items. Closing it wakes up
+// everyone, after which Push drops items and Pop drains what is left
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+  // Returns false if the queue was closed
+  bool Push(T item);
+  // Returns false once the queue is closed and empty
+  bool Pop(T &item);
+  void Close();
+
+ private:
+  size_t capacity;
+  bool closed = false;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable not_full, not_empty;
+};
+
+template <typename T>
+bool BoundedQueue<T>::Push(T item) {
+  std::unique_lock<std::mutex> lock(mutex);
+  not_full.wait(lock, [this]() { return closed || items.size() < capacity; });
+  if (closed)
+    return false;
+  items.push_back(std::move(item));
+  not_empty.notify_one();
+  return true;
+}
+
+template <typename T>
+bool BoundedQueue<T>::Pop(T &item) {
+  std::unique_lock<std::mutex> lock(mutex);
+  not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+  if (items.empty())
+    return false;
+  item = std::move(items.front());
+  items.pop_front();
+  not_full.notify_one();
+  return true;
+}
+
+template <typename T>
+void BoundedQueue<T>::Close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  closed = true;
+  not_full.notify_all();
+  not_empty.notify_all();
+}
+
+// Reads and writes at file offsets through an io_uring when the kernel allows
+// one, and through pread/pwrite otherwise. A ring must only be used by one
+// thread at a time
+class PositionalIo {
+ public:
+  PositionalIo();
+  ~PositionalIo();
+  PositionalIo(const PositionalIo &) = delete;
+  PositionalIo &operator=(const PositionalIo &) = delete;
+
+  // Same results as pread and pwrite, short counts included. Pipes and
+  // sockets have no offsets, so they are read and written in order instead
+  ssize_t Read(int fd, char *data, size_t size, off_t offset);
+  ssize_t Write(int fd, const char *data, size_t size, off_t offset);
+
+  bool UsesIoUring() { return ring_fd >= 0; }
+
+  // Cleared to stay with pread/pwrite, for tests of that path
+  static bool io_uring_allowed;
+
+ private:
+  int ring_fd = -1;
+  // The last fd asked about, and whether it has offsets
+  int checked_fd = -1;
+  bool seekable = true;
+  void *sq_ring = MAP_FAILED, *cq_ring = MAP_FAILED;
+  size_t sq_ring_size = 0, cq_ring_size = 0;
+  io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+  size_t sqes_size = 0;
+  unsigned *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+  unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+  io_uring_cqe *cqes = nullptr;
+
+  // Helpers
+  ssize_t Submit(int opcode, int fd, char *data, size_t size, off_t offset);
+  void Teardown();
+  bool Seekable(int fd);
+};
+
+bool PositionalIo::io_uring_allowed = true;
+
+PositionalIo::PositionalIo() {
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+  if (!io_uring_allowed)
+    return;
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, 4, &params);
+  // Disabled or unsupported, stay with pread/pwrite
+  if (ring_fd < 0)
+    return;
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  sqes = static_cast<io_uring_sqe *>(
+      mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    Teardown();
+    return;
+  }
+
+  char *sq = static_cast<char *>(sq_ring);
+  char *cq = static_cast<char *>(cq_ring);
+  sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+#endif
+}
+
+PositionalIo::~PositionalIo() { Teardown(); }
+
+void PositionalIo::Teardown() {
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqes_size);
+  if (cq_ring != MAP_FAILED)
+    munmap(cq_ring, cq_ring_size);
+  if (sq_ring != MAP_FAILED)
+    munmap(sq_ring, sq_ring_size);
+  sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+  sq_ring = cq_ring = MAP_FAILED;
+  if (ring_fd >= 0)
+    close(ring_fd);
+  ring_fd = -1;
+}
+
+// Submits a single request and waits for it, overlap comes from running the
+// reader and writer on their own threads. A ring that fails is torn down,
+// which leaves the request to pread/pwrite
+ssize_t PositionalIo::Submit(int opcode, int fd, char *data, size_t size,
+                             off_t offset) {
+#if defined(__NR_io_uring_enter)
+  unsigned tail = *sq_tail;
+  unsigned index = tail & *sq_mask;
+  io_uring_sqe *sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(data);
+  sqe->len = size;
+  sqe->off = offset;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  // Only signals and a lack of kernel resources are worth waiting out, any
+  // other error means the ring itself is broken
+  int entered;
+  do {
+    entered = syscall(__NR_io_uring_enter, ring_fd, 1, 1,
+                      IORING_ENTER_GETEVENTS, nullptr, 0);
+  } while (entered < 0 && (errno == EINTR || errno == EAGAIN));
+  if (entered < 0) {
+    Teardown();
+    return -1;
+  }
+
+  unsigned head = *cq_head;
+  while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                nullptr, 0) < 0 &&
+        errno != EINTR && errno != EAGAIN) {
+      Teardown();
+      return -1;
+    }
+  }
+  int result = cqes[head & *cq_mask].res;
+  __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+  if (result < 0) {
+    errno = -result;
+    return -1;
+  }
+  return result;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+bool PositionalIo::Seekable(int fd) {
+  if (fd != checked_fd) {
+    checked_fd = fd;
+    seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+  }
+  return seekable;
+}
+
+ssize_t PositionalIo::Read(int fd, char *data, size_t size, off_t offset) {
+  if (!Seekable(fd))
+    return read(fd, data, size);
+  if (UsesIoUring()) {
+    ssize_t result = Submit(IORING_OP_READ, fd, data, size, offset);
+    // Kernels before 5.6 have a ring but not this opcode
+    if (result >= 0 || (errno != EINVAL && UsesIoUring()))
+      return result;
+    Teardown();
+  }
+  return pread(fd, data, size, offset);
+}
+
+ssize_t PositionalIo::Write(int fd, const char *data, size_t size,
+                            off_t offset) {
+  if (!Seekable(fd))
+    return write(fd, data, size);
+  if (UsesIoUring()) {
+    ssize_t result =
+        Submit(IORING_OP_WRITE, fd, const_cast<char *>(data), size, offset);
+    if (result >= 0 || (errno != EINVAL && UsesIoUring()))
+      return result;
+    Teardown();
+  }
+  return pwrite(fd, data, size, offset);
+}
+
+// Source for the bit streams that takes buffers off a queue
+class QueueSource {
+ public:
+  explicit QueueSource(BoundedQueue<std::string> &queue) : queue(queue) {}
+
+  size_t Read(char *data, size_t size) {
+    while (pos == buffer.size()) {
+      pos = 0;
+      if (!queue.Pop(buffer)) {
+        buffer.clear();
+        return 0;
+      }
+    }
+    size = std::min(size, buffer.size() - pos);
+    std::memcpy(data, buffer.data() + pos, size);
+    pos += size;
+    return size;
+  }
+
+ private:
+  BoundedQueue<std::string> &queue;
+  std::string buffer;
+  size_t pos = 0;
+};
+
+// Sink for the bit streams that hands large buffers to a queue
+class QueueSink {
+ public:
+  QueueSink(BoundedQueue<std::string> &queue, size_t buffer_size)
+      : queue(queue), buffer_size(buffer_size) {}
+
+  void Write(const char *data, size_t size) {
+    buffer.append(data, size);
+    if (buffer.size() >= buffer_size)
+      Flush();
+  }
+  void Flush() {
+    if (!buffer.empty())
+      queue.Push(std::move(buffer));
+    buffer.clear();
+  }
+  void Reserve(size_t size) {}
+
+ private:
+  BoundedQueue<std::string> &queue;
+  size_t buffer_size;
+  std::string buffer;
+};
+
+// One block coded on its own, before it has a place in the stream
+struct CodedBlock {
+  std::string coded;
+  // Input bytes in the block
+  size_t size = 0;
+  std::vector<SyncPoint> sync_points;
+  BlockHistogram histogram;
+};
+
+// Where a zap stream left off, everything needed to code more blocks onto it
+struct StreamTail {
+  // Input bytes in the stream so far
+  uint64_t offset = 0;
+  // Stream bytes before the end of stream marker
+  uint64_t coded_offset = 0;
+  std::vector<PackedCode> previous_code;
+  std::vector<SyncPoint> sync_points;
+  std::vector<BlockHistogram> histograms;
+
+  // Whether each block needs the code of the one before it, in which case
+  // blocks have to be coded one at a time and in order
+  static bool Reuses(const CompressOptions &options);
+  // Codes a block that will follow the tail, with its sync points and
+  // histogram still relative to the block. Any number can run at once unless
+  // Reuses(options)
+  void CodeBlock(const char *block, size_t size,
+                 const CompressOptions &options, CodedBlock &coded);
+  // Moves past the next block in the stream, taking its sync points and
+  // histogram. coded.coded is left for the caller to write
+  void Add(CodedBlock &coded, const CompressOptions &options);
+  // The end of stream marker and the indexes, written at coded_offset
+  std::string End(const CompressOptions &options) const;
+};
+
+// Runs zap and unzap as three stages, a reader thread, the coder and a writer
+// thread, handing large buffers along bounded queues so that file I/O
+// overlaps with coding. Compress appends a HistogramIndex when
+// options.histograms is set and a SyncIndex when options.sync_interval is
+class Pipeline {
+ public:
+  static void Compress(int in_fd, int out_fd,
+                       const CompressOptions &options = CompressOptions());
+  static void Decompress(int in_fd, int out_fd);
+  // Codes only what in_fd holds past the data already in the zap file open
+  // for reading and writing on zap_fd, as new blocks written over its end of
+  // stream marker, and rewrites its indexes to cover them. The input has to
+  // start with the data in the zap file, which is checked as far as it is
+  // decoded. Returns the number of input bytes added
+  //
+  // Only zap files with a sync index or histograms can be appended to, so
+  // that none has to be decoded from the start. They keep the indexes they
+  // have, so options.sync_interval has to be set exactly when there is a
+  // sync index. Histograms are kept up to date whenever there are some, and
+  // options.histograms may only be set then. Without a sync index the code
+  // of the last block is not known, so options.reuse_tables may not be set
+  static uint64_t Append(int in_fd, int zap_fd,
+                         const CompressOptions &options = CompressOptions());
+  // Whether fd is the same file or pipe as stdout, where the tools keep
+  // their reports out of the data
+  static bool IsStdout(int fd);
+
+  // Threads coding blocks, one pool for every pipeline in the process so that
+  // concurrent ones share the cores. 0 means one per core. Read when the
+  // first pipeline starts coding
+  static size_t coder_threads;
+
+ private:
+  // Two buffers per queue, one being filled while the other is drained
+  static const size_t kQueueDepth = 2;
+  static const size_t kChunkSize = 1 << 20;
+
+  // Stage bodies starting at offset in their file, both close their queue
+  // when done
+  static void ReadChunks(int fd, off_t offset, size_t chunk_size,
+                         BoundedQueue<std::string> &queue);
+  static void WriteChunks(int fd, off_t offset,
+                          BoundedQueue<std::string> &queue);
+  // Codes in_fd from tail.offset on into out_fd from tail.coded_offset on,
+  // then ends the stream and writes its indexes. Returns the size of out_fd
+  static uint64_t Code(int in_fd, int out_fd, const CompressOptions &options,
+                       StreamTail &tail);
+  // Reads where the zap stream left off from its indexes, decoding at most
+  // what follows the last sync point and checking it against the input.
+  // Turns on options.histograms when the zap file has them
+  static void ReadTail(const char *zap, size_t zap_size, const char *input,
+                       size_t input_size, CompressOptions &options,
+                       StreamTail &tail);
+  // Runs a stage on its own thread, keeping the first exception it throws
+  static std::thread Spawn(std::function<void()> stage,
+                           std::exception_ptr &error);
+  static ThreadPool &Coders();
+};
+
+const size_t Pipeline::kQueueDepth;
+const size_t Pipeline::kChunkSize;
+size_t Pipeline::coder_threads = 0;
+
+ThreadPool &Pipeline::Coders() {
+  // Function statics are initialized once, even with several threads
+  static ThreadPool pool(coder_threads);
+  return pool;
+}
+
+std::thread Pipeline::Spawn(std::function<void()> stage,
+                            std::exception_ptr &error) {
+  return std::thread([stage, &error]() {
+    try {
+      stage();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  });
+}
+
+bool Pipeline::IsStdout(int fd) {
+  struct stat fd_stat, stdout_stat;
+  return fstat(fd, &fd_stat) == 0 && fstat(STDOUT_FILENO, &stdout_stat) == 0 &&
+         fd_stat.st_dev == stdout_stat.st_dev &&
+         fd_stat.st_ino == stdout_stat.st_ino;
+}
+
+void Pipeline::ReadChunks(int fd, off_t offset, size_t chunk_size,
+                          BoundedQueue<std::string> &queue) {
+  PositionalIo io;
+  // Stop early if the consumer gave up and closed the queue
+  bool consumer_open = true;
+  while (consumer_open) {
+    std::string chunk(chunk_size, '\0');
+    size_t filled = 0;
+    while (filled < chunk_size) {
+      ssize_t num_read =
+          io.Read(fd, &chunk[filled], chunk_size - filled, offset + filled);
+      if (num_read < 0 && errno == EINTR)
+        continue;
+      if (num_read < 0) {
+        queue.Close();
+        throw std::runtime_error("Cannot read input file");
+      }
+      if (num_read == 0)
+        break;
+      filled += num_read;
+    }
+    if (!filled)
+      break;
+    chunk.resize(filled);
+    offset += filled;
+    consumer_open = queue.Push(std::move(chunk));
+  }
+  queue.Close();
+}
+
+void Pipeline::WriteChunks(int fd, off_t offset,
+                           BoundedQueue<std::string> &queue) {
+  PositionalIo io;
+  std::string chunk;
+  while (queue.Pop(chunk)) {
+    size_t written = 0;
+    while (written < chunk.size()) {
+      ssize_t num_written = io.Write(fd, chunk.data() + written,
+                                     chunk.size() - written, offset + written);
+      if (num_written < 0 && errno == EINTR)
+        continue;
+      if (num_written < 0) {
+        queue.Close();
+        throw std::runtime_error("Cannot write output file");
+      }
+      written += num_written;
+    }
+    offset += written;
+  }
+}
+
+bool StreamTail::Reuses(const CompressOptions &options) {
+  return options.reuse_tables && !options.sync_interval;
+}
+
+void StreamTail::CodeBlock(const char *block, size_t size,
+                           const CompressOptions &options, CodedBlock &coded) {
+  {
+    BasicBinaryOutputStream<StringSink> bos(coded.coded);
+    Huffman::CompressBlock(bos, block, size, options, &coded.sync_points,
+                           Reuses(options) ? &previous_code : nullptr);
+    bos.Close();
+  }
+  coded.size = size;
+  if (options.histograms)
+    HistogramIndex::Count(block, size, coded.histogram);
+}
+
+void StreamTail::Add(CodedBlock &coded, const CompressOptions &options) {
+  for (SyncPoint sync : coded.sync_points) {
+    sync.offset += offset;
+    sync.block_offset += coded_offset;
+    sync_points.push_back(sync);
+  }
+  if (options.histograms) {
+    coded.histogram.offset = offset;
+    histograms.push_back(std::move(coded.histogram));
+  }
+  offset += coded.size;
+  coded_offset += coded.coded.size();
+}
+
+std::string StreamTail::End(const CompressOptions &options) const {
+  std::string end;
+  {
+    BasicBinaryOutputStream<StringSink> bos(end);
+    Huffman::EndStream(bos);
+    bos.Close();
+  }
+  if (options.histograms)
+    HistogramIndex::Write(histograms, coded_offset + end.size(), end);
+  if (options.sync_interval)
+    SyncIndex::Write(sync_points, coded_offset + end.size(), end);
+  return end;
+}
+
+void Pipeline::Compress(int in_fd, int out_fd,
+                        const CompressOptions &options) {
+  StreamTail tail;
+  Code(in_fd, out_fd, options, tail);
+}
+
+uint64_t Pipeline::Code(int in_fd, int out_fd, const CompressOptions &options,
+                        StreamTail &tail) {
+  BoundedQueue<std::string> blocks(kQueueDepth), coded(kQueueDepth);
+  std::exception_ptr read_error, write_error, code_error;
+  uint64_t file_size = 0;
+  // The tail moves on as blocks are coded, the stages only need its start
+  off_t in_offset = tail.offset, out_offset = tail.coded_offset;
+  std::thread reader = Spawn(
+      [&]() {
+        ReadChunks(in_fd, in_offset, Huffman::BlockSize(options), blocks);
+      },
+      read_error);
+  std::thread writer = Spawn(
+      [&]() { WriteChunks(out_fd, out_offset, coded); }, write_error);
+
+  try {
+    // Code as many blocks at a time as there are coders, keeping their order
+    ThreadPool &pool = Coders();
+    size_t batch_size = StreamTail::Reuses(options) ? 1 : pool.Size();
+    std::vector<std::string> batch;
+    std::vector<CodedBlock> batch_coded;
+    std::string block;
+    bool more = true;
+    while (more) {
+      batch.clear();
+      while (batch.size() < batch_size && (more = blocks.Pop(block)))
+        batch.push_back(std::move(block));
+
+      batch_coded.assign(batch.size(), CodedBlock());
+      std::vector<std::future<void>> coders;
+      for (size_t i = 0; i < batch.size(); i++) {
+        coders.push_back(pool.Submit([&, i]() {
+          tail.CodeBlock(batch[i].data(), batch[i].size(), options,
+                         batch_coded[i]);
+        }));
+      }
+      // All of them use the batch, so none may be left running on an error
+      for (size_t i = 0; i < coders.size(); i++)
+        coders[i].wait();
+      for (size_t i = 0; i < batch.size(); i++) {
+        coders[i].get();
+        tail.Add(batch_coded[i], options);
+        coded.Push(std::move(batch_coded[i].coded));
+      }
+    }
+
+    // Input cut short by a failed read must not end in a complete looking
+    // stream. A failed writer has closed its queue, so nothing more goes out
+    reader.join();
+    if (!read_error) {
+      // The tail stays where the blocks end, for whoever appends next
+      std::string end = tail.End(options);
+      file_size = tail.coded_offset + end.size();
+      coded.Push(std::move(end));
+    }
+  } catch (...) {
+    code_error = std::current_exception();
+  }
+
+  blocks.Close();
+  coded.Close();
+  if (reader.joinable())
+    reader.join();
+  writer.join();
+  // A failed read or write makes the coder fail too, report the cause
+  for (std::exception_ptr error : {read_error, write_error, code_error}) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+  return file_size;
+}
+
+uint64_t Pipeline::Append(int in_fd, int zap_fd,
+                          const CompressOptions &options) {
+  StreamTail tail;
+  CompressOptions append_options = options;
+  uint64_t input_size;
+  {
+    MappedFile zap(zap_fd), input(in_fd);
+    ReadTail(zap.data(), zap.size(), input.data(), input.size(),
+             append_options, tail);
+    input_size = input.size();
+  }
+  if (input_size == tail.offset)
+    return 0;
+
+  uint64_t old_offset = tail.offset;
+  uint64_t file_size = Code(in_fd, zap_fd, append_options, tail);
+  // The new indexes hold the old ones, so this only cuts off anything
+  // written past them by mistake
+  if (ftruncate(zap_fd, file_size) < 0)
+    throw std::runtime_error("Cannot truncate zap file");
+  return tail.offset - old_offset;
+}
+
+void Pipeline::ReadTail(const char *zap, size_t zap_size, const char *input,
+                        size_t input_size, CompressOptions &options,
+                        StreamTail &tail) {
+  uint64_t stream_end = zap_size;
+  bool has_sync_index =
+      SyncIndex::Read(zap, zap_size, tail.sync_points, stream_end);
+  bool has_histograms = HistogramIndex::Read(zap, zap_size, tail.histograms);
+  if (has_sync_index != (options.sync_interval != 0))
+    throw std::runtime_error(
+        has_sync_index ? "Zap file has a sync index, append with a sync "
+                         "interval to keep it"
+                       : "Zap file has no sync index to add to");
+  if (options.histograms && !has_histograms)
+    throw std::runtime_error("Zap file has no histograms to add to");
+  // Anything else would mean decoding the whole stream
+  if (!has_sync_index && !has_histograms)
+    throw std::runtime_error(
+        "Zap file has no sync index or histograms, make it with --sync or "
+        "--histograms to append to it");
+  if (!has_sync_index && options.reuse_tables)
+    throw std::runtime_error(
+        "Zap file has no sync index, append without reusing codes");
+  options.histograms = has_histograms;
+
+  // The histograms come before the sync index, and the end of stream marker
+  // before both
+  if (has_histograms)
+    HistogramIndex::Locate(zap, zap_size, stream_end);
+  if (!stream_end ||
+      static_cast<unsigned char>(zap[stream_end - 1]) != kEndOfStream)
+    throw std::runtime_error("Zap file does not end its stream");
+  tail.coded_offset = stream_end - 1;
+
+  // Decode from the last sync point, or from the start without one
+  SyncPoint start = {0, 0, 0, 0};
+  if (!tail.sync_points.empty())
+    start = tail.sync_points.back();
+  else if (has_sync_index && tail.coded_offset)
+    throw std::runtime_error("Sync index is corrupt");
+  if (start.offset > input_size)
+    throw std::runtime_error("Input is shorter than the zap file holds");
+
+  uint64_t histogram_offset = 0;
+  if (!tail.histograms.empty())
+    histogram_offset =
+        tail.histograms.back().offset + tail.histograms.back().size;
+  std::string decoded;
+  if (has_sync_index) {
+    BasicBinaryInputStream<MemorySource> bis(zap + start.block_offset,
+                                             stream_end - start.block_offset);
+    Huffman::DecompressRange(bis, start, 0, SIZE_MAX, decoded);
+  } else {
+    // Nothing to decode, the histograms count every byte
+    start.offset = histogram_offset;
+    if (start.offset > input_size)
+      throw std::runtime_error("Input is shorter than the zap file holds");
+  }
+  if (decoded.size() > input_size - start.offset ||
+      std::memcmp(decoded.data(), input + start.offset, decoded.size()) != 0)
+    throw std::runtime_error(
+        "Input does not start with the data in the zap file");
+  tail.offset = start.offset + decoded.size();
+  if (has_histograms && histogram_offset != tail.offset)
+    throw std::runtime_error("Histogram index is corrupt");
+}
+
+void Pipeline::Decompress(int in_fd, int out_fd) {
+  BoundedQueue<std::string> compressed(kQueueDepth), decoded(kQueueDepth);
+  std::exception_ptr read_error, write_error, code_error;
+  std::thread reader = Spawn(
+      [&]() { ReadChunks(in_fd, 0, kChunkSize, compressed); }, read_error);
+  std::thread writer =
+      Spawn([&]() { WriteChunks(out_fd, 0, decoded); }, write_error);
+
+  try {
+    BasicBinaryInputStream<QueueSource> bis(compressed);
+    QueueSink sink(decoded, kChunkSize);
+    Huffman::Decompress(bis, sink);
+  } catch (...) {
+    code_error = std::current_exception();
+  }
+
+  compressed.Close();
+  decoded.Close();
+  reader.join();
+  writer.join();
+  // A failed read or write makes the coder fail too, report the cause
+  for (std::exception_ptr error : {read_error, write_error, code_error}) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+}
+
+#endif  // PIPELINE_H_
@@ -20,6 +20,8 @@ class PQueue {
   void Pop();
   // Insert item and sort priority queue
   void Push(const T& item);
+  // Replace top with item, one percolate down instead of Pop and Push
+  void ReplaceTop(const T& item);
 
   template <typename P>
   void Push(std::unique_ptr<P> item);
@@ -82,6 +84,14 @@ void PQueue<T, C>::Push(const T& item) {
   PercolateUp(cur_size - 1);
 }
 
+template <typename T, typename C>
+void PQueue<T, C>::ReplaceTop(const T& item) {
+  if (!cur_size)
+    throw std::underflow_error("Empty priority queue!");
+  items[0] = item;
+  PercolateDown(0);
+}
+
 template <typename T, typename C>
 template <typename P>
 void PQueue<T, C>::Push(std::unique_ptr<P> item) {
@@ -0,0 +1,130 @@
+#ifndef RADIX_HEAP_H_
+#define RADIX_HEAP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// The key of items that are unsigned integers themselves
+template <typename T>
+class RadixKey {
+ public:
+  uint64_t operator()(const T& item) { return item; }
+};
+
+// A priority queue with PQueue's interface for unsigned keys that never go
+// below the last key popped, such as Huffman tree weights or the times of a
+// simulation. Items sit in a bucket per highest bit in which their key
+// differs from the last key popped, and only move to lower buckets, so each
+// moves at most 64 times overall. Pushes and pops come out O(1) amortized
+// instead of O(log n) comparisons.
+//
+// K gives the key of an item. Equal keys come out in no particular order
+template <typename T, typename K = RadixKey<T>>
+class RadixHeap {
+ public:
+  // Constructor
+  RadixHeap() {}
+  // Return number of items in radix heap
+  size_t Size();
+  // Return the item with the smallest key
+  T& Top();
+  // Remove the item with the smallest key
+  void Pop();
+  // Insert item, its key may not be below the last key popped
+  void Push(const T& item);
+
+  template <typename P>
+  void Push(std::unique_ptr<P> item);
+
+ private:
+  // One bucket for keys equal to the last, one for each highest bit set
+  static const int kNumBuckets = 65;
+
+  std::vector<T> buckets[kNumBuckets];
+  uint64_t last = 0;
+  size_t cur_size = 0;
+  K key;
+
+  // Helper methods
+  int Bucket(uint64_t item_key);
+  // Moves the smallest keys into bucket 0
+  void Refill();
+};
+
+template <typename T, typename K>
+size_t RadixHeap<T, K>::Size() {
+  return cur_size;
+}
+
+template <typename T, typename K>
+T& RadixHeap<T, K>::Top() {
+  if (!cur_size)
+    throw std::underflow_error("Empty radix heap!");
+  if (buckets[0].empty())
+    Refill();
+  return buckets[0].back();
+}
+
+template <typename T, typename K>
+void RadixHeap<T, K>::Pop() {
+  if (!cur_size)
+    throw std::underflow_error("Empty radix heap!");
+  if (buckets[0].empty())
+    Refill();
+  buckets[0].pop_back();
+  cur_size--;
+}
+
+template <typename T, typename K>
+void RadixHeap<T, K>::Push(const T& item) {
+  uint64_t item_key = key(item);
+  if (item_key < last)
+    throw std::invalid_argument("Radix heap key below the last popped!");
+  buckets[Bucket(item_key)].push_back(item);
+  cur_size++;
+}
+
+template <typename T, typename K>
+template <typename P>
+void RadixHeap<T, K>::Push(std::unique_ptr<P> item) {
+  uint64_t item_key = key(item);
+  if (item_key < last)
+    throw std::invalid_argument("Radix heap key below the last popped!");
+  buckets[Bucket(item_key)].push_back(std::move(item));
+  cur_size++;
+}
+
+template <typename T, typename K>
+int RadixHeap<T, K>::Bucket(uint64_t item_key) {
+  uint64_t diff = item_key ^ last;
+  return diff ? 64 - __builtin_clzll(diff) : 0;
+}
+
+// The smallest key in the first nonempty bucket becomes the last key, which
+// spreads that bucket over the ones below it
+template <typename T, typename K>
+void RadixHeap<T, K>::Refill() {
+  int i = 1;
+  while (buckets[i].empty())
+    i++;
+
+  uint64_t min_key = key(buckets[i][0]);
+  for (size_t j = 1; j < buckets[i].size(); j++)
+    min_key = std::min(min_key, key(buckets[i][j]));
+  last = min_key;
+
+  // Every item lands in a lower bucket, so this one can be handed back
+  // empty with its capacity
+  std::vector<T> items;
+  items.swap(buckets[i]);
+  for (size_t j = 0; j < items.size(); j++)
+    buckets[Bucket(key(items[j]))].push_back(std::move(items[j]));
+  items.clear();
+  buckets[i].swap(items);
+}
+
+#endif  // RADIX_HEAP_H_
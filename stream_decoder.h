@@ -0,0 +1,381 @@
+#ifndef STREAM_DECODER_H_
+#define STREAM_DECODER_H_
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bwt.h"
+#include "huffman.h"
+#include "lz77.h"
+
+// Decodes a zap stream handed over in chunks of any size, such as network
+// packets, instead of pulling it from a stream until the end. Chunks may end
+// anywhere, even in the middle of a tree or a code.
+//
+// Decoding goes one step at a time, a step being a block header or a single
+// symbol with its extra bits. A step that runs out of input is undone and
+// tried again once more input arrives, so nothing is decoded twice except
+// the step that was cut off
+class StreamDecoder {
+ public:
+  // Takes the next size bytes of the zap stream
+  void Feed(const char *data, size_t size);
+  // Decodes up to size bytes into data, as far as the input so far allows,
+  // and returns how many it wrote. Plain Huffman, run-length, stored and LZ77
+  // blocks come out symbol by symbol, Burrows-Wheeler and filtered blocks
+  // only once complete
+  size_t Read(char *data, size_t size);
+  // Whether the end of the stream was decoded and all of it read
+  bool Finished() {
+    Decode(1);
+    return state == kDone && output_pos == output.size();
+  }
+
+ private:
+  enum State {
+    kBlockStart,
+    kHuffmanSymbols,
+    kRuns,
+    kBwtSymbols,
+    kLz77Tokens,
+    kStoredBytes,
+    kDone,
+  };
+
+  // The bits fed so far that are not decoded yet, with the interface of the
+  // bit streams in bstream.h. Running out throws std::underflow_error
+  class PendingBits {
+   public:
+    bool GetBit() {
+      if (bit_pos == data.size() * CHAR_BIT)
+        throw std::underflow_error("No more characters to read");
+      unsigned char byte = data[bit_pos / CHAR_BIT];
+      bool bit = byte >> (CHAR_BIT - 1 - bit_pos % CHAR_BIT) & 1;
+      bit_pos++;
+      return bit;
+    }
+    unsigned GetBits(int num_bits) {
+      unsigned bits = 0;
+      for (int i = 0; i < num_bits; i++)
+        bits = bits << 1 | GetBit();
+      return bits;
+    }
+    char GetChar() { return static_cast<char>(GetBits(CHAR_BIT)); }
+    int GetInt() { return static_cast<int>(GetBits(sizeof(int) * CHAR_BIT)); }
+    void Align() {
+      bit_pos = (bit_pos + CHAR_BIT - 1) / CHAR_BIT * CHAR_BIT;
+    }
+
+    // Whole bytes left, only meaningful on a byte boundary
+    size_t AvailableBytes() { return data.size() - bit_pos / CHAR_BIT; }
+    const char *Bytes() { return data.data() + bit_pos / CHAR_BIT; }
+    void SkipBytes(size_t size) { bit_pos += size * CHAR_BIT; }
+
+    std::string data;
+    size_t bit_pos = 0;
+  };
+
+  PendingBits input;
+  // Set when a step ran out of input, so no step is retried before more
+  // arrives
+  bool starved = false;
+  // Decoded bytes not read yet start at output_pos
+  std::string output;
+  size_t output_pos = 0;
+  // Inside a filtered block, its bytes from filter_start on are held back
+  // until all filter_size of them are there to invert
+  int filter = 0;
+  size_t filter_start = 0;
+  size_t filter_size = 0;
+
+  // Where the current block is at
+  State state = kBlockStart;
+  std::shared_ptr<HuffmanNode> tree, second_tree;
+  // The last plain Huffman tree, which plain Huffman blocks decode with and
+  // later blocks may reuse
+  std::shared_ptr<HuffmanNode> huffman_tree;
+  // Symbols, runs or bytes left in the block
+  int remaining = 0;
+  // Bytes in a Burrows-Wheeler or LZ77 block, the former decoded at the end
+  int num_chars = 0;
+  int primary_index = 0;
+  std::vector<int> bwt_symbols;
+  // LZ77 matches reach back into the block decoded so far
+  std::string block;
+
+  // Helpers
+  // Decoded bytes that may be read
+  size_t Ready() {
+    return (filter ? filter_start : output.size()) - output_pos;
+  }
+  // Steps until wanted bytes are ready, the input runs out or the stream ends
+  void Decode(size_t wanted);
+  void Step();
+  void StartBlock();
+  void EndBlock();
+};
+
+void StreamDecoder::Feed(const char *data, size_t size) {
+  // Drop what is decoded once it makes up most of the buffer. No step is
+  // under way between calls, so nothing points into it
+  size_t consumed = input.bit_pos / CHAR_BIT;
+  if (consumed > input.data.size() / 2) {
+    input.data.erase(0, consumed);
+    input.bit_pos -= consumed * CHAR_BIT;
+  }
+  input.data.append(data, size);
+  starved = false;
+}
+
+void StreamDecoder::Decode(size_t wanted) {
+  while (Ready() < wanted && state != kDone && !starved) {
+    size_t checkpoint = input.bit_pos;
+    try {
+      Step();
+    } catch (const std::underflow_error &) {
+      // Undo the step that was cut off
+      input.bit_pos = checkpoint;
+      starved = true;
+    }
+  }
+}
+
+size_t StreamDecoder::Read(char *data, size_t size) {
+  Decode(size);
+
+  size = std::min(size, Ready());
+  std::memcpy(data, output.data() + output_pos, size);
+  output_pos += size;
+  // Held back bytes start at the end then, if any
+  if (output_pos == output.size()) {
+    output.clear();
+    output_pos = 0;
+    filter_start = 0;
+  }
+  return size;
+}
+
+// Every step reads all it needs before changing any state, so that it can be
+// undone by rewinding the input
+void StreamDecoder::Step() {
+  switch (state) {
+    case kBlockStart: {
+      StartBlock();
+      break;
+    }
+    case kHuffmanSymbols: {
+      output +=
+          static_cast<char>(Huffman::ReadSymbol(input, huffman_tree.get()));
+      if (!--remaining)
+        EndBlock();
+      break;
+    }
+    case kRuns: {
+      char ch = static_cast<char>(Huffman::ReadSymbol(input, tree.get()));
+      int length_class = Huffman::ReadSymbol(input, second_tree.get());
+      size_t run_length = 1;
+      for (int j = 0; j < length_class - 1; j++)
+        run_length = run_length << 1 | input.GetBit();
+      output.append(run_length, ch);
+      if (!--remaining)
+        EndBlock();
+      break;
+    }
+    case kBwtSymbols: {
+      bwt_symbols.push_back(Huffman::ReadSymbol(input, tree.get()));
+      if (--remaining)
+        break;
+      Huffman::InverseBwt(bwt_symbols, num_chars, primary_index, output);
+      EndBlock();
+      break;
+    }
+    case kLz77Tokens: {
+      int symbol = Huffman::ReadSymbol(input, tree.get());
+      if (symbol < kEndOfBlock) {
+        if (block.size() == static_cast<size_t>(num_chars))
+          throw std::runtime_error("Bad LZ77 block in zap file");
+        block += static_cast<char>(symbol);
+        output += static_cast<char>(symbol);
+        break;
+      }
+      if (symbol == kEndOfBlock) {
+        if (block.size() != static_cast<size_t>(num_chars))
+          throw std::runtime_error("Bad LZ77 block in zap file");
+        EndBlock();
+        break;
+      }
+
+      // The trees can hold symbols past the ends of the tables
+      if (symbol >= kNumLiteralSymbols)
+        throw std::runtime_error("Bad LZ77 symbol in zap file");
+      int length = Lz77::LengthBase(symbol) +
+                   input.GetBits(Lz77::LengthExtraBits(symbol));
+      int distance_symbol = Huffman::ReadSymbol(input, second_tree.get());
+      if (distance_symbol >= kNumDistanceSymbols)
+        throw std::runtime_error("Bad LZ77 symbol in zap file");
+      size_t distance =
+          Lz77::DistanceBase(distance_symbol) +
+          input.GetBits(Lz77::DistanceExtraBits(distance_symbol));
+      if (distance > block.size())
+        throw std::runtime_error("Match distance before start of block");
+      if (static_cast<size_t>(length) > num_chars - block.size())
+        throw std::runtime_error("Bad LZ77 block in zap file");
+
+      // Byte at a time since the match may overlap what it produces
+      size_t from = block.size() - distance;
+      for (int i = 0; i < length; i++)
+        block += block[from + i];
+      output.append(block, block.size() - length, length);
+      break;
+    }
+    case kStoredBytes: {
+      // Copy whatever has arrived, stored blocks are byte aligned
+      size_t size = std::min<size_t>(remaining, input.AvailableBytes());
+      if (!size)
+        throw std::underflow_error("No more characters to read");
+      output.append(input.Bytes(), size);
+      input.SkipBytes(size);
+      remaining -= size;
+      if (!remaining)
+        EndBlock();
+      break;
+    }
+    case kDone:
+      break;
+  }
+}
+
+// Reads a whole block header, same layouts as in Huffman::ReadBlock
+void StreamDecoder::StartBlock() {
+  unsigned char block_type = input.GetChar();
+  if (filter && (block_type == kEndOfStream || block_type == kFilteredBlock))
+    throw std::runtime_error("Bad filtered block in zap file");
+  if (block_type == kEndOfStream) {
+    state = kDone;
+    return;
+  }
+
+  if (block_type == kFilteredBlock) {
+    int block_filter = static_cast<unsigned char>(input.GetChar());
+    int block_size = input.GetInt();
+    if (!Filter::Valid(block_filter) || block_size < 0 ||
+        static_cast<size_t>(block_size) > Huffman::kBlockSize)
+      throw std::runtime_error("Bad filtered block in zap file");
+    // The blocks inside follow, the first of them right away
+    if (block_size) {
+      filter = block_filter;
+      filter_start = output.size();
+      filter_size = block_size;
+    }
+    return;
+  }
+
+  if (block_type == kHuffmanBlock) {
+    std::shared_ptr<HuffmanNode> block_tree = Huffman::ReadTree(input);
+    int block_size = input.GetInt();
+    // A lone leaf has no bits to read and is never reused
+    if (block_tree->IsLeaf()) {
+      output.append(block_size, static_cast<char>(block_tree->data()));
+      EndBlock();
+      return;
+    }
+    huffman_tree = std::move(block_tree);
+    if (!block_size) {
+      EndBlock();
+      return;
+    }
+    remaining = block_size;
+    state = kHuffmanSymbols;
+  } else if (block_type == kReusedHuffmanBlock ||
+             block_type == kDeltaHuffmanBlock) {
+    if (!huffman_tree)
+      throw std::runtime_error("No Huffman tree to reuse in zap file");
+    std::unique_ptr<HuffmanNode> delta_tree;
+    if (block_type == kDeltaHuffmanBlock)
+      delta_tree = Huffman::ReadDeltaTree(input, huffman_tree.get());
+    int block_size = input.GetInt();
+    if (delta_tree)
+      huffman_tree = std::move(delta_tree);
+    if (!block_size) {
+      EndBlock();
+      return;
+    }
+    remaining = block_size;
+    state = kHuffmanSymbols;
+  } else if (block_type == kRunLengthBlock) {
+    input.GetInt();
+    int num_runs = input.GetInt();
+    std::shared_ptr<HuffmanNode> run_tree = Huffman::ReadTree(input);
+    std::shared_ptr<HuffmanNode> class_tree = Huffman::ReadTree(input);
+    if (!num_runs) {
+      EndBlock();
+      return;
+    }
+    tree = std::move(run_tree);
+    second_tree = std::move(class_tree);
+    remaining = num_runs;
+    state = kRuns;
+  } else if (block_type == kBwtBlock) {
+    int block_size = input.GetInt();
+    int block_primary_index = input.GetInt();
+    int num_symbols = input.GetInt();
+    Huffman::CheckBwtHeader(block_size, block_primary_index, num_symbols);
+    std::shared_ptr<HuffmanNode> bwt_tree =
+        Huffman::ReadTree(input, CHAR_BIT + 1);
+    tree = std::move(bwt_tree);
+    num_chars = block_size;
+    primary_index = block_primary_index;
+    bwt_symbols.clear();
+    bwt_symbols.reserve(num_symbols);
+    remaining = num_symbols;
+    state = kBwtSymbols;
+  } else if (block_type == kLz77Block) {
+    int block_size = input.GetInt();
+    if (block_size < 0 || static_cast<size_t>(block_size) > Huffman::kBlockSize)
+      throw std::runtime_error("Bad LZ77 block in zap file");
+    std::shared_ptr<HuffmanNode> literal_tree =
+        Huffman::ReadTree(input, CHAR_BIT + 1);
+    std::shared_ptr<HuffmanNode> distance_tree =
+        Huffman::ReadTree(input, 5);
+    tree = std::move(literal_tree);
+    second_tree = std::move(distance_tree);
+    num_chars = block_size;
+    block.clear();
+    block.reserve(block_size);
+    state = kLz77Tokens;
+  } else if (block_type == kStoredBlock) {
+    int block_size = input.GetInt();
+    if (!block_size) {
+      EndBlock();
+      return;
+    }
+    remaining = block_size;
+    state = kStoredBytes;
+  } else {
+    throw std::runtime_error("Unknown block type in zap file");
+  }
+}
+
+void StreamDecoder::EndBlock() {
+  input.Align();
+  tree.reset();
+  second_tree.reset();
+  state = kBlockStart;
+
+  // The last block inside a filtered block completes it
+  if (filter && output.size() - filter_start >= filter_size) {
+    if (output.size() - filter_start != filter_size)
+      throw std::runtime_error("Bad filtered block in zap file");
+    Filter::Invert(filter, &output[filter_start], filter_size);
+    filter = 0;
+  }
+}
+
+#endif  // STREAM_DECODER_H_
@@ -0,0 +1,346 @@
+#ifndef SYMBOL_HUFFMAN_H_
+#define SYMBOL_HUFFMAN_H_
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "bstream.h"
+#include "huffman.h"
+
+// Huffman coding of arrays of 16 or 32-bit unsigned integers, such as sensor
+// IDs or quantized readings, one symbol per integer instead of splitting
+// them into bytes, which would mix the statistics of their high and low
+// bytes. Alphabets may be sparse, only the values present in a block are
+// sent:
+//
+//   per block  number of values, number of symbols,
+//              value gaps, code lengths, codes
+//   end        a block of 0 values
+//
+// Codes are canonical, so the lengths alone describe them, and decode
+// through a two-level table instead of a tree walk
+template <typename Symbol>
+class SymbolHuffman {
+ public:
+  static_assert(std::is_unsigned<Symbol>::value && sizeof(Symbol) >= 2 &&
+                    sizeof(Symbol) <= 4,
+                "Symbols are 16 or 32-bit unsigned integers");
+
+  // Symbols coded together with one code
+  static const size_t kBlockSize = 1 << 18;
+
+  static void Compress(const std::vector<Symbol> &input, std::string &output);
+  static void Decompress(const std::string &input,
+                         std::vector<Symbol> &output);
+
+ private:
+  // Codes of up to kRootBits bits decode with one lookup, longer ones with
+  // a second in a table of their own
+  static const int kRootBits = 10;
+  // Blocks of kBlockSize symbols never need longer codes
+  static const int kMaxLength = 31;
+  static const int kLengthBits = 5;
+  // Bits of the bit length of each gap between values
+  static const int kGapLengthBits = 6;
+
+  // One slot of the decode table. A length of 0 points to a second-level
+  // table of 2^sub_bits slots starting at index
+  struct DecodeEntry {
+    uint32_t index;
+    uint8_t length;
+    uint8_t sub_bits;
+  };
+
+  // Reads bits from memory with lookahead, as the tables need to look at
+  // more bits than a code may have. Past the end it reads 0s, and checking
+  // for that is left to Overrun()
+  class BitReader {
+   public:
+    BitReader(const char *data, size_t size) : data(data), size(size) {}
+    // The next num_bits bits, up to 32, without reading them
+    uint32_t Peek(int num_bits);
+    void Skip(int num_bits) { bit_pos += num_bits; }
+    uint32_t GetBits(int num_bits) {
+      uint32_t bits = num_bits ? Peek(num_bits) : 0;
+      Skip(num_bits);
+      return bits;
+    }
+    void Align() { bit_pos = (bit_pos + CHAR_BIT - 1) / CHAR_BIT * CHAR_BIT; }
+    bool Overrun() { return bit_pos > size * CHAR_BIT; }
+
+   private:
+    const unsigned char *Bytes() {
+      return reinterpret_cast<const unsigned char *>(data);
+    }
+
+    const char *data;
+    size_t size;
+    size_t bit_pos = 0;
+  };
+
+  // Helpers
+  // Distinct values in increasing order and how often each occurs
+  static void CountSymbols(const Symbol *block, size_t block_size,
+                           std::vector<Symbol> &values,
+                           std::vector<int> &counts);
+  static void CodeLengths(HuffmanNode *node, int depth,
+                          std::vector<int> &lengths);
+  // Canonical codes from lengths, shortest first and by value among equals
+  static void CanonicalCodes(const std::vector<int> &lengths,
+                             std::vector<uint32_t> &codes);
+  static void BuildDecodeTable(const std::vector<int> &lengths,
+                               const std::vector<uint32_t> &codes,
+                               std::vector<DecodeEntry> &table);
+  static void CompressBlock(BasicBinaryOutputStream<StringSink> &bos,
+                            const Symbol *block, size_t block_size);
+  static void DecompressBlock(BitReader &reader, size_t num_values,
+                              std::vector<Symbol> &output);
+};
+
+template <typename Symbol>
+const size_t SymbolHuffman<Symbol>::kBlockSize;
+template <typename Symbol>
+const int SymbolHuffman<Symbol>::kRootBits;
+template <typename Symbol>
+const int SymbolHuffman<Symbol>::kMaxLength;
+template <typename Symbol>
+const int SymbolHuffman<Symbol>::kLengthBits;
+template <typename Symbol>
+const int SymbolHuffman<Symbol>::kGapLengthBits;
+
+template <typename Symbol>
+uint32_t SymbolHuffman<Symbol>::BitReader::Peek(int num_bits) {
+  // The 8 bytes from the current one hold any 32 bits from any offset
+  size_t byte_pos = bit_pos / CHAR_BIT;
+  uint64_t window = 0;
+  for (size_t i = 0; i < 8; i++) {
+    window <<= CHAR_BIT;
+    if (byte_pos + i < size)
+      window |= Bytes()[byte_pos + i];
+  }
+  window <<= bit_pos % CHAR_BIT;
+  return static_cast<uint32_t>(window >> (64 - num_bits));
+}
+
+// Sorting puts equal values next to each other, however sparse they are
+template <typename Symbol>
+void SymbolHuffman<Symbol>::CountSymbols(const Symbol *block,
+                                         size_t block_size,
+                                         std::vector<Symbol> &values,
+                                         std::vector<int> &counts) {
+  std::vector<Symbol> sorted(block, block + block_size);
+  std::sort(sorted.begin(), sorted.end());
+  values.clear();
+  counts.clear();
+  for (size_t i = 0; i < sorted.size(); i++) {
+    if (values.empty() || sorted[i] != values.back()) {
+      values.push_back(sorted[i]);
+      counts.push_back(0);
+    }
+    counts.back()++;
+  }
+}
+
+template <typename Symbol>
+void SymbolHuffman<Symbol>::CodeLengths(HuffmanNode *node, int depth,
+                                        std::vector<int> &lengths) {
+  if (node->IsLeaf()) {
+    lengths[node->data()] = depth;
+    return;
+  }
+  CodeLengths(node->left(), depth + 1, lengths);
+  CodeLengths(node->right(), depth + 1, lengths);
+}
+
+template <typename Symbol>
+void SymbolHuffman<Symbol>::CanonicalCodes(const std::vector<int> &lengths,
+                                           std::vector<uint32_t> &codes) {
+  std::vector<size_t> order(lengths.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](size_t i, size_t j) {
+    return lengths[i] < lengths[j];
+  });
+
+  codes.assign(lengths.size(), 0);
+  uint64_t next = 0;
+  int length = lengths.empty() ? 0 : lengths[order[0]];
+  for (size_t i = 0; i < order.size(); i++) {
+    next <<= lengths[order[i]] - length;
+    length = lengths[order[i]];
+    if (length < 1 || length > kMaxLength || next >> length)
+      throw std::runtime_error("Bad code lengths in symbol stream");
+    codes[order[i]] = static_cast<uint32_t>(next++);
+  }
+}
+
+template <typename Symbol>
+void SymbolHuffman<Symbol>::BuildDecodeTable(
+    const std::vector<int> &lengths, const std::vector<uint32_t> &codes,
+    std::vector<DecodeEntry> &table) {
+  DecodeEntry empty = {0, 0, 0};
+  table.assign(1 << kRootBits, empty);
+
+  // Size the second-level tables for the longest code under each prefix
+  for (size_t i = 0; i < lengths.size(); i++) {
+    if (lengths[i] <= kRootBits)
+      continue;
+    DecodeEntry &entry = table[codes[i] >> (lengths[i] - kRootBits)];
+    entry.sub_bits = std::max<int>(entry.sub_bits, lengths[i] - kRootBits);
+  }
+  for (size_t prefix = 0; prefix < (1u << kRootBits); prefix++) {
+    if (!table[prefix].sub_bits)
+      continue;
+    table[prefix].index = table.size();
+    table.resize(table.size() + (size_t(1) << table[prefix].sub_bits), empty);
+  }
+
+  // A code fills every slot its bits are a prefix of
+  for (size_t i = 0; i < lengths.size(); i++) {
+    DecodeEntry entry = {static_cast<uint32_t>(i),
+                         static_cast<uint8_t>(lengths[i]), 0};
+    size_t first, num_slots;
+    if (lengths[i] <= kRootBits) {
+      first = static_cast<size_t>(codes[i]) << (kRootBits - lengths[i]);
+      num_slots = size_t(1) << (kRootBits - lengths[i]);
+    } else {
+      int extra_bits = lengths[i] - kRootBits;
+      const DecodeEntry &root = table[codes[i] >> extra_bits];
+      size_t low = codes[i] & ((1u << extra_bits) - 1);
+      first = root.index + (low << (root.sub_bits - extra_bits));
+      num_slots = size_t(1) << (root.sub_bits - extra_bits);
+    }
+    std::fill(table.begin() + first, table.begin() + first + num_slots,
+              entry);
+  }
+}
+
+template <typename Symbol>
+void SymbolHuffman<Symbol>::CompressBlock(
+    BasicBinaryOutputStream<StringSink> &bos, const Symbol *block,
+    size_t block_size) {
+  std::vector<Symbol> values;
+  std::vector<int> counts;
+  CountSymbols(block, block_size, values, counts);
+  bos.PutInt(values.size());
+  bos.PutInt(block_size);
+
+  // Gaps between values, each with its bit length first
+  Symbol previous = 0;
+  for (size_t i = 0; i < values.size(); i++) {
+    uint32_t gap = values[i] - previous - (i ? 1 : 0);
+    int gap_bits = 0;
+    while (gap_bits < 32 && gap >> gap_bits)
+      gap_bits++;
+    bos.PutBits(gap_bits, kGapLengthBits);
+    if (gap_bits)
+      bos.PutBits(gap, gap_bits);
+    previous = values[i];
+  }
+
+  // A lone value has an empty code
+  if (values.size() == 1)
+    return;
+
+  std::vector<int> lengths(values.size());
+  std::unique_ptr<HuffmanNode> tree = Huffman::BuildHuffmanTree(counts);
+  CodeLengths(tree.get(), 0, lengths);
+  std::vector<uint32_t> codes;
+  CanonicalCodes(lengths, codes);
+  for (size_t i = 0; i < lengths.size(); i++)
+    bos.PutBits(lengths[i], kLengthBits);
+
+  for (size_t i = 0; i < block_size; i++) {
+    size_t index = std::lower_bound(values.begin(), values.end(), block[i]) -
+                   values.begin();
+    bos.PutBits(codes[index], lengths[index]);
+  }
+}
+
+template <typename Symbol>
+void SymbolHuffman<Symbol>::DecompressBlock(BitReader &reader,
+                                            size_t num_values,
+                                            std::vector<Symbol> &output) {
+  size_t block_size = reader.GetBits(32);
+  if (num_values > block_size || block_size > kBlockSize)
+    throw std::runtime_error("Bad block size in symbol stream");
+
+  std::vector<Symbol> values(num_values);
+  uint64_t value = 0;
+  for (size_t i = 0; i < num_values; i++) {
+    int gap_bits = reader.GetBits(kGapLengthBits);
+    if (gap_bits > 32)
+      throw std::runtime_error("Bad value in symbol stream");
+    value += reader.GetBits(gap_bits) + (i ? 1 : 0);
+    if (value > static_cast<Symbol>(~Symbol()))
+      throw std::runtime_error("Bad value in symbol stream");
+    values[i] = static_cast<Symbol>(value);
+  }
+  if (reader.Overrun())
+    throw std::underflow_error("No more characters to read");
+
+  if (num_values == 1) {
+    output.insert(output.end(), block_size, values[0]);
+    return;
+  }
+
+  std::vector<int> lengths(num_values);
+  for (size_t i = 0; i < num_values; i++)
+    lengths[i] = reader.GetBits(kLengthBits);
+  std::vector<uint32_t> codes;
+  CanonicalCodes(lengths, codes);
+  std::vector<DecodeEntry> table;
+  BuildDecodeTable(lengths, codes, table);
+
+  size_t start = output.size();
+  output.resize(start + block_size);
+  for (size_t i = 0; i < block_size; i++) {
+    DecodeEntry entry = table[reader.Peek(kRootBits)];
+    if (!entry.length && entry.sub_bits) {
+      uint32_t bits = reader.Peek(kRootBits + entry.sub_bits);
+      entry = table[entry.index + (bits & ((1u << entry.sub_bits) - 1))];
+    }
+    // Slots no code reaches, the code lengths were incomplete
+    if (!entry.length)
+      throw std::runtime_error("Bad code in symbol stream");
+    reader.Skip(entry.length);
+    output[start + i] = values[entry.index];
+  }
+  if (reader.Overrun())
+    throw std::underflow_error("No more characters to read");
+}
+
+template <typename Symbol>
+void SymbolHuffman<Symbol>::Compress(const std::vector<Symbol> &input,
+                                     std::string &output) {
+  BasicBinaryOutputStream<StringSink> bos(output);
+  for (size_t i = 0; i < input.size(); i += kBlockSize) {
+    CompressBlock(bos, input.data() + i,
+                  std::min(kBlockSize, input.size() - i));
+    bos.Align();
+  }
+  bos.PutInt(0);
+  bos.Close();
+}
+
+template <typename Symbol>
+void SymbolHuffman<Symbol>::Decompress(const std::string &input,
+                                       std::vector<Symbol> &output) {
+  BitReader reader(input.data(), input.size());
+  while (size_t num_values = reader.GetBits(32)) {
+    DecompressBlock(reader, num_values, output);
+    reader.Align();
+  }
+  if (reader.Overrun())
+    throw std::underflow_error("No more characters to read");
+}
+
+#endif  // SYMBOL_HUFFMAN_H_
@@ -0,0 +1,136 @@
+#ifndef SYNC_INDEX_H_
+#define SYNC_INDEX_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bstream.h"
+#include "huffman.h"
+
+// The sync points of a zap stream are stored right after its end of stream
+// marker, where decoders stop reading, followed by a fixed size trailer
+// pointing back at them:
+//
+//   zap stream | count, sync points | index offset "ZAPX"
+//
+// With it, any range of the uncompressed data can be decoded starting from
+// the nearest sync point before it
+class SyncIndex {
+ public:
+  // Appends the index of sync points for a zap stream of index_offset bytes
+  static void Write(const std::vector<SyncPoint> &sync_points,
+                    uint64_t index_offset, std::string &output);
+  // Finds where the index at the end of a zap file starts from its trailer
+  // alone, returns false if it has none
+  static bool Locate(const char *zap, size_t zap_size, uint64_t &index_offset);
+  // Reads the index at the end of a zap file, returns false if it has none
+  static bool Read(const char *zap, size_t zap_size,
+                   std::vector<SyncPoint> &sync_points,
+                   uint64_t &index_offset);
+  // Decodes length bytes from offset in the uncompressed data, fewer if the
+  // data ends first. Only the blocks covering the range are touched
+  static void DecompressRange(const char *zap, size_t zap_size,
+                              uint64_t offset, uint64_t length,
+                              std::string &output);
+
+ private:
+  static const char kTrailerMagic[4];
+  // Index offset and magic
+  static const size_t kTrailerSize = 12;
+  static const size_t kSyncPointSize = 24;
+};
+
+const char SyncIndex::kTrailerMagic[4] = {'Z', 'A', 'P', 'X'};
+const size_t SyncIndex::kTrailerSize;
+const size_t SyncIndex::kSyncPointSize;
+
+void SyncIndex::Write(const std::vector<SyncPoint> &sync_points,
+                      uint64_t index_offset, std::string &output) {
+  BasicBinaryOutputStream<StringSink> bos(output);
+  bos.PutInt(sync_points.size());
+  for (size_t i = 0; i < sync_points.size(); i++) {
+    bos.PutInt64(sync_points[i].offset);
+    bos.PutInt64(sync_points[i].block_offset);
+    bos.PutInt(sync_points[i].block_skip);
+    bos.PutInt(sync_points[i].bit_skip);
+  }
+  bos.PutInt64(index_offset);
+  for (size_t i = 0; i < sizeof(kTrailerMagic); i++)
+    bos.PutChar(kTrailerMagic[i]);
+}
+
+bool SyncIndex::Locate(const char *zap, size_t zap_size,
+                       uint64_t &index_offset) {
+  if (zap_size < kTrailerSize ||
+      std::memcmp(zap + zap_size - sizeof(kTrailerMagic), kTrailerMagic,
+                  sizeof(kTrailerMagic)) != 0)
+    return false;
+
+  BasicBinaryInputStream<MemorySource> trailer_bis(
+      zap + zap_size - kTrailerSize, kTrailerSize);
+  index_offset = trailer_bis.GetInt64();
+  if (index_offset > zap_size - kTrailerSize)
+    throw std::runtime_error("Sync index is out of bounds");
+  return true;
+}
+
+bool SyncIndex::Read(const char *zap, size_t zap_size,
+                     std::vector<SyncPoint> &sync_points,
+                     uint64_t &index_offset) {
+  if (!Locate(zap, zap_size, index_offset))
+    return false;
+
+  BasicBinaryInputStream<MemorySource> bis(
+      zap + index_offset, zap_size - kTrailerSize - index_offset);
+  uint32_t num_sync_points = bis.GetInt();
+  if (num_sync_points > (zap_size - index_offset) / kSyncPointSize)
+    throw std::runtime_error("Sync index is corrupt");
+  sync_points.resize(num_sync_points);
+  for (size_t i = 0; i < sync_points.size(); i++) {
+    sync_points[i].offset = bis.GetInt64();
+    sync_points[i].block_offset = bis.GetInt64();
+    sync_points[i].block_skip = bis.GetInt();
+    sync_points[i].bit_skip = bis.GetInt();
+    if (sync_points[i].block_offset >= index_offset)
+      throw std::runtime_error("Sync point is out of bounds");
+  }
+  return true;
+}
+
+void SyncIndex::DecompressRange(const char *zap, size_t zap_size,
+                                uint64_t offset, uint64_t length,
+                                std::string &output) {
+  std::vector<SyncPoint> sync_points;
+  uint64_t index_offset;
+  if (!Read(zap, zap_size, sync_points, index_offset))
+    throw std::runtime_error("Zap file has no sync index");
+
+  // Last sync point at or before the range
+  auto compare_offset = [](uint64_t offset, const SyncPoint &sync) {
+    return offset < sync.offset;
+  };
+  auto after = std::upper_bound(sync_points.begin(), sync_points.end(),
+                                offset, compare_offset);
+  if (after == sync_points.begin() || !length)
+    return;
+  const SyncPoint &sync = *(after - 1);
+
+  // The range ends before the first block starting after it
+  uint64_t end = index_offset;
+  for (; after != sync_points.end(); ++after) {
+    if (!after->bit_skip && after->offset - offset >= length) {
+      end = after->block_offset;
+      break;
+    }
+  }
+
+  BasicBinaryInputStream<MemorySource> bis(zap + sync.block_offset,
+                                           end - sync.block_offset);
+  Huffman::DecompressRange(bis, sync, offset - sync.offset, length, output);
+}
+
+#endif  // SYNC_INDEX_H_
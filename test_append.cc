@@ -0,0 +1,199 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "histogram_index.h"
+#include "huffman.h"
+#include "pipeline.h"
+#include "sync_index.h"
+
+std::string MakeInput(size_t size) {
+  std::string input;
+  std::srand(7);
+  while (input.size() < size)
+    input += "event " + std::to_string(std::rand() % 3000) + " at " +
+             std::to_string(std::rand() % 60) + "s\n";
+  input.resize(size);
+  return input;
+}
+
+std::string TempName(const std::string &suffix) {
+  return "/tmp/test_append_" + std::to_string(getpid()) + suffix;
+}
+
+void WriteFile(const std::string &name, const std::string &contents) {
+  int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(write(fd, contents.data(), contents.size()),
+            static_cast<ssize_t>(contents.size()));
+  close(fd);
+}
+
+std::string ReadFile(const std::string &name) {
+  MappedFile file(name);
+  return std::string(file.data(), file.size());
+}
+
+// Compresses input into the zap file from scratch
+void Compress(const std::string &input, const CompressOptions &options) {
+  WriteFile(TempName(".in"), input);
+  int in_fd = open(TempName(".in").c_str(), O_RDONLY);
+  int out_fd =
+      open(TempName(".zap").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  Pipeline::Compress(in_fd, out_fd, options);
+  close(in_fd);
+  close(out_fd);
+}
+
+// Appends what input has past the data already in the zap file
+uint64_t Append(const std::string &input, const CompressOptions &options) {
+  WriteFile(TempName(".in"), input);
+  int in_fd = open(TempName(".in").c_str(), O_RDONLY);
+  int zap_fd = open(TempName(".zap").c_str(), O_RDWR);
+  uint64_t appended = 0;
+  try {
+    appended = Pipeline::Append(in_fd, zap_fd, options);
+  } catch (...) {
+    close(in_fd);
+    close(zap_fd);
+    throw;
+  }
+  close(in_fd);
+  close(zap_fd);
+  return appended;
+}
+
+std::string Decompress(const std::string &zap) {
+  std::string output;
+  BasicBinaryInputStream<MemorySource> bis(zap);
+  StringSink sink(output);
+  Huffman::Decompress(bis, sink);
+  return output;
+}
+
+// Every one has an index to append after
+std::vector<CompressOptions> AllOptions() {
+  std::vector<CompressOptions> all(5);
+  for (CompressOptions &options : all)
+    options.block_size = 100000;
+  all[0].histograms = true;
+  all[1].histograms = true;
+  all[1].split_blocks = true;
+  all[2].sync_interval = 30000;
+  all[3].sync_interval = 30000;
+  all[3].histograms = true;
+  all[4].sync_interval = 30000;
+  all[4].reuse_tables = true;
+  all[4].histograms = true;
+  all[4].split_blocks = true;
+  return all;
+}
+
+TEST(Append, SameAsWholeFile) {
+  std::string input = MakeInput(1000000);
+  for (const CompressOptions &options : AllOptions()) {
+    Compress(input, options);
+    std::string whole = ReadFile(TempName(".zap"));
+
+    // Cut at a block boundary, the blocks and indexes come out the same
+    Compress(input.substr(0, 300000), options);
+    EXPECT_EQ(Append(input, options), 700000u);
+    EXPECT_EQ(ReadFile(TempName(".zap")), whole);
+  }
+  unlink(TempName(".in").c_str());
+  unlink(TempName(".zap").c_str());
+}
+
+TEST(Append, Repeatedly) {
+  std::string input = MakeInput(1000000);
+  for (const CompressOptions &options : AllOptions()) {
+    Compress("", options);
+    // Histograms are kept without asking for them again
+    CompressOptions append_options = options;
+    append_options.histograms = false;
+    size_t sizes[] = {0, 12345, 12345, 250001, 250002, 999999, 1000000};
+    for (size_t size : sizes)
+      Append(input.substr(0, size), size % 2 ? append_options : options);
+
+    std::string zap = ReadFile(TempName(".zap"));
+    EXPECT_EQ(Decompress(zap), input);
+    if (options.sync_interval) {
+      std::string range;
+      SyncIndex::DecompressRange(zap.data(), zap.size(), 250000, 5000, range);
+      EXPECT_EQ(range, input.substr(250000, 5000));
+    }
+    if (options.histograms) {
+      std::vector<BlockHistogram> histograms;
+      ASSERT_TRUE(HistogramIndex::Read(zap.data(), zap.size(), histograms));
+      ASSERT_FALSE(histograms.empty());
+      EXPECT_EQ(histograms.back().offset + histograms.back().size,
+                input.size());
+      BlockHistogram expected;
+      HistogramIndex::Count(input.data() + 250001, 1, expected);
+      EXPECT_EQ(histograms[4].offset, 250001u);
+      EXPECT_EQ(histograms[4].counts, expected.counts);
+    }
+  }
+  unlink(TempName(".in").c_str());
+  unlink(TempName(".zap").c_str());
+}
+
+TEST(Append, Mismatches) {
+  std::string input = MakeInput(500000);
+  CompressOptions options;
+  options.histograms = true;
+  Compress(input.substr(0, 200000), options);
+  EXPECT_THROW(Append(input.substr(0, 100000), options), std::runtime_error);
+
+  // The indexes have to go on as they started
+  CompressOptions sync_options;
+  sync_options.sync_interval = 10000;
+  EXPECT_THROW(Append(input, sync_options), std::runtime_error);
+  Compress(input.substr(0, 200000), sync_options);
+  EXPECT_THROW(Append(input, options), std::runtime_error);
+  // Only the data after the last sync point is decoded and checked
+  std::string changed = input;
+  changed[195000] ^= 1;
+  EXPECT_THROW(Append(changed, sync_options), std::runtime_error);
+
+  // Nothing was written by the failed appends
+  EXPECT_EQ(Append(input, sync_options), 300000u);
+  EXPECT_EQ(Decompress(ReadFile(TempName(".zap"))), input);
+
+  WriteFile(TempName(".zap"), "not a zap file");
+  EXPECT_THROW(Append(input, sync_options), std::runtime_error);
+
+  unlink(TempName(".in").c_str());
+  unlink(TempName(".zap").c_str());
+}
+
+TEST(Append, NeedsAnIndex) {
+  // Otherwise the whole stream would have to be decoded, and without a sync
+  // index so would the last code to reuse
+  std::string input = MakeInput(500000);
+  CompressOptions options;
+  Compress(input.substr(0, 200000), options);
+  EXPECT_THROW(Append(input, options), std::runtime_error);
+
+  options.histograms = true;
+  options.reuse_tables = true;
+  Compress(input.substr(0, 200000), options);
+  EXPECT_THROW(Append(input, options), std::runtime_error);
+  options.reuse_tables = false;
+  EXPECT_EQ(Append(input, options), 300000u);
+  EXPECT_EQ(Decompress(ReadFile(TempName(".zap"))), input);
+
+  unlink(TempName(".in").c_str());
+  unlink(TempName(".zap").c_str());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
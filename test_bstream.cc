@@ -2,6 +2,7 @@
 
 #include <cstdio>
 #include <fstream>
+#include <stdexcept>
 
 #include "bstream.h"
 
@@ -404,6 +405,160 @@ TEST(BStream, OutputAndInputIrregularlyDifferentOrder) {
   std::remove(filename.c_str());
 }
 
+TEST(BStream, MemorySinkAndSource) {
+  std::string buffer;
+  {
+    BasicBinaryOutputStream<StringSink> bos(buffer);
+    bos.PutBit(1);
+    bos.PutChar('Z');
+    bos.PutBits(0x5, 3);
+    bos.PutInt(-9835315);
+  }
+
+  // 1 01011010 101 then the int, padded to 6 bytes
+  ASSERT_EQ(buffer.size(), 6);
+  EXPECT_EQ(static_cast<unsigned char>(buffer[0]), 0xAD);
+  EXPECT_EQ(static_cast<unsigned char>(buffer[1]), 0x5F);
+
+  BasicBinaryInputStream<MemorySource> bis(buffer);
+  EXPECT_EQ(bis.GetBit(), 1);
+  EXPECT_EQ(bis.GetChar(), 'Z');
+  EXPECT_EQ(bis.GetBits(3), 0x5);
+  EXPECT_EQ(bis.GetInt(), -9835315);
+  EXPECT_EQ(bis.GetBits(4), 0x0);
+  EXPECT_THROW(bis.GetBit(), std::exception);
+}
+
+TEST(BStream, Align) {
+  std::string buffer;
+  {
+    BasicBinaryOutputStream<StringSink> bos(buffer);
+    bos.PutBits(0x5, 3);
+    bos.Align();
+    bos.Align();
+    bos.PutChar('A');
+    bos.PutBit(1);
+    bos.Align();
+    bos.PutChar('B');
+  }
+  ASSERT_EQ(buffer, std::string("\xA0" "A" "\x80" "B"));
+
+  BasicBinaryInputStream<MemorySource> bis(buffer);
+  EXPECT_EQ(bis.GetBits(3), 0x5);
+  bis.Align();
+  bis.Align();
+  EXPECT_EQ(bis.GetChar(), 'A');
+  EXPECT_EQ(bis.GetBit(), 1);
+  bis.Align();
+  EXPECT_EQ(bis.GetChar(), 'B');
+  EXPECT_THROW(bis.GetBit(), std::exception);
+}
+
+TEST(BStream, Int64) {
+  std::string buffer;
+  {
+    BasicBinaryOutputStream<StringSink> bos(buffer);
+    bos.PutBit(1);
+    bos.PutInt64(0x0123456789ABCDEFull);
+    bos.PutInt64(5000000000ull);
+  }
+  ASSERT_EQ(buffer.size(), 17);
+
+  BasicBinaryInputStream<MemorySource> bis(buffer);
+  EXPECT_EQ(bis.GetBit(), 1);
+  EXPECT_EQ(bis.GetInt64(), 0x0123456789ABCDEFull);
+  EXPECT_EQ(bis.GetInt64(), 5000000000ull);
+}
+
+TEST(BStream, Bytes) {
+  std::string bytes("stored\0bytes", 12), buffer;
+  {
+    BasicBinaryOutputStream<StringSink> bos(buffer);
+    bos.PutChar('A');
+    bos.PutBytes(bytes.data(), bytes.size());
+    bos.PutBits(0x5, 3);
+    bos.PutBytes(bytes.data(), bytes.size());
+  }
+  ASSERT_EQ(buffer.size(), 26);
+  EXPECT_EQ(buffer.substr(1, 12), bytes);
+
+  BasicBinaryInputStream<MemorySource> bis(buffer);
+  std::string read(bytes.size(), '\0');
+  EXPECT_EQ(bis.GetChar(), 'A');
+  bis.GetBytes(&read[0], read.size());
+  EXPECT_EQ(read, bytes);
+  EXPECT_EQ(bis.GetBits(3), 0x5);
+  bis.GetBytes(&read[0], read.size());
+  EXPECT_EQ(read, bytes);
+  EXPECT_THROW(bis.GetBytes(&read[0], 1), std::exception);
+}
+
+TEST(BStream, LsbFirstNarrowAccumulator) {
+  std::string buffer;
+  {
+    BasicBinaryOutputStream<StringSink, false, uint32_t> bos(buffer);
+    // Bits fill each byte from the bottom, so 1 then 0s is 0x01
+    bos.PutBit(1);
+    bos.PutBits(0, 7);
+    for (int i = 0; i < 20; i++)
+      bos.PutInt(i * 58439983 - 3458902);
+    bos.PutBits(0x2A, 6);
+  }
+  EXPECT_EQ(buffer[0], 0x01);
+
+  BasicBinaryInputStream<MemorySource, false, uint32_t> bis(buffer);
+  EXPECT_EQ(bis.GetBit(), 1);
+  EXPECT_EQ(bis.GetBits(7), 0x0);
+  for (int i = 0; i < 20; i++)
+    EXPECT_EQ(bis.GetInt(), i * 58439983 - 3458902);
+  EXPECT_EQ(bis.GetBits(6), 0x2A);
+}
+
+TEST(BStream, FdAndFileSinksAndSources) {
+  std::string filename{"test_fd_and_file"};
+
+  FILE *file = std::fopen(filename.c_str(), "wb");
+  {
+    BasicBinaryOutputStream<FileSink> bos(file);
+    bos.PutChar('H');
+    bos.PutBit(1);
+    bos.PutInt(4890320);
+    bos.Close();
+  }
+  std::fclose(file);
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  BasicBinaryInputStream<FdSource> bis(fd);
+  EXPECT_EQ(bis.GetChar(), 'H');
+  EXPECT_EQ(bis.GetBit(), 1);
+  EXPECT_EQ(bis.GetInt(), 4890320);
+  ::close(fd);
+
+  MappedFile mapped(filename);
+  BasicBinaryInputStream<MemorySource> mapped_bis(mapped.data(),
+                                                  mapped.size());
+  EXPECT_EQ(mapped_bis.GetChar(), 'H');
+
+  std::remove(filename.c_str());
+}
+
+TEST(BStream, WriteErrorsOnlyFromClose) {
+  // A bad descriptor fails once the buffered bits are flushed
+  {
+    BasicBinaryOutputStream<FdSink> bos(-1);
+    bos.PutInt(1);
+    EXPECT_THROW(bos.Close(), std::runtime_error);
+  }
+  // Unwinding past a stream with bits still buffered does not terminate
+  EXPECT_THROW(
+      {
+        BasicBinaryOutputStream<FdSink> bos(-1);
+        bos.PutInt(7);
+        throw std::logic_error("unwinding");
+      },
+      std::logic_error);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,186 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+#include "checksum.h"
+#include "chunker.h"
+
+std::string MakeInput(size_t size, unsigned seed) {
+  std::string input;
+  std::srand(seed);
+  while (input.size() < size)
+    input += "row " + std::to_string(std::rand()) + '\n';
+  input.resize(size);
+  return input;
+}
+
+std::string TempName(const std::string &suffix) {
+  return "/tmp/test_chunker_" + std::to_string(getpid()) + suffix;
+}
+
+void WriteFile(const std::string &name, const std::string &contents) {
+  int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(write(fd, contents.data(), contents.size()),
+            static_cast<ssize_t>(contents.size()));
+  close(fd);
+}
+
+std::string ReadFile(const std::string &name) {
+  MappedFile file(name);
+  return std::string(file.data(), file.size());
+}
+
+// Chunks as the strings they hold
+std::vector<std::string> Chunks(const std::string &input) {
+  std::vector<size_t> chunk_sizes;
+  Chunker::Split(input.data(), input.size(), chunk_sizes);
+  std::vector<std::string> chunks;
+  size_t offset = 0;
+  for (size_t i = 0; i < chunk_sizes.size(); i++) {
+    chunks.push_back(input.substr(offset, chunk_sizes[i]));
+    offset += chunk_sizes[i];
+  }
+  EXPECT_EQ(offset, input.size());
+  return chunks;
+}
+
+TEST(Checksum, Sha256) {
+  auto hex = [](const std::string &digest) {
+    std::string text;
+    for (size_t i = 0; i < digest.size(); i++) {
+      text += "0123456789abcdef"[static_cast<unsigned char>(digest[i]) >> 4];
+      text += "0123456789abcdef"[digest[i] & 0xF];
+    }
+    return text;
+  };
+  EXPECT_EQ(hex(Checksum::Sha256("", 0)),
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  EXPECT_EQ(hex(Checksum::Sha256("abc", 3)),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  // Padding that spills into a second block
+  std::string message =
+      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  EXPECT_EQ(hex(Checksum::Sha256(message.data(), message.size())),
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  std::string million(1000000, 'a');
+  EXPECT_EQ(hex(Checksum::Sha256(million.data(), million.size())),
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST(Chunker, Sizes) {
+  std::string input = MakeInput(5000000, 1);
+  std::vector<size_t> chunk_sizes;
+  Chunker::Split(input.data(), input.size(), chunk_sizes);
+  for (size_t i = 0; i + 1 < chunk_sizes.size(); i++) {
+    EXPECT_GE(chunk_sizes[i], Chunker::kMinChunk);
+    EXPECT_LE(chunk_sizes[i], Chunker::kMaxChunk);
+  }
+  size_t average = input.size() / chunk_sizes.size();
+  EXPECT_GT(average, Chunker::kAverageChunk / 2);
+  EXPECT_LT(average, Chunker::kAverageChunk * 2);
+
+  // Runs never cut by content end up at the largest size
+  std::string zeros(1000000, '\0');
+  chunk_sizes.clear();
+  Chunker::Split(zeros.data(), zeros.size(), chunk_sizes);
+  EXPECT_EQ(chunk_sizes[0], Chunker::kMaxChunk);
+  chunk_sizes.clear();
+  Chunker::Split(zeros.data(), 0, chunk_sizes);
+  EXPECT_TRUE(chunk_sizes.empty());
+}
+
+TEST(Chunker, InsertionMovesFewCuts) {
+  std::string input = MakeInput(3000000, 2);
+  std::string edited = input;
+  edited.insert(1234567, "a few bytes that were not there before");
+  edited.erase(2500000, 100);
+
+  std::vector<std::string> before = Chunks(input), after = Chunks(edited);
+  std::set<std::string> known(before.begin(), before.end());
+  size_t changed = 0;
+  for (size_t i = 0; i < after.size(); i++)
+    changed += !known.count(after[i]);
+  EXPECT_LE(changed, 4u);
+}
+
+TEST(Archive, Dedup) {
+  std::string first = MakeInput(2000000, 3);
+  std::string second = first.substr(0, 700000) + "changed" +
+                       first.substr(700000) + MakeInput(100000, 4);
+  std::vector<std::string> names = {TempName(".a"), TempName(".b"),
+                                    TempName(".c"), TempName(".empty")};
+  WriteFile(names[0], first);
+  WriteFile(names[1], second);
+  WriteFile(names[2], first);
+  WriteFile(names[3], "");
+
+  Archive::Create(TempName(".zap"), names);
+  size_t plain_size = ReadFile(TempName(".zap")).size();
+  Archive::Create(TempName(".zap"), names, CompressOptions(), true);
+  size_t dedup_size = ReadFile(TempName(".zap")).size();
+  EXPECT_LT(dedup_size, plain_size / 2);
+
+  std::vector<ArchiveEntry> entries = Archive::List(TempName(".zap"));
+  ASSERT_EQ(entries.size(), 4u);
+  // Nothing new in the copy
+  EXPECT_EQ(entries[2].compressed_size, 0u);
+  EXPECT_EQ(entries[2].chunks, entries[0].chunks);
+  EXPECT_LT(entries[1].compressed_size, entries[0].compressed_size / 4);
+  for (size_t i = 0; i < names.size(); i++) {
+    Archive::Extract(TempName(".zap"), names[i], TempName(".out"));
+    EXPECT_EQ(ReadFile(TempName(".out")), ReadFile(names[i])) << i;
+  }
+
+  // A chunk count the directory cannot hold
+  std::string archive = ReadFile(TempName(".zap"));
+  size_t directory_offset = 0;
+  for (size_t i = archive.size() - 12; i < archive.size() - 4; i++)
+    directory_offset =
+        directory_offset << 8 | static_cast<unsigned char>(archive[i]);
+  archive[directory_offset] = 0x7F;
+  WriteFile(TempName(".zap"), archive);
+  EXPECT_THROW(Archive::List(TempName(".zap")), std::runtime_error);
+
+  for (const std::string &name : names)
+    unlink(name.c_str());
+  for (const char *suffix : {".zap", ".out"})
+    unlink(TempName(suffix).c_str());
+}
+
+TEST(Archive, OnlyComplete) {
+  std::vector<std::string> names = {TempName(".a"), TempName(".missing")};
+  WriteFile(names[0], MakeInput(100000, 5));
+  WriteFile(TempName(".zap"), "left alone");
+  // A file that cannot be read leaves no archive and the old file as it was
+  EXPECT_THROW(Archive::Create(TempName(".zap"), names), std::runtime_error);
+  EXPECT_EQ(ReadFile(TempName(".zap")), "left alone");
+  EXPECT_NE(access(TempName(".zap.tmp").c_str(), F_OK), 0);
+
+  names.pop_back();
+  for (int i = 0; i < 2; i++) {
+    CompressOptions options;
+    options.sync_interval = i ? 0 : 1000;
+    options.histograms = i;
+    EXPECT_THROW(Archive::Create(TempName(".zap"), names, options),
+                 std::invalid_argument);
+  }
+  Archive::Create(TempName(".zap"), names);
+  EXPECT_EQ(Archive::List(TempName(".zap")).size(), 1u);
+
+  unlink(names[0].c_str());
+  unlink(TempName(".zap").c_str());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
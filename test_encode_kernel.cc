@@ -0,0 +1,96 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#include "./bstream.h"
+#include "./encode_kernel.h"
+
+// Random codes of 1 to max_length bits for every byte value. They need not
+// be prefix free, only written the same way by both versions
+void MakeCodes(int max_length, uint32_t *codes, uint32_t *lengths) {
+  for (int i = 0; i < 256; i++) {
+    lengths[i] = 1 + std::rand() % max_length;
+    codes[i] = static_cast<uint32_t>(std::rand()) & ((1u << lengths[i]) - 1);
+  }
+  // The longest codes and all ones bits, where merging shifts the most
+  lengths[255] = max_length;
+  codes[255] = (1u << max_length) - 1;
+}
+
+std::string MakeBlock(size_t size) {
+  std::string block;
+  for (size_t i = 0; i < size; i++)
+    block += static_cast<char>(i % 5 ? std::rand() : 255);
+  return block;
+}
+
+std::string EncodeScalar(const std::string &block, const uint32_t *codes,
+                         const uint32_t *lengths) {
+  std::string output;
+  BasicBinaryOutputStream<StringSink> bos(output);
+  // Off a byte boundary, so that merged words straddle bytes
+  bos.PutBits(5, 3);
+  EncodeKernel::EncodeScalar(
+      bos, reinterpret_cast<const unsigned char *>(block.data()),
+      block.size(), codes, lengths);
+  bos.Close();
+  return output;
+}
+
+// The vector version as far as it goes, then the scalar one for the tail
+std::string EncodeAvx2(const std::string &block, const uint32_t *codes,
+                       const uint32_t *lengths) {
+  std::string output;
+  BasicBinaryOutputStream<StringSink> bos(output);
+  bos.PutBits(5, 3);
+  const unsigned char *bytes =
+      reinterpret_cast<const unsigned char *>(block.data());
+  size_t done =
+      EncodeKernel::EncodeAvx2(bos, bytes, block.size(), codes, lengths);
+  EXPECT_EQ(done, block.size() / 8 * 8);
+  EncodeKernel::EncodeScalar(bos, bytes + done, block.size() - done, codes,
+                             lengths);
+  bos.Close();
+  return output;
+}
+
+TEST(EncodeKernel, Avx2SameAsScalar) {
+  if (!EncodeKernel::HasAvx2())
+    GTEST_SKIP();
+  std::srand(17);
+  uint32_t codes[256], lengths[256];
+  for (int max_length : {1, 5, 9, EncodeKernel::kMaxVectorLength}) {
+    MakeCodes(max_length, codes, lengths);
+    // Whole groups of 8, scalar tails of every size and 1 byte blocks
+    for (size_t size : {1, 7, 8, 9, 15, 16, 17, 63, 64, 1000, 4099}) {
+      std::string block = MakeBlock(size);
+      EXPECT_EQ(EncodeAvx2(block, codes, lengths),
+                EncodeScalar(block, codes, lengths))
+          << max_length << ' ' << size;
+    }
+  }
+}
+
+TEST(EncodeKernel, EncodePicksEither) {
+  std::srand(18);
+  uint32_t codes[256], lengths[256];
+  std::string block = MakeBlock(1001);
+  // Codes too long to merge always take the scalar path
+  for (int max_length : {EncodeKernel::kMaxVectorLength, 20}) {
+    MakeCodes(max_length, codes, lengths);
+    std::string output;
+    BasicBinaryOutputStream<StringSink> bos(output);
+    bos.PutBits(5, 3);
+    EncodeKernel::Encode(bos, block.data(), block.size(), codes, lengths,
+                         max_length);
+    bos.Close();
+    EXPECT_EQ(output, EncodeScalar(block, codes, lengths)) << max_length;
+  }
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
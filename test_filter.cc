@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "./filter.h"
+#include "./huffman.h"
+
+// Slowly rising little-endian counters with some noise
+std::string MakeCounters(size_t count) {
+  std::string data;
+  uint32_t value = 1000000;
+  for (size_t i = 0; i < count; i++) {
+    value += 40 + i * 7919 % 23;
+    for (int b = 0; b < 4; b++)
+      data += static_cast<char>(value >> (8 * b));
+  }
+  return data;
+}
+
+std::string Decompress(const std::string &zap) {
+  std::string output;
+  BasicBinaryInputStream<MemorySource> bis(zap);
+  StringSink sink(output);
+  Huffman::Decompress(bis, sink);
+  return output;
+}
+
+TEST(Filter, Parse) {
+  EXPECT_EQ(Filter::Parse("delta4"),
+            Filter::Make(kDeltaTransform, false, 4));
+  EXPECT_EQ(Filter::Parse("xor8+shuffle"),
+            Filter::Make(kXorTransform, true, 8));
+  EXPECT_EQ(Filter::Parse("shuffle2"), Filter::Make(kNoTransform, true, 2));
+  EXPECT_EQ(Filter::Width(Filter::Parse("delta1")), 1);
+  EXPECT_EQ(Filter::Width(Filter::Parse("xor8")), 8);
+  for (const char *spec : {"", "delta", "delta3", "xor16", "shuffle4+shuffle",
+                           "delta4+", "rle4"})
+    EXPECT_THROW(Filter::Parse(spec), std::invalid_argument) << spec;
+  EXPECT_FALSE(Filter::Valid(0));
+  EXPECT_FALSE(Filter::Valid(3));
+}
+
+TEST(Filter, RoundTrip) {
+  std::string input = MakeCounters(1000);
+  for (const char *spec :
+       {"delta1", "delta2", "delta4", "delta8", "xor1", "xor2", "xor4",
+        "xor8", "shuffle2", "shuffle4", "shuffle8", "delta4+shuffle",
+        "xor8+shuffle"}) {
+    int filter = Filter::Parse(spec);
+    // Sizes that leave a tail after the last whole value
+    for (size_t size : {0, 1, 7, 15, 4000}) {
+      std::string filtered;
+      Filter::Apply(filter, input.data(), size, filtered);
+      ASSERT_EQ(filtered.size(), size);
+      Filter::Invert(filter, &filtered[0], size);
+      EXPECT_EQ(filtered, input.substr(0, size)) << spec << ' ' << size;
+    }
+  }
+}
+
+TEST(Filter, LittleEndianDeltas) {
+  std::string input("\x01\x00\x03\x00\x02\x00", 6), filtered;
+  Filter::Apply(Filter::Parse("delta2"), input.data(), input.size(),
+                filtered);
+  EXPECT_EQ(filtered, std::string("\x01\x00\x02\x00\xFF\xFF", 6));
+  Filter::Apply(Filter::Parse("delta2+shuffle"), input.data(), input.size(),
+                filtered);
+  EXPECT_EQ(filtered, std::string("\x01\x02\xFF\x00\x00\xFF", 6));
+}
+
+TEST(Filter, Compress) {
+  std::string input = MakeCounters(200000), plain;
+  Huffman::Compress(input, plain);
+  for (const char *spec : {"delta4", "delta4+shuffle"}) {
+    CompressOptions options;
+    options.filter = Filter::Parse(spec);
+    // Blocks that split values are fine, each one starts over
+    for (size_t block_size : {0, 10001}) {
+      options.block_size = block_size;
+      std::string zap;
+      Huffman::Compress(input, zap, options);
+      EXPECT_EQ(Decompress(zap), input) << spec;
+      EXPECT_LT(zap.size(), plain.size() / 2) << spec;
+      EXPECT_LE(zap.size(), Huffman::EstimateSize(input.data(), input.size(),
+                                                  options));
+    }
+  }
+
+  // Along with every other stage
+  CompressOptions options;
+  options.filter = Filter::Parse("xor4");
+  options.bwt = true;
+  options.lz77_level = 2;
+  options.split_blocks = true;
+  options.reuse_tables = true;
+  options.block_size = 50000;
+  std::string zap;
+  Huffman::Compress(input, zap, options);
+  EXPECT_EQ(Decompress(zap), input);
+}
+
+TEST(Filter, Corrupt) {
+  std::string input = MakeCounters(1000), zap;
+  CompressOptions options;
+  options.filter = Filter::Parse("delta4");
+  Huffman::Compress(input, zap, options);
+  ASSERT_EQ(zap[0], kFilteredBlock);
+
+  std::string bad = zap;
+  bad[1] = 3;
+  EXPECT_THROW(Decompress(bad), std::runtime_error);
+  // A size that the blocks inside do not add up to
+  bad = zap;
+  bad[5]++;
+  EXPECT_THROW(Decompress(bad), std::runtime_error);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
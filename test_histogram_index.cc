@@ -0,0 +1,140 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "histogram_index.h"
+#include "huffman.h"
+#include "pipeline.h"
+#include "sync_index.h"
+
+std::string MakeInput(size_t size) {
+  std::string input;
+  std::srand(5);
+  for (size_t i = 0; input.size() < size; i++)
+    input += "entry " + std::to_string(std::rand() % 5000) + " done\n";
+  input.resize(size);
+  return input;
+}
+
+std::string TempName(const std::string &suffix) {
+  return "/tmp/test_histogram_index_" + std::to_string(getpid()) + suffix;
+}
+
+// Through zap's own path, reading and writing files
+std::string CompressFile(const std::string &input,
+                         const CompressOptions &options) {
+  int fd = open(TempName(".in").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  EXPECT_EQ(write(fd, input.data(), input.size()),
+            static_cast<ssize_t>(input.size()));
+  close(fd);
+  int in_fd = open(TempName(".in").c_str(), O_RDONLY);
+  int out_fd =
+      open(TempName(".zap").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  Pipeline::Compress(in_fd, out_fd, options);
+  close(in_fd);
+  close(out_fd);
+
+  std::string zap;
+  {
+    MappedFile file(TempName(".zap"));
+    zap.assign(file.data(), file.size());
+  }
+  unlink(TempName(".in").c_str());
+  unlink(TempName(".zap").c_str());
+  return zap;
+}
+
+std::string Decompress(const std::string &zap) {
+  std::string output;
+  BasicBinaryInputStream<MemorySource> bis(zap);
+  StringSink sink(output);
+  Huffman::Decompress(bis, sink);
+  return output;
+}
+
+TEST(HistogramIndex, Count) {
+  std::string input = MakeInput(100003);
+  BlockHistogram histogram;
+  histogram.counts[7] = 42;
+  HistogramIndex::Count(input.data(), input.size(), histogram);
+  std::vector<uint32_t> expected(256);
+  for (size_t i = 0; i < input.size(); i++)
+    expected[static_cast<unsigned char>(input[i])]++;
+  EXPECT_EQ(histogram.counts, expected);
+  EXPECT_EQ(histogram.size, input.size());
+
+  std::vector<int> uniform(4, 10);
+  EXPECT_DOUBLE_EQ(HistogramIndex::Entropy(uniform), 2);
+  EXPECT_DOUBLE_EQ(HistogramIndex::Entropy(std::vector<int>(3)), 0);
+}
+
+TEST(HistogramIndex, Pipeline) {
+  std::string input = MakeInput(1000000);
+  for (uint64_t sync_interval : {0, 50000}) {
+    CompressOptions options;
+    options.block_size = 100000;
+    options.sync_interval = sync_interval;
+    options.histograms = true;
+    std::string zap = CompressFile(input, options);
+    EXPECT_EQ(Decompress(zap), input);
+
+    std::vector<BlockHistogram> histograms;
+    ASSERT_TRUE(HistogramIndex::Read(zap.data(), zap.size(), histograms));
+    ASSERT_EQ(histograms.size(), 10u);
+    for (size_t i = 0; i < histograms.size(); i++) {
+      BlockHistogram expected;
+      HistogramIndex::Count(input.data() + i * 100000, 100000, expected);
+      EXPECT_EQ(histograms[i].offset, i * 100000);
+      EXPECT_EQ(histograms[i].size, 100000u);
+      EXPECT_EQ(histograms[i].counts, expected.counts);
+    }
+
+    // The sync index is still found behind the histograms
+    std::string range;
+    if (sync_interval) {
+      SyncIndex::DecompressRange(zap.data(), zap.size(), 123456, 1000, range);
+      EXPECT_EQ(range, input.substr(123456, 1000));
+      // Lengths that would wrap around once added to the offset
+      range.clear();
+      SyncIndex::DecompressRange(zap.data(), zap.size(), 123456, UINT64_MAX,
+                                 range);
+      EXPECT_EQ(range, input.substr(123456));
+    }
+  }
+
+  // Nothing after the stream without the option
+  std::vector<BlockHistogram> histograms;
+  std::string zap = CompressFile(input, CompressOptions());
+  EXPECT_FALSE(HistogramIndex::Read(zap.data(), zap.size(), histograms));
+}
+
+TEST(HistogramIndex, EmptyAndCorrupt) {
+  CompressOptions options;
+  options.histograms = true;
+  std::string zap = CompressFile("", options);
+  std::vector<BlockHistogram> histograms;
+  ASSERT_TRUE(HistogramIndex::Read(zap.data(), zap.size(), histograms));
+  EXPECT_TRUE(histograms.empty());
+
+  zap = CompressFile(MakeInput(1000), options);
+  std::string bad = zap;
+  // Index offset past the trailer
+  bad[bad.size() - 6] = 0x7F;
+  EXPECT_THROW(HistogramIndex::Read(bad.data(), bad.size(), histograms),
+               std::runtime_error);
+  // An index too short for its own count
+  bad = zap.substr(0, 2) + std::string(7, '\0') + '\x01' + "ZAPH";
+  EXPECT_THROW(HistogramIndex::Read(bad.data(), bad.size(), histograms),
+               std::runtime_error);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "merge.h"
+
+// A sorted run held in memory
+class VectorSource {
+ public:
+  typedef std::pair<int, int> Record;
+
+  explicit VectorSource(std::vector<Record> records)
+      : records(std::move(records)) {}
+  bool Done() { return pos == records.size(); }
+  const Record &Current() { return records[pos]; }
+  void Next() { pos++; }
+
+ private:
+  std::vector<Record> records;
+  size_t pos = 0;
+};
+
+// Compares keys only, so equal keys show which source came first
+class CompareKeys {
+ public:
+  bool operator()(const std::pair<int, int> &record1,
+                  const std::pair<int, int> &record2) {
+    return record1.first < record2.first;
+  }
+};
+
+// num_sources sorted runs of random keys, each record tagged with its run
+std::vector<VectorSource> MakeSources(int num_sources, int max_size) {
+  std::srand(11);
+  std::vector<VectorSource> sources;
+  for (int i = 0; i < num_sources; i++) {
+    std::vector<std::pair<int, int>> records;
+    int size = std::rand() % (max_size + 1);
+    for (int j = 0; j < size; j++)
+      records.push_back(std::make_pair(std::rand() % 100, i));
+    std::sort(records.begin(), records.end());
+    sources.push_back(VectorSource(records));
+  }
+  return sources;
+}
+
+template <typename Merger>
+std::vector<std::pair<int, int>> Drain(Merger &merger) {
+  std::vector<std::pair<int, int>> output;
+  for (; !merger.Done(); merger.Next())
+    output.push_back(merger.Current());
+  return output;
+}
+
+// The same records, sorted by key with ties in source order
+std::vector<std::pair<int, int>> Expected(int num_sources, int max_size) {
+  std::vector<VectorSource> sources = MakeSources(num_sources, max_size);
+  std::vector<std::pair<int, int>> expected;
+  for (size_t i = 0; i < sources.size(); i++) {
+    for (; !sources[i].Done(); sources[i].Next())
+      expected.push_back(sources[i].Current());
+  }
+  std::stable_sort(expected.begin(), expected.end(), CompareKeys());
+  return expected;
+}
+
+TEST(Merge, Heap) {
+  for (int k : {1, 2, 3, 7, 64, 301}) {
+    std::vector<VectorSource> sources = MakeSources(k, 50);
+    HeapMerge<VectorSource, CompareKeys> merger(sources);
+    EXPECT_EQ(Drain(merger), Expected(k, 50));
+  }
+}
+
+TEST(Merge, LoserTree) {
+  for (int k : {1, 2, 3, 7, 64, 301}) {
+    std::vector<VectorSource> sources = MakeSources(k, 50);
+    LoserTree<VectorSource, CompareKeys> merger(sources);
+    EXPECT_EQ(Drain(merger), Expected(k, 50));
+  }
+}
+
+TEST(Merge, Empty) {
+  std::vector<VectorSource> none;
+  HeapMerge<VectorSource> heap(none);
+  EXPECT_TRUE(heap.Done());
+  LoserTree<VectorSource> tree(none);
+  EXPECT_TRUE(tree.Done());
+
+  // Sources with nothing in them are skipped
+  std::vector<VectorSource> empty(3, VectorSource({}));
+  empty.push_back(VectorSource({{5, 0}}));
+  LoserTree<VectorSource> merger(empty);
+  ASSERT_FALSE(merger.Done());
+  EXPECT_EQ(merger.Current().first, 5);
+  merger.Next();
+  EXPECT_TRUE(merger.Done());
+}
+
+TEST(Merge, MergesOfMerges) {
+  std::vector<VectorSource> sources = MakeSources(20, 30);
+  std::vector<LoserTree<VectorSource, CompareKeys>> halves;
+  std::vector<VectorSource> first(sources.begin(), sources.begin() + 10);
+  std::vector<VectorSource> second(sources.begin() + 10, sources.end());
+  halves.emplace_back(first);
+  halves.emplace_back(second);
+  HeapMerge<LoserTree<VectorSource, CompareKeys>, CompareKeys> merger(halves);
+  EXPECT_EQ(Drain(merger), Expected(20, 30));
+}
+
+TEST(Merge, Lines) {
+  const char text[] = "apple\nbanana\nband\nban\n";
+  Line lines[] = {{text, 5}, {text + 6, 6}, {text + 13, 4}, {text + 18, 3}};
+  EXPECT_TRUE(lines[0] < lines[1]);
+  EXPECT_TRUE(lines[3] < lines[1]);
+  EXPECT_TRUE(lines[1] < lines[2]);
+  EXPECT_FALSE(lines[2] < lines[2]);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,146 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <csignal>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "./huffman.h"
+#include "./pipeline.h"
+
+std::string MakeInput(size_t size) {
+  std::string input;
+  std::srand(23);
+  while (input.size() < size)
+    input += "sample " + std::to_string(std::rand() % 10000) + '\n';
+  input.resize(size);
+  return input;
+}
+
+std::string TempName(const std::string &suffix) {
+  return "/tmp/test_pipeline_" + std::to_string(getpid()) + suffix;
+}
+
+// Runs stage with its input fed through one pipe and its output read from
+// another, like zap in the middle of a shell pipeline
+std::string ThroughPipes(const std::string &input,
+                         void (*stage)(int in_fd, int out_fd)) {
+  int in_pipe[2], out_pipe[2];
+  EXPECT_EQ(pipe(in_pipe), 0);
+  EXPECT_EQ(pipe(out_pipe), 0);
+  std::thread feeder([&]() {
+    for (size_t done = 0; done < input.size();) {
+      ssize_t written =
+          write(in_pipe[1], input.data() + done, input.size() - done);
+      if (written <= 0)
+        break;
+      done += written;
+    }
+    close(in_pipe[1]);
+  });
+  std::string output;
+  std::thread drainer([&]() {
+    char buffer[4096];
+    ssize_t num_read;
+    while ((num_read = read(out_pipe[0], buffer, sizeof(buffer))) > 0)
+      output.append(buffer, num_read);
+  });
+
+  try {
+    stage(in_pipe[0], out_pipe[1]);
+  } catch (...) {
+    ADD_FAILURE() << "stage threw";
+  }
+  // A stage that stopped early leaves the feeder blocked until this
+  close(in_pipe[0]);
+  close(out_pipe[1]);
+  feeder.join();
+  drainer.join();
+  close(out_pipe[0]);
+  return output;
+}
+
+void Compress(int in_fd, int out_fd) { Pipeline::Compress(in_fd, out_fd); }
+void Decompress(int in_fd, int out_fd) {
+  Pipeline::Decompress(in_fd, out_fd);
+}
+
+TEST(Pipeline, ThroughPipes) {
+  std::string input = MakeInput(3000000);
+  for (bool io_uring : {true, false}) {
+    PositionalIo::io_uring_allowed = io_uring;
+    std::string zap = ThroughPipes(input, Compress);
+    std::string expected;
+    Huffman::Compress(input, expected);
+    EXPECT_EQ(zap, expected);
+    EXPECT_EQ(ThroughPipes(zap, Decompress), input);
+  }
+  PositionalIo::io_uring_allowed = true;
+}
+
+TEST(Pipeline, ReportsReadErrorFirst) {
+  // Reading a directory fails, which also leaves the decoder short of input
+  int in_fd = open("/tmp", O_RDONLY);
+  int out_fd = open(TempName(".out").c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                    0644);
+  ASSERT_GE(in_fd, 0);
+  try {
+    Pipeline::Decompress(in_fd, out_fd);
+    ADD_FAILURE() << "no error";
+  } catch (const std::exception &e) {
+    EXPECT_EQ(std::string(e.what()), "Cannot read input file");
+  }
+  close(in_fd);
+  close(out_fd);
+  unlink(TempName(".out").c_str());
+}
+
+TEST(Pipeline, NoEndAfterReadError) {
+  // Without the end of stream marker the output cannot pass for a whole
+  // stream of what was read
+  int in_fd = open("/tmp", O_RDONLY);
+  int out_fd = open(TempName(".zap").c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                    0644);
+  ASSERT_GE(in_fd, 0);
+  EXPECT_THROW(Pipeline::Compress(in_fd, out_fd), std::runtime_error);
+  close(in_fd);
+  close(out_fd);
+  EXPECT_EQ(MappedFile(TempName(".zap")).size(), 0u);
+  unlink(TempName(".zap").c_str());
+}
+
+TEST(PositionalIo, FallsBackWhenRingFails) {
+  std::string contents = MakeInput(10000);
+  int fd = open(TempName(".io").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(write(fd, contents.data(), contents.size()),
+            static_cast<ssize_t>(contents.size()));
+
+  // The ring gets the lowest free descriptor, closing it breaks the ring
+  int ring_fd = dup(fd);
+  close(ring_fd);
+  PositionalIo io;
+  if (!io.UsesIoUring()) {
+    close(fd);
+    unlink(TempName(".io").c_str());
+    GTEST_SKIP();
+  }
+  close(ring_fd);
+  std::string read_back(100, '\0');
+  EXPECT_EQ(io.Read(fd, &read_back[0], 100, 5000), 100);
+  EXPECT_EQ(read_back, contents.substr(5000, 100));
+  EXPECT_FALSE(io.UsesIoUring());
+  close(fd);
+  unlink(TempName(".io").c_str());
+}
+
+int main(int argc, char **argv) {
+  // Writes to a closed pipe fail instead of ending the test
+  signal(SIGPIPE, SIG_IGN);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
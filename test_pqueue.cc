@@ -114,6 +114,28 @@ TEST(PQueue, PushPop) {
   EXPECT_EQ(pq.Size(), 4);
 }
 
+TEST(PQueue, ReplaceTop) {
+  PQueue<int> pq;
+
+  EXPECT_THROW(pq.ReplaceTop(1), std::exception);
+
+  pq.Push(28);
+  pq.Push(19);
+  pq.Push(50);
+  pq.Push(20);
+  pq.ReplaceTop(3);
+  EXPECT_EQ(pq.Top(), 3);
+  pq.ReplaceTop(40);
+  EXPECT_EQ(pq.Top(), 20);
+  EXPECT_EQ(pq.Size(), 4);
+  pq.Pop();
+  EXPECT_EQ(pq.Top(), 28);
+  pq.Pop();
+  EXPECT_EQ(pq.Top(), 40);
+  pq.Pop();
+  EXPECT_EQ(pq.Top(), 50);
+}
+
 TEST(PQueue, Duplicates) {
   PQueue<int> pq;
 
@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "./huffman.h"
+#include "./pqueue.h"
+#include "./radix_heap.h"
+
+TEST(RadixHeap, PushPop) {
+  RadixHeap<uint64_t> heap;
+
+  EXPECT_THROW(heap.Top(), std::exception);
+  EXPECT_THROW(heap.Pop(), std::exception);
+
+  heap.Push(28);
+  heap.Push(19);
+  heap.Push(50);
+  heap.Push(20);
+  EXPECT_EQ(heap.Top(), 19);
+  EXPECT_EQ(heap.Size(), 4);
+  heap.Pop();
+  EXPECT_EQ(heap.Top(), 20);
+  heap.Push(20);
+  heap.Push(1000000);
+  heap.Pop();
+  EXPECT_EQ(heap.Top(), 20);
+  heap.Pop();
+  EXPECT_EQ(heap.Top(), 28);
+  heap.Pop();
+  EXPECT_EQ(heap.Top(), 50);
+  heap.Pop();
+  EXPECT_EQ(heap.Top(), 1000000);
+  heap.Pop();
+  EXPECT_EQ(heap.Size(), 0);
+}
+
+TEST(RadixHeap, KeyBelowLast) {
+  RadixHeap<uint64_t> heap;
+
+  heap.Push(10);
+  heap.Push(30);
+  heap.Pop();
+  heap.Push(10);
+  EXPECT_THROW(heap.Push(9), std::invalid_argument);
+  EXPECT_EQ(heap.Top(), 10);
+}
+
+// Pops the same keys as PQueue on an event simulation
+TEST(RadixHeap, MatchesPQueue) {
+  RadixHeap<uint64_t> heap;
+  PQueue<uint64_t> pq;
+  std::srand(3);
+  for (int i = 0; i < 1000; i++) {
+    uint64_t time = std::rand() % 100;
+    heap.Push(time);
+    pq.Push(time);
+  }
+  for (int i = 0; i < 100000; i++) {
+    ASSERT_EQ(heap.Top(), pq.Top());
+    uint64_t time = heap.Top() + std::rand() % 1000;
+    heap.Pop();
+    pq.Pop();
+    if (i % 3) {
+      heap.Push(time);
+      pq.Push(time);
+    }
+    if (!pq.Size())
+      break;
+  }
+  EXPECT_EQ(heap.Size(), pq.Size());
+}
+
+TEST(RadixHeap, LargeKeys) {
+  RadixHeap<uint64_t> heap;
+
+  heap.Push(UINT64_MAX);
+  heap.Push(1ull << 63);
+  heap.Push(0);
+  EXPECT_EQ(heap.Top(), 0);
+  heap.Pop();
+  EXPECT_EQ(heap.Top(), 1ull << 63);
+  heap.Pop();
+  EXPECT_EQ(heap.Top(), UINT64_MAX);
+}
+
+// Bits to code the counts the tree was built from, the sum of the
+// frequencies of its internal nodes
+size_t CodedSize(HuffmanNode *node) {
+  if (node->IsLeaf())
+    return 0;
+  return node->freq() + CodedSize(node->left()) + CodedSize(node->right());
+}
+
+// Both queues give optimal trees, so the coded sizes agree even where ties
+// make the trees differ
+TEST(RadixHeap, HuffmanTree) {
+  std::srand(9);
+  for (int round = 0; round < 100; round++) {
+    std::vector<int> freq_array(256);
+    for (int i = 0; i < 2000; i++)
+      freq_array[std::rand() % (1 + round)]++;
+
+    std::unique_ptr<HuffmanNode> pqueue_tree =
+        Huffman::BuildHuffmanTree(freq_array);
+    std::unique_ptr<HuffmanNode> radix_tree =
+        Huffman::BuildHuffmanTree<Huffman::RadixQueue>(freq_array);
+    EXPECT_EQ(CodedSize(pqueue_tree.get()), CodedSize(radix_tree.get()));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
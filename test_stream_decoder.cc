@@ -0,0 +1,267 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "stream_decoder.h"
+#include "tree_cache.h"
+
+// Text with runs and repeats, followed by noise, so that every block type
+// shows up with some option
+std::string MakeInput() {
+  std::string input;
+  std::srand(7);
+  for (int i = 0; i < 20000; i++)
+    input += "line " + std::to_string(i % 97) + " of the stream\n";
+  input.append(70000, 'z');
+  for (int i = 0; i < 300000; i++)
+    input += static_cast<char>(std::rand());
+  return input;
+}
+
+// Feeds chunk_size bytes at a time and reads with a small buffer after each
+std::string DecodeInChunks(const std::string &zap, size_t chunk_size) {
+  StreamDecoder decoder;
+  std::string output;
+  char buffer[1000];
+  for (size_t i = 0; i < zap.size(); i += chunk_size) {
+    decoder.Feed(zap.data() + i, std::min(chunk_size, zap.size() - i));
+    while (size_t size = decoder.Read(buffer, sizeof(buffer)))
+      output.append(buffer, size);
+  }
+  EXPECT_TRUE(decoder.Finished());
+  return output;
+}
+
+TEST(StreamDecoder, ByteAtATime) {
+  std::string input = MakeInput(), zap;
+  Huffman::Compress(input, zap);
+  EXPECT_EQ(DecodeInChunks(zap, 1), input);
+}
+
+TEST(StreamDecoder, Packets) {
+  std::string input = MakeInput();
+  CompressOptions options;
+  options.lz77_level = 6;
+  std::string zap;
+  Huffman::Compress(input, zap, options);
+  EXPECT_EQ(DecodeInChunks(zap, 1500), input);
+  EXPECT_EQ(DecodeInChunks(zap, 7), input);
+}
+
+TEST(StreamDecoder, BurrowsWheeler) {
+  std::string input = MakeInput();
+  CompressOptions options;
+  options.bwt = true;
+  std::string zap;
+  Huffman::Compress(input, zap, options);
+  EXPECT_EQ(DecodeInChunks(zap, 333), input);
+}
+
+TEST(StreamDecoder, ReusedTables) {
+  std::string input = MakeInput();
+  CompressOptions options;
+  options.reuse_tables = true;
+  options.block_size = 4096;
+  std::string zap, output;
+  Huffman::Compress(input, zap, options);
+  EXPECT_EQ(DecodeInChunks(zap, 5), input);
+  BasicBinaryInputStream<MemorySource> bis(zap);
+  StringSink sink(output);
+  Huffman::Decompress(bis, sink);
+  EXPECT_EQ(output, input);
+
+  // Small blocks of the same text code smaller with the tables reused
+  std::string fresh;
+  options.reuse_tables = false;
+  Huffman::Compress(input, fresh, options);
+  EXPECT_LT(zap.size(), fresh.size());
+}
+
+TEST(StreamDecoder, SplitBlocks) {
+  std::string input = MakeInput();
+  CompressOptions options;
+  options.split_blocks = true;
+  std::string zap, whole;
+  Huffman::Compress(input, zap, options);
+  EXPECT_EQ(DecodeInChunks(zap, 1000), input);
+
+  // The text, the run and the noise each get their own part
+  std::vector<size_t> part_sizes;
+  Huffman::SplitBlock(input.data() + 300000, Huffman::kBlockSize,
+                      part_sizes);
+  EXPECT_GT(part_sizes.size(), 1);
+  options.split_blocks = false;
+  Huffman::Compress(input, whole, options);
+  EXPECT_LT(zap.size(), whole.size());
+}
+
+TEST(StreamDecoder, FilteredBlocks) {
+  std::string input = MakeInput();
+  CompressOptions options;
+  options.filter = Filter::Parse("delta2+shuffle");
+  options.split_blocks = true;
+  options.block_size = 100000;
+  std::string zap;
+  Huffman::Compress(input, zap, options);
+  EXPECT_EQ(DecodeInChunks(zap, 1), input);
+  EXPECT_EQ(DecodeInChunks(zap, 777), input);
+}
+
+TEST(StreamDecoder, EmptyAndSingle) {
+  std::string zap;
+  Huffman::Compress(std::string(), zap);
+  EXPECT_EQ(DecodeInChunks(zap, 1), "");
+
+  zap.clear();
+  Huffman::Compress(std::string(1000, 'a'), zap);
+  EXPECT_EQ(DecodeInChunks(zap, 1), std::string(1000, 'a'));
+}
+
+TEST(StreamDecoder, OutputBeforeEndOfInput) {
+  std::string input = MakeInput(), zap;
+  Huffman::Compress(input, zap);
+
+  // Half the stream already gives most of the first half of the input
+  StreamDecoder decoder;
+  decoder.Feed(zap.data(), zap.size() / 2);
+  std::string output(input.size(), '\0');
+  size_t size = decoder.Read(&output[0], output.size());
+  EXPECT_GT(size, 0);
+  EXPECT_FALSE(decoder.Finished());
+  EXPECT_EQ(output.substr(0, size), input.substr(0, size));
+
+  decoder.Feed(zap.data() + zap.size() / 2, zap.size() - zap.size() / 2);
+  size += decoder.Read(&output[size], output.size() - size);
+  EXPECT_EQ(size, input.size());
+  EXPECT_EQ(output, input);
+  EXPECT_TRUE(decoder.Finished());
+}
+
+TEST(StreamDecoder, BadBlockType) {
+  StreamDecoder decoder;
+  decoder.Feed("\x7F", 1);
+  char buffer[16];
+  EXPECT_THROW(decoder.Read(buffer, sizeof(buffer)), std::runtime_error);
+}
+
+// A Burrows-Wheeler block whose tree is a lone leaf, so that each of its
+// symbols takes no bits
+std::string BwtBlock(int num_chars, int primary_index, int num_symbols,
+                     int symbol) {
+  std::string zap;
+  BasicBinaryOutputStream<StringSink> bos(zap);
+  bos.PutChar(kBwtBlock);
+  bos.PutInt(num_chars);
+  bos.PutInt(primary_index);
+  bos.PutInt(num_symbols);
+  bos.PutBit(1);
+  bos.PutBits(symbol, CHAR_BIT + 1);
+  bos.Align();
+  bos.PutChar(static_cast<char>(kEndOfStream));
+  bos.Close();
+  return zap;
+}
+
+// Both decoders turn down the stream with an exception
+void ExpectBad(const std::string &zap) {
+  std::string output;
+  EXPECT_THROW(Huffman::Decompress(zap, output), std::runtime_error);
+  StreamDecoder decoder;
+  decoder.Feed(zap.data(), zap.size());
+  char buffer[16];
+  EXPECT_THROW(decoder.Read(buffer, sizeof(buffer)), std::runtime_error);
+}
+
+TEST(StreamDecoder, BadBurrowsWheelerBlocks) {
+  std::string output;
+  Huffman::Decompress(BwtBlock(1, 1, 1, 'a' + 1), output);
+  EXPECT_EQ(output, "a");
+  EXPECT_EQ(DecodeInChunks(BwtBlock(1, 1, 1, 'a' + 1), 1), "a");
+
+  ExpectBad(BwtBlock(1, 2, 1, 'a' + 1));
+  ExpectBad(BwtBlock(1, -1, 1, 'a' + 1));
+  ExpectBad(BwtBlock(1, 1, 0, 'a' + 1));
+  ExpectBad(BwtBlock(-1, 0, 1, 'a' + 1));
+  // Too few bytes, and a run of zeros past the end of the block
+  ExpectBad(BwtBlock(10, 1, 5, 'a' + 1));
+  ExpectBad(BwtBlock(5, 1, 3, kRunA));
+  ExpectBad(BwtBlock(100, 1, 70, kRunB));
+}
+
+// An LZ77 block coding 'a' as 00, length_symbol as 01 and the end of block
+// as 1, with distance_symbol as the lone leaf of its distance tree. bits
+// follow the trees
+std::string Lz77Block(int num_chars, int length_symbol, int distance_symbol,
+                      const std::string &bits) {
+  std::string zap;
+  BasicBinaryOutputStream<StringSink> bos(zap);
+  bos.PutChar(kLz77Block);
+  bos.PutInt(num_chars);
+  bos.PutBit(0);
+  bos.PutBit(0);
+  for (int symbol : {static_cast<int>('a'), length_symbol,
+                     static_cast<int>(kEndOfBlock)}) {
+    bos.PutBit(1);
+    bos.PutBits(symbol, CHAR_BIT + 1);
+  }
+  bos.PutBit(1);
+  bos.PutBits(distance_symbol, 5);
+  for (char bit : bits)
+    bos.PutBit(bit == '1');
+  bos.Align();
+  bos.PutChar(static_cast<char>(kEndOfStream));
+  bos.Close();
+  return zap;
+}
+
+TEST(StreamDecoder, BadLz77Blocks) {
+  std::string output;
+  Huffman::Decompress(Lz77Block(4, 257, 0, "00011"), output);
+  EXPECT_EQ(output, "aaaa");
+  EXPECT_EQ(DecodeInChunks(Lz77Block(4, 257, 0, "00011"), 1), "aaaa");
+
+  // Symbols past the length and distance tables
+  ExpectBad(Lz77Block(4, kNumLiteralSymbols, 0, "00011"));
+  ExpectBad(Lz77Block(4, 257, kNumDistanceSymbols, "00011"));
+  ExpectBad(Lz77Block(4, 257, 31, "00011"));
+  // A match before the first byte, and blocks that do not come out at their
+  // size
+  ExpectBad(Lz77Block(4, 257, 0, "011"));
+  ExpectBad(Lz77Block(3, 257, 0, "00011"));
+  ExpectBad(Lz77Block(1, 257, 0, "00001"));
+  ExpectBad(Lz77Block(5, 257, 0, "00011"));
+  ExpectBad(Lz77Block(-1, 257, 0, "1"));
+}
+
+TEST(StreamDecoder, BadTrees) {
+  // Nothing but internal nodes, nested far deeper than any tree goes
+  std::string deep(1, static_cast<char>(kHuffmanBlock));
+  deep.append(4 << 20, '\0');
+  // Leaves in the left subtrees too, so that only the count is off
+  std::string wide(1, static_cast<char>(kHuffmanBlock));
+  {
+    BasicBinaryOutputStream<StringSink> bos(wide);
+    for (int i = 0; i < 300; i++) {
+      bos.PutBit(0);
+      bos.PutBit(1);
+      bos.PutBits('a', CHAR_BIT);
+    }
+    bos.Close();
+  }
+  // With and without the tree cache, which scans trees before building them
+  size_t capacity = TreeCache::Instance().Capacity();
+  for (size_t cache : {static_cast<size_t>(0), capacity}) {
+    TreeCache::Instance().SetCapacity(cache);
+    ExpectBad(deep);
+    ExpectBad(wide);
+  }
+  TreeCache::Instance().SetCapacity(capacity);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
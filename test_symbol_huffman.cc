@@ -0,0 +1,84 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "./huffman.h"
+#include "./symbol_huffman.h"
+
+template <typename Symbol>
+std::vector<Symbol> RoundTrip(const std::vector<Symbol> &input) {
+  std::string zap;
+  SymbolHuffman<Symbol>::Compress(input, zap);
+  std::vector<Symbol> output;
+  SymbolHuffman<Symbol>::Decompress(zap, output);
+  return output;
+}
+
+TEST(SymbolHuffman, EmptyAndSingle) {
+  std::vector<uint16_t> empty;
+  EXPECT_EQ(RoundTrip(empty), empty);
+
+  std::vector<uint32_t> single(1000, 0xDEADBEEF);
+  EXPECT_EQ(RoundTrip(single), single);
+  std::vector<uint16_t> extremes = {0, 65535, 0, 65535, 65535};
+  EXPECT_EQ(RoundTrip(extremes), extremes);
+}
+
+// Sensor IDs scattered over the whole 32-bit range
+TEST(SymbolHuffman, SparseAlphabet) {
+  std::mt19937 random(1);
+  std::vector<uint32_t> ids(500);
+  for (size_t i = 0; i < ids.size(); i++)
+    ids[i] = random();
+  std::vector<uint32_t> input(600000);
+  std::geometric_distribution<int> pick(0.02);
+  for (size_t i = 0; i < input.size(); i++)
+    input[i] = ids[pick(random) % ids.size()];
+  EXPECT_EQ(RoundTrip(input), input);
+
+  // Byte splitting through the plain coder loses the value statistics
+  std::string zap, bytes;
+  SymbolHuffman<uint32_t>::Compress(input, zap);
+  Huffman::Compress(
+      std::string(reinterpret_cast<const char *>(input.data()),
+                  input.size() * sizeof(uint32_t)),
+      bytes);
+  EXPECT_LT(zap.size() * 2, bytes.size());
+}
+
+// Skewed counts give codes longer than the first table level
+TEST(SymbolHuffman, LongCodes) {
+  std::vector<uint16_t> input;
+  for (int value = 0; value < 24; value++)
+    input.insert(input.end(), 1 << (value / 2 + 1), value * 1000);
+  for (int value = 0; value < 5000; value++)
+    input.push_back(60000 - value);
+  EXPECT_EQ(RoundTrip(input), input);
+}
+
+TEST(SymbolHuffman, Corrupt) {
+  std::vector<uint32_t> input;
+  for (uint32_t i = 0; i < 10000; i++)
+    input.push_back(i % 37 * 1000003);
+  std::string zap;
+  SymbolHuffman<uint32_t>::Compress(input, zap);
+
+  std::vector<uint32_t> output;
+  EXPECT_THROW(SymbolHuffman<uint32_t>::Decompress(zap.substr(0, 100), output),
+               std::exception);
+  // Too many values for a 16-bit alphabet
+  EXPECT_THROW(
+      {
+        std::vector<uint16_t> narrow;
+        SymbolHuffman<uint16_t>::Decompress(zap, narrow);
+      },
+      std::runtime_error);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./huffman.h"
+#include "./tree_cache.h"
+
+std::string Decompress(const std::string &zap) {
+  std::string output;
+  BasicBinaryInputStream<MemorySource> bis(zap);
+  StringSink sink(output);
+  Huffman::Decompress(bis, sink);
+  return output;
+}
+
+// Small messages from one producer, all with the same tree
+std::string MakeMessage(int i) {
+  std::string message;
+  for (int j = 0; j < 50; j++)
+    message += "{\"id\": " + std::to_string(i * 50 + j) + ", \"ok\": true}\n";
+  return message;
+}
+
+class TreeCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override { TreeCache::Instance().Clear(); }
+  void TearDown() override {
+    TreeCache::Instance().SetCapacity(0);
+    TreeCache::Instance().Clear();
+  }
+};
+
+TEST_F(TreeCacheTest, OffByDefault) {
+  std::string input = MakeMessage(0), zap;
+  Huffman::Compress(input, zap);
+  EXPECT_EQ(Decompress(zap), input);
+  EXPECT_EQ(TreeCache::Instance().Hits(), 0);
+  EXPECT_EQ(TreeCache::Instance().Misses(), 0);
+}
+
+TEST_F(TreeCacheTest, HitsOnRepeatedTrees) {
+  TreeCache &cache = TreeCache::Instance();
+  cache.SetCapacity(1 << 20);
+
+  std::string input = MakeMessage(0), zap;
+  Huffman::Compress(input, zap);
+  EXPECT_EQ(Decompress(zap), input);
+  EXPECT_EQ(cache.Hits(), 0);
+  EXPECT_EQ(cache.Misses(), 1);
+  EXPECT_GT(cache.Bytes(), 0);
+
+  for (int i = 0; i < 10; i++)
+    EXPECT_EQ(Decompress(zap), input);
+  EXPECT_EQ(cache.Hits(), 10);
+  EXPECT_EQ(cache.Misses(), 1);
+}
+
+TEST_F(TreeCacheTest, AllBlockTypes) {
+  TreeCache &cache = TreeCache::Instance();
+  cache.SetCapacity(1 << 20);
+
+  std::string input;
+  for (int i = 0; i < 20; i++)
+    input += MakeMessage(i);
+  input.append(10000, 'x');
+  for (bool bwt : {false, true}) {
+    CompressOptions options;
+    options.bwt = bwt;
+    options.lz77_level = bwt ? 0 : 6;
+    std::string zap;
+    Huffman::Compress(input, zap, options);
+    EXPECT_EQ(Decompress(zap), input);
+    EXPECT_EQ(Decompress(zap), input);
+  }
+  EXPECT_GT(cache.Hits(), 0);
+}
+
+TEST_F(TreeCacheTest, Eviction) {
+  TreeCache &cache = TreeCache::Instance();
+  cache.SetCapacity(1 << 20);
+
+  // Messages over different alphabets have different trees
+  std::vector<std::string> zaps(20);
+  for (size_t i = 0; i < zaps.size(); i++) {
+    std::string input;
+    for (size_t j = 0; j < 1000; j++)
+      input += static_cast<char>('a' + (j * j) % (i + 2));
+    Huffman::Compress(input, zaps[i]);
+    EXPECT_EQ(Decompress(zaps[i]), input);
+  }
+  size_t all_bytes = cache.Bytes();
+
+  // Only the most recent trees stay
+  cache.SetCapacity(all_bytes / 2);
+  EXPECT_LE(cache.Bytes(), all_bytes / 2);
+  cache.Clear();
+  EXPECT_EQ(cache.Bytes(), 0);
+  Decompress(zaps[0]);
+  Decompress(zaps[19]);
+  Decompress(zaps[0]);
+  EXPECT_EQ(cache.Hits(), 1);
+  EXPECT_EQ(cache.Misses(), 2);
+}
+
+TEST_F(TreeCacheTest, SharedBetweenThreads) {
+  TreeCache &cache = TreeCache::Instance();
+  cache.SetCapacity(1 << 20);
+
+  std::vector<std::string> inputs, zaps;
+  for (int i = 0; i < 8; i++) {
+    inputs.push_back(MakeMessage(i));
+    zaps.push_back(std::string());
+    Huffman::Compress(inputs.back(), zaps.back());
+  }
+
+  std::vector<std::thread> threads;
+  std::vector<int> failures(8, 0);
+  for (int t = 0; t < 8; t++) {
+    threads.push_back(std::thread([&, t]() {
+      for (int i = 0; i < 200; i++) {
+        int message = (t + i) % 8;
+        if (Decompress(zaps[message]) != inputs[message])
+          failures[t]++;
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+  for (int t = 0; t < 8; t++)
+    EXPECT_EQ(failures[t], 0);
+  EXPECT_EQ(cache.Hits() + cache.Misses(), 1600);
+  EXPECT_GT(cache.Hits(), 1500);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,207 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "zap_search.h"
+#include "zap_server.h"
+
+// Lower case log lines, with a rare upper case one and a few lines long
+// enough to run through several blocks
+std::string MakeLog() {
+  std::string input;
+  std::srand(11);
+  for (int i = 0; i < 30000; i++) {
+    if (i % 4999 == 17)
+      input += "ERROR disk " + std::to_string(i) + " failed\n";
+    else if (i % 9001 == 5)
+      input += std::string(20000 + i % 7, 'q') + "ERROR at the end\n";
+    else if (i % 12007 == 9)
+      input += "ERROR at the start" + std::string(30000, 'w') + '\n';
+    else
+      input += "request " + std::to_string(std::rand() % 1000) +
+               " served in " + std::to_string(std::rand() % 90) + " ms\n";
+  }
+  // No newline at the end
+  input += "last ERROR";
+  return input;
+}
+
+// Same as grep -F
+std::vector<SearchMatch> Grep(const std::string &input,
+                              const std::string &needle) {
+  std::vector<SearchMatch> matches;
+  uint64_t line_number = 1;
+  for (size_t begin = 0; begin < input.size(); line_number++) {
+    size_t end = input.find('\n', begin);
+    if (end == std::string::npos)
+      end = input.size();
+    std::string line = input.substr(begin, end - begin);
+    if (line.find(needle) != std::string::npos) {
+      SearchMatch match = {begin, line_number, line};
+      matches.push_back(match);
+    }
+    begin = end + 1;
+  }
+  return matches;
+}
+
+std::vector<SearchMatch> Search(const std::string &zap,
+                                const std::string &needle,
+                                const SearchOptions &options,
+                                SearchStats *stats = nullptr) {
+  std::vector<SearchMatch> matches;
+  uint64_t count = ZapSearch::Search(
+      zap.data(), zap.size(), needle, options,
+      [&](const SearchMatch &match) { matches.push_back(match); }, stats);
+  EXPECT_EQ(count, options.count_only ? count : matches.size());
+  return matches;
+}
+
+void ExpectSame(const std::vector<SearchMatch> &matches,
+                const std::vector<SearchMatch> &expected, bool line_numbers) {
+  ASSERT_EQ(matches.size(), expected.size());
+  for (size_t i = 0; i < matches.size(); i++) {
+    EXPECT_EQ(matches[i].offset, expected[i].offset) << i;
+    EXPECT_EQ(matches[i].line, expected[i].line) << i;
+    if (line_numbers) {
+      EXPECT_EQ(matches[i].line_number, expected[i].line_number) << i;
+    }
+  }
+}
+
+// Block by block like zap, which adds the sync index
+std::string Compress(const std::string &input, size_t block_size,
+                     uint64_t sync_interval, bool histograms = false) {
+  CompressOptions options;
+  options.histograms = histograms;
+  options.block_size = block_size;
+  options.sync_interval = sync_interval;
+  options.lz77_level = 2;
+  std::string zap;
+  ZapServer::Compress(input, options, zap);
+  return zap;
+}
+
+TEST(ZapSearch, Find) {
+  std::string text = "abc, abd; abd";
+  EXPECT_EQ(ZapSearch::Find(text.data(), text.size(), "abd"), 5u);
+  EXPECT_EQ(ZapSearch::Find(text.data(), text.size(), "abd", 6), 10u);
+  EXPECT_EQ(ZapSearch::Find(text.data(), text.size(), "d; a"), 7u);
+  EXPECT_EQ(ZapSearch::Find(text.data(), text.size(), "abe"), ZapSearch::npos);
+  EXPECT_EQ(ZapSearch::Find(text.data(), text.size(), "abd; abdx"),
+            ZapSearch::npos);
+  EXPECT_EQ(ZapSearch::Find(text.data(), text.size(), "", 3), 3u);
+  EXPECT_EQ(ZapSearch::Find(text.data(), 2, "abc"), ZapSearch::npos);
+}
+
+TEST(ZapSearch, SameAsGrep) {
+  std::string input = MakeLog();
+  for (size_t block_size : {1000, 16384, 0}) {
+    for (uint64_t sync_interval : {0, 1 << 20}) {
+      std::string zap = Compress(input, block_size, sync_interval);
+      for (const char *needle : {"ERROR", "served in 42", "q\n", "qqqE", "",
+                                 "no such thing", "R at the s"}) {
+        if (std::string(needle).find('\n') != std::string::npos) {
+          EXPECT_THROW(Search(zap, needle, SearchOptions()),
+                       std::invalid_argument);
+          continue;
+        }
+        std::vector<SearchMatch> expected = Grep(input, needle);
+        SearchOptions options;
+        options.num_threads = 3;
+        ExpectSame(Search(zap, needle, options), expected, false);
+        options.line_numbers = true;
+        ExpectSame(Search(zap, needle, options), expected, true);
+
+        options.count_only = true;
+        EXPECT_EQ(ZapSearch::Search(zap.data(), zap.size(), needle, options,
+                                    [](const SearchMatch &) { FAIL(); }),
+                  expected.size())
+            << needle;
+      }
+    }
+  }
+}
+
+TEST(ZapSearch, SkipsBlocks) {
+  std::string input = MakeLog();
+  std::string zap = Compress(input, 4096, 1 << 20);
+  SearchStats stats;
+  ExpectSame(Search(zap, "ERROR", SearchOptions(), &stats),
+             Grep(input, "ERROR"), false);
+  EXPECT_GT(stats.skipped_blocks, stats.blocks / 2);
+  // Long lines ending or starting with a match are decoded after all
+  EXPECT_GT(stats.late_blocks, 0u);
+  EXPECT_LT(stats.late_blocks, stats.skipped_blocks);
+
+  // Only blocks in the middle of long lines lack a common string
+  ExpectSame(Search(zap, "served", SearchOptions(), &stats),
+             Grep(input, "served"), false);
+  EXPECT_LT(stats.skipped_blocks, stats.blocks / 4);
+
+  // Line numbers need every newline counted
+  SearchOptions options;
+  options.line_numbers = true;
+  Search(zap, "ERROR", options, &stats);
+  EXPECT_EQ(stats.skipped_blocks, 0u);
+}
+
+TEST(ZapSearch, Histograms) {
+  std::string input = MakeLog();
+  std::string zap = Compress(input, 4096, 1 << 20, true);
+  SearchStats stats, tree_stats;
+  ExpectSame(Search(zap, "ERROR", SearchOptions(), &stats),
+             Grep(input, "ERROR"), false);
+  Search(Compress(input, 4096, 1 << 20), "ERROR", SearchOptions(),
+         &tree_stats);
+  EXPECT_GE(stats.skipped_blocks, tree_stats.skipped_blocks);
+
+  // Newlines are counted without decoding
+  SearchOptions options;
+  options.line_numbers = true;
+  for (const char *needle : {"ERROR", "at the", "qqqqE", "served in 1 "}) {
+    ExpectSame(Search(zap, needle, options, &stats), Grep(input, needle),
+               true);
+    if (std::string(needle) == "ERROR") {
+      EXPECT_GT(stats.skipped_blocks, stats.blocks / 2);
+    }
+  }
+
+  // Split blocks do not line up with the histograms, the trees still count
+  CompressOptions split_options;
+  split_options.split_blocks = true;
+  split_options.sync_interval = 1 << 20;
+  split_options.histograms = true;
+  zap.clear();
+  ZapServer::Compress(input, split_options, zap);
+  ExpectSame(Search(zap, "ERROR", SearchOptions(), &stats),
+             Grep(input, "ERROR"), false);
+  ExpectSame(Search(zap, "ERROR", options, &stats), Grep(input, "ERROR"),
+             true);
+}
+
+TEST(ZapSearch, EmptyAndCorrupt) {
+  for (uint64_t sync_interval : {0, 100}) {
+    std::string zap = Compress("", 0, sync_interval);
+    EXPECT_TRUE(Search(zap, "a", SearchOptions()).empty());
+    EXPECT_EQ(Search(zap, "", SearchOptions()).size(), 0u);
+  }
+
+  std::string zap = Compress(MakeLog(), 4096, 1 << 20);
+  // The trailer points past the end
+  std::string bad =
+      zap.substr(0, zap.size() / 2) + zap.substr(zap.size() - 12);
+  EXPECT_THROW(Search(bad, "ERROR", SearchOptions()), std::runtime_error);
+  bad = zap;
+  bad[0] = 0x42;
+  EXPECT_THROW(Search(bad, "ERROR", SearchOptions()), std::runtime_error);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,175 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./huffman.h"
+#include "./pipeline.h"
+#include "./zap_server.h"
+
+std::string MakeInput(size_t size) {
+  std::string input;
+  for (size_t i = 0; input.size() < size; i++)
+    input += "line " + std::to_string(i % 977) + " of the log\n";
+  input.resize(size);
+  return input;
+}
+
+std::string TempName(const std::string &suffix) {
+  return "/tmp/test_zap_server_" + std::to_string(getpid()) + suffix;
+}
+
+void WriteFile(const std::string &name, const std::string &contents) {
+  int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(write(fd, contents.data(), contents.size()),
+            static_cast<ssize_t>(contents.size()));
+  close(fd);
+}
+
+std::string ReadFile(const std::string &name) {
+  MappedFile file(name);
+  return std::string(file.data(), file.size());
+}
+
+class ZapServerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    socket_path = TempName(".sock");
+    server.reset(new ZapServer(socket_path, 4));
+    serving = std::thread([this]() { server->Run(); });
+  }
+  void TearDown() override {
+    server->Stop();
+    serving.join();
+    server.reset();
+  }
+
+  std::string socket_path;
+  std::unique_ptr<ZapServer> server;
+  std::thread serving;
+};
+
+TEST_F(ZapServerTest, InlineRoundTrip) {
+  ZapClient client(socket_path);
+  for (size_t size : {0, 1, 1000, 700000}) {
+    std::string input = MakeInput(size), zap, expected, output;
+    client.Compress(input, zap);
+    Huffman::Compress(input, expected);
+    EXPECT_EQ(zap, expected);
+    client.Decompress(zap, output);
+    EXPECT_EQ(output, input);
+  }
+}
+
+TEST_F(ZapServerTest, SameBytesAsPipeline) {
+  std::string input = MakeInput(600000);
+  WriteFile(TempName(".in"), input);
+  CompressOptions options;
+  options.sync_interval = 10000;
+  options.lz77_level = 3;
+  options.filter = Filter::Parse("delta2");
+  options.histograms = true;
+  int in_fd = open(TempName(".in").c_str(), O_RDONLY);
+  int out_fd =
+      open(TempName(".zap").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  Pipeline::Compress(in_fd, out_fd, options);
+  close(in_fd);
+  close(out_fd);
+
+  std::string zap;
+  ZapClient(socket_path).Compress(input, zap, options);
+  EXPECT_EQ(zap, ReadFile(TempName(".zap")));
+  unlink(TempName(".in").c_str());
+  unlink(TempName(".zap").c_str());
+}
+
+TEST_F(ZapServerTest, FileDescriptors) {
+  std::string input = MakeInput(900000);
+  WriteFile(TempName(".in"), input);
+  ZapClient client(socket_path);
+
+  int in_fd = open(TempName(".in").c_str(), O_RDONLY);
+  int out_fd =
+      open(TempName(".zap").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  client.Compress(in_fd, out_fd);
+  close(in_fd);
+  close(out_fd);
+
+  in_fd = open(TempName(".zap").c_str(), O_RDONLY);
+  out_fd = open(TempName(".out").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  client.Decompress(in_fd, out_fd);
+  close(in_fd);
+  close(out_fd);
+
+  EXPECT_EQ(ReadFile(TempName(".out")), input);
+  for (const char *suffix : {".in", ".zap", ".out"})
+    unlink(TempName(suffix).c_str());
+}
+
+TEST_F(ZapServerTest, ErrorsKeepConnection) {
+  ZapClient client(socket_path);
+  std::string output;
+  EXPECT_THROW(client.Decompress(std::string("\x07garbage", 8), output),
+               std::runtime_error);
+  CompressOptions options;
+  options.lz77_level = 42;
+  EXPECT_THROW(client.Compress("abc", output, options), std::runtime_error);
+  options = CompressOptions();
+  options.store_margin = 100;
+  EXPECT_THROW(client.Compress("abc", output, options), std::runtime_error);
+  options = CompressOptions();
+  options.reuse_threshold = -1;
+  EXPECT_THROW(client.Compress("abc", output, options), std::runtime_error);
+  // A tree that never ends, which must not take the server down
+  std::string deep_tree(1, static_cast<char>(kHuffmanBlock));
+  deep_tree.append(1 << 20, '\0');
+  EXPECT_THROW(client.Decompress(deep_tree, output), std::runtime_error);
+
+  std::string zap;
+  client.Compress("still here", zap);
+  client.Decompress(zap, output);
+  EXPECT_EQ(output, "still here");
+  EXPECT_NE(client.Stats().find("errors 5"), std::string::npos);
+}
+
+TEST_F(ZapServerTest, ConcurrentClients) {
+  std::vector<std::thread> clients;
+  std::vector<int> failures(8, 0);
+  for (int i = 0; i < 8; i++) {
+    clients.push_back(std::thread([&, i]() {
+      ZapClient client(socket_path);
+      for (int j = 0; j < 20; j++) {
+        std::string input = MakeInput(1000 * (i + 1) + j), zap, output;
+        client.Compress(input, zap);
+        client.Decompress(zap, output);
+        failures[i] += output != input;
+      }
+    }));
+  }
+  for (size_t i = 0; i < clients.size(); i++)
+    clients[i].join();
+  for (int i = 0; i < 8; i++)
+    EXPECT_EQ(failures[i], 0);
+
+  std::string stats = ZapClient(socket_path).Stats();
+  EXPECT_NE(stats.find("compress 160, decompress 160"), std::string::npos);
+}
+
+TEST(ZapServer, RefusesLiveSocket) {
+  std::string socket_path = TempName(".live");
+  ZapServer server(socket_path, 1);
+  EXPECT_THROW(ZapServer(socket_path, 1), std::runtime_error);
+  EXPECT_THROW(ZapClient(TempName(".none")), std::runtime_error);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
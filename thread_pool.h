@@ -0,0 +1,85 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed set of worker threads running submitted tasks in submission order
+class ThreadPool {
+ public:
+  // 0 threads means one per core
+  explicit ThreadPool(size_t num_threads = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // The future becomes ready when the task is done and rethrows whatever it
+  // threw
+  std::future<void> Submit(std::function<void()> task);
+
+  size_t Size() { return workers.size(); }
+
+ private:
+  std::vector<std::thread> workers;
+  std::deque<std::packaged_task<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable has_task;
+  bool stopping = false;
+
+  // Helpers
+  void Work();
+};
+
+ThreadPool::ThreadPool(size_t num_threads) {
+  if (!num_threads)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t i = 0; i < num_threads; i++)
+    workers.push_back(std::thread(&ThreadPool::Work, this));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  has_task.notify_all();
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+}
+
+std::future<void> ThreadPool::Submit(std::function<void()> task) {
+  std::packaged_task<void()> packaged(std::move(task));
+  std::future<void> result = packaged.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(packaged));
+  }
+  has_task.notify_one();
+  return result;
+}
+
+void ThreadPool::Work() {
+  while (true) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      has_task.wait(lock, [this]() { return stopping || !tasks.empty(); });
+      // Finish everything queued before stopping
+      if (tasks.empty())
+        return;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+#endif  // THREAD_POOL_H_
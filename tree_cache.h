@@ -0,0 +1,155 @@
+#ifndef TREE_CACHE_H_
+#define TREE_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "checksum.h"
+
+class HuffmanNode;
+
+// Decode trees shared by every decoder in the process, so that streams from
+// the same producer, which keep sending the same trees, rebuild each of them
+// only once. Trees are looked up by a fingerprint of their serialized form
+// and compared in full, so a collision only costs a rebuild. Trees handed
+// out are never changed and may be read by any number of threads.
+//
+// The least recently used trees go first once the cache holds more than its
+// capacity. A capacity of 0, the default, turns the cache off
+class TreeCache {
+ public:
+  // The one cache of the process
+  static TreeCache &Instance();
+
+  // Sets the memory cap in bytes, evicting trees to stay under it
+  void SetCapacity(size_t capacity);
+  size_t Capacity();
+  // Memory held by the trees in the cache
+  size_t Bytes();
+  // Lookups that found a tree or did not, since the last Clear()
+  uint64_t Hits() { return hits; }
+  uint64_t Misses() { return misses; }
+  // Drops every tree and resets the counters
+  void Clear();
+
+  // The tree for a serialized header, null on a miss
+  std::shared_ptr<HuffmanNode> Find(const std::string &header);
+  // Adds a tree built after a miss, taking up about size bytes
+  void Insert(const std::string &header, std::shared_ptr<HuffmanNode> tree,
+              size_t size);
+
+ private:
+  struct Entry {
+    uint64_t fingerprint;
+    std::string header;
+    std::shared_ptr<HuffmanNode> tree;
+    size_t size;
+  };
+  typedef std::list<Entry>::iterator EntryIterator;
+
+  std::mutex mutex;
+  // Most recently used first
+  std::list<Entry> entries;
+  std::unordered_multimap<uint64_t, EntryIterator> index;
+  size_t capacity = 0;
+  size_t bytes = 0;
+  std::atomic<uint64_t> hits{0}, misses{0};
+
+  // Helpers, called with the mutex held
+  EntryIterator Lookup(const std::string &header, uint64_t fingerprint);
+  void Evict(size_t max_bytes);
+};
+
+TreeCache &TreeCache::Instance() {
+  // Function statics are initialized once, even with several threads
+  static TreeCache cache;
+  return cache;
+}
+
+void TreeCache::SetCapacity(size_t new_capacity) {
+  std::lock_guard<std::mutex> lock(mutex);
+  capacity = new_capacity;
+  Evict(capacity);
+}
+
+size_t TreeCache::Capacity() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return capacity;
+}
+
+size_t TreeCache::Bytes() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return bytes;
+}
+
+void TreeCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  Evict(0);
+  hits = 0;
+  misses = 0;
+}
+
+std::shared_ptr<HuffmanNode> TreeCache::Find(const std::string &header) {
+  uint64_t fingerprint = Checksum::Fnv1a64(header.data(), header.size());
+  std::lock_guard<std::mutex> lock(mutex);
+  EntryIterator entry = Lookup(header, fingerprint);
+  if (entry == entries.end()) {
+    misses++;
+    return nullptr;
+  }
+  hits++;
+  entries.splice(entries.begin(), entries, entry);
+  return entry->tree;
+}
+
+void TreeCache::Insert(const std::string &header,
+                       std::shared_ptr<HuffmanNode> tree, size_t size) {
+  uint64_t fingerprint = Checksum::Fnv1a64(header.data(), header.size());
+  size += header.size() + sizeof(Entry);
+  std::lock_guard<std::mutex> lock(mutex);
+  // Another thread may have built the same tree meanwhile
+  if (size > capacity || Lookup(header, fingerprint) != entries.end())
+    return;
+
+  Evict(capacity - size);
+  Entry entry = {fingerprint, header, std::move(tree), size};
+  entries.push_front(std::move(entry));
+  index.insert(std::make_pair(fingerprint, entries.begin()));
+  bytes += size;
+}
+
+TreeCache::EntryIterator TreeCache::Lookup(const std::string &header,
+                                           uint64_t fingerprint) {
+  auto range = index.equal_range(fingerprint);
+  for (auto i = range.first; i != range.second; ++i) {
+    if (i->second->header == header)
+      return i->second;
+  }
+  return entries.end();
+}
+
+// Drops the least recently used trees until at most max_bytes are left
+void TreeCache::Evict(size_t max_bytes) {
+  while (bytes > max_bytes) {
+    Entry &entry = entries.back();
+    auto range = index.equal_range(entry.fingerprint);
+    for (auto i = range.first; i != range.second; ++i) {
+      if (i->second == std::prev(entries.end())) {
+        index.erase(i);
+        break;
+      }
+    }
+    bytes -= entry.size;
+    entries.pop_back();
+  }
+}
+
+#endif  // TREE_CACHE_H_
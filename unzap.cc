@@ -1,35 +1,186 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
+#include "archive.h"
+#include "histogram_index.h"
 #include "huffman.h"
+#include "pipeline.h"
+#include "sync_index.h"
+#include "zap_server.h"
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " <zapfile> <outputfile>\n";
+  std::string option = argc > 1 ? argv[1] : "";
+
+  // Archive members are listed or extracted one at a time
+  if (option == "--list" && argc == 3) {
+    try {
+      std::vector<ArchiveEntry> entries = Archive::List(argv[2]);
+      for (size_t i = 0; i < entries.size(); i++)
+        std::cout << entries[i].original_size << '\t'
+                  << entries[i].compressed_size << '\t' << entries[i].name
+                  << '\n';
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(1);
+    }
+    return 0;
+  }
+  if (option == "--extract" && argc == 5) {
+    try {
+      Archive::Extract(argv[2], argv[3], argv[4]);
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(1);
+    }
+    std::cout << "Extracted " << argv[3] << " from zap file " << argv[2]
+              << " into output file " << argv[4] << '\n';
+    return 0;
+  }
+
+  // Counts from the histogram index, nothing is decoded
+  if (option == "--stats" && argc == 3) {
+    std::vector<BlockHistogram> histograms;
+    try {
+      MappedFile zap(argv[2]);
+      if (!HistogramIndex::Read(zap.data(), zap.size(), histograms))
+        throw std::runtime_error(
+            "Zap file has no histogram index, zap it with --histograms");
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(1);
+    }
+
+    // The code of each block only has to fit that block
+    std::vector<uint64_t> totals(1 << CHAR_BIT);
+    uint64_t size = 0;
+    double block_bits = 0;
+    for (size_t i = 0; i < histograms.size(); i++) {
+      for (size_t b = 0; b < totals.size(); b++)
+        totals[b] += histograms[i].counts[b];
+      size += histograms[i].size;
+      block_bits += histograms[i].size *
+                    HistogramIndex::Entropy(histograms[i].counts);
+    }
+    std::cout << "bytes " << size << '\n'
+              << "lines " << totals['\n'] << '\n'
+              << "blocks " << histograms.size() << '\n'
+              << "entropy " << HistogramIndex::Entropy(totals)
+              << " bits per byte, " << (size ? block_bits / size : 0)
+              << " within blocks\n";
+    for (size_t b = 0; b < totals.size(); b++) {
+      if (totals[b])
+        std::cout << "byte " << b << ' ' << totals[b] << '\n';
+    }
+    return 0;
+  }
+
+  // Only the blocks covering the range are decoded, using the sync index
+  if (option == "--range" && argc == 5) {
+    // Whole decimal numbers only, strtoull alone takes signs, spaces and
+    // trailing junk
+    auto parse = [](const std::string &text, uint64_t &value) {
+      if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0])))
+        return false;
+      char *end;
+      errno = 0;
+      value = std::strtoull(text.c_str(), &end, 10);
+      return errno == 0 && *end == '\0';
+    };
+    std::string range(argv[2]);
+    size_t colon = range.find(':');
+    uint64_t offset, length;
+    if (colon == std::string::npos || !parse(range.substr(0, colon), offset) ||
+        !parse(range.substr(colon + 1), length)) {
+      std::cerr << "Error: range must be OFFSET:LEN, two whole numbers\n";
+      exit(1);
+    }
+
+    std::string output;
+    try {
+      MappedFile zap(argv[3]);
+      SyncIndex::DecompressRange(zap.data(), zap.size(), offset, length,
+                                 output);
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(1);
+    }
+
+    std::ofstream ofs(argv[4], std::ios::out | std::ios::trunc |
+                                   std::ios::binary);
+    if (!ofs.write(output.data(), output.size())) {
+      std::cerr << "Error: cannot write output file " << argv[4] << '\n';
+      exit(1);
+    }
+    std::cout << "Decompressed " << output.size() << " bytes of zap file "
+              << argv[3] << " into output file " << argv[4] << '\n';
+    return 0;
+  }
+
+  // A running zapd may do the work on the files opened here
+  std::string daemon_socket;
+  if (option.compare(0, 9, "--daemon=") == 0 && argc == 4) {
+    daemon_socket = option.substr(9);
+    argv++;
+    argc--;
+  }
+
+  if (argc != 3 || std::string(argv[1]).compare(0, 2, "--") == 0) {
+    std::cerr << "Usage: " << argv[0] << " <zapfile> <outputfile>\n"
+              << "       " << argv[0] << " --list <zapfile>\n"
+              << "       " << argv[0]
+              << " --extract <zapfile> <member> <outputfile>\n"
+              << "       " << argv[0]
+              << " --range OFFSET:LEN <zapfile> <outputfile>\n"
+              << "       " << argv[0] << " --stats <zapfile>\n"
+              << "       " << argv[0]
+              << " --daemon=SOCKET <zapfile> <outputfile>\n";
     exit(1);
   }
 
   // Open files
-  std::ifstream ifs(argv[1], std::ios::in | std::ios::binary);
-  if (!ifs.is_open()) {
+  int in_fd = open(argv[1], O_RDONLY);
+  if (in_fd < 0) {
     std::cerr << "Error: cannot open zap file " << argv[1] << '\n';
     exit(1);
   }
+  if (Archive::IsArchive(in_fd)) {
+    std::cerr << "Error: " << argv[1]
+              << " is an archive, use --list or --extract\n";
+    exit(1);
+  }
 
   // Truncate output
-  std::ofstream ofs(argv[2], std::ios::out | std::ios::trunc);
-  if (!ofs.is_open()) {
+  int out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0) {
     std::cerr << "Error: cannot open output file " << argv[2] << '\n';
     exit(1);
   }
 
-  // Decompress
-  Huffman::Decompress(ifs, ofs);
+  // Decompress, overlapping reading and writing with decoding
+  try {
+    if (daemon_socket.empty())
+      Pipeline::Decompress(in_fd, out_fd);
+    else
+      ZapClient(daemon_socket).Decompress(in_fd, out_fd);
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    exit(1);
+  }
 
-  std::cout << "Decompressed zap file " << argv[1] << " into output file "
-            << argv[2] << '\n';
+  if (!Pipeline::IsStdout(out_fd))
+    std::cout << "Decompressed zap file " << argv[1] << " into output file "
+              << argv[2] << '\n';
 
-  ifs.close();
-  ofs.close();
+  close(in_fd);
+  close(out_fd);
 }
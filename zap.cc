@@ -1,35 +1,239 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
+#include "archive.h"
 #include "huffman.h"
+#include "pipeline.h"
+#include "zap_server.h"
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " <inputfile> <zapfile>\n";
+  CompressOptions options;
+  bool append = false;
+  bool archive = false;
+  bool dedup = false;
+  bool estimate = false;
+  std::string daemon_socket;
+
+  // Whole decimal numbers only, like unzap --range. atol alone takes signs
+  // and spaces and stops quietly at junk
+  auto parse = [](const char *text, long &value) {
+    if (!std::isdigit(static_cast<unsigned char>(*text)))
+      return false;
+    char *end;
+    errno = 0;
+    value = std::strtol(text, &end, 10);
+    return errno == 0 && *end == '\0';
+  };
+
+  // Options come before the file names
+  int arg = 1;
+  for (; arg < argc && std::string(argv[arg]).compare(0, 2, "--") == 0;
+       arg++) {
+    std::string option(argv[arg]);
+    if (option == "--bwt") {
+      options.bwt = true;
+    } else if (option == "--append") {
+      append = true;
+    } else if (option == "--archive") {
+      archive = true;
+    } else if (option == "--dedup") {
+      dedup = true;
+    } else if (option == "--estimate") {
+      estimate = true;
+    } else if (option == "--fast") {
+      options.sampled = true;
+    } else if (option == "--split") {
+      options.split_blocks = true;
+    } else if (option == "--histograms") {
+      options.histograms = true;
+    } else if (option.compare(0, 9, "--filter=") == 0) {
+      try {
+        options.filter = Filter::Parse(option.substr(9));
+      } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        exit(1);
+      }
+    } else if (option.compare(0, 9, "--daemon=") == 0) {
+      daemon_socket = option.substr(9);
+    } else if (option.compare(0, 7, "--sync=") == 0) {
+      long sync_interval;
+      if (!parse(option.c_str() + 7, sync_interval) || sync_interval <= 0) {
+        std::cerr << "Error: sync interval must be a positive whole number\n";
+        exit(1);
+      }
+      options.sync_interval = sync_interval;
+    } else if (option == "--reuse" || option.compare(0, 8, "--reuse=") == 0) {
+      options.reuse_tables = true;
+      long threshold = options.reuse_threshold;
+      if ((option.size() > 7 && !parse(option.c_str() + 8, threshold)) ||
+          threshold > 100) {
+        std::cerr << "Error: reuse threshold must be between 0 and 100 "
+                     "percent\n";
+        exit(1);
+      }
+      options.reuse_threshold = threshold;
+    } else if (option.compare(0, 8, "--block=") == 0) {
+      long block_size;
+      if (!parse(option.c_str() + 8, block_size) || block_size <= 0 ||
+          static_cast<size_t>(block_size) > Huffman::kBlockSize) {
+        std::cerr << "Error: block size must be between 1 and "
+                  << Huffman::kBlockSize << '\n';
+        exit(1);
+      }
+      options.block_size = block_size;
+    } else if (option.compare(0, 9, "--margin=") == 0) {
+      long margin;
+      if (!parse(option.c_str() + 9, margin) || margin > 99) {
+        std::cerr << "Error: margin must be between 0 and 99 percent\n";
+        exit(1);
+      }
+      options.store_margin = margin;
+    } else if (option.compare(0, 8, "--level=") == 0) {
+      long level;
+      if (!parse(option.c_str() + 8, level) || level < Lz77::kMinLevel ||
+          level > Lz77::kMaxLevel) {
+        std::cerr << "Error: level must be between " << Lz77::kMinLevel
+                  << " and " << Lz77::kMaxLevel << '\n';
+        exit(1);
+      }
+      options.lz77_level = level;
+    } else {
+      std::cerr << "Error: unknown option " << option << '\n';
+      exit(1);
+    }
+  }
+
+  if (dedup && !archive) {
+    std::cerr << "Error: --dedup only applies to --archive\n";
+    exit(1);
+  }
+  if (append && (archive || estimate || !daemon_socket.empty())) {
+    std::cerr << "Error: --append only works on a zap file of its own\n";
+    exit(1);
+  }
+
+  int num_names = argc - arg;
+  if (archive ? num_names < 2 : num_names != (estimate ? 1 : 2)) {
+    std::cerr << "Usage: " << argv[0] << " [options] <inputfile> <zapfile>\n"
+              << "       " << argv[0]
+              << " --archive [options] <zapfile> <inputfile>...\n"
+              << "       " << argv[0] << " --estimate [options] <inputfile>\n"
+              << "       " << argv[0]
+              << " --append [options] <inputfile> <zapfile>\n"
+              << "Options:\n"
+              << "  --bwt           also try Burrows-Wheeler on each block\n"
+              << "  --level=N       also try LZ77 matching at level N\n"
+              << "  --sync=BYTES    index a sync point every BYTES bytes\n"
+              << "  --histograms    index the byte counts of every block\n"
+              << "  --margin=PCT    store blocks that shrink less than PCT\n"
+              << "  --block=BYTES   code BYTES bytes per block\n"
+              << "  --split         split blocks where the bytes change\n"
+              << "  --reuse[=PCT]   reuse the previous block's code when at\n"
+              << "                  most PCT larger than a new one\n"
+              << "  --fast          build trees from a sample of each block\n"
+              << "  --filter=F      filter arrays of numbers first, F is\n"
+              << "                  delta, xor or shuffle and a width of 1,\n"
+              << "                  2, 4 or 8, such as delta4 or xor8+shuffle\n"
+              << "  --daemon=SOCKET have the zapd on SOCKET do the work\n"
+              << "  --dedup         store content shared between archived\n"
+              << "                  files only once\n"
+              << "  --append        code only what inputfile has grown by\n"
+              << "                  since zapfile was made from it, which\n"
+              << "                  needs --sync or --histograms\n";
     exit(1);
   }
 
+  // Report the expected size without writing anything
+  if (estimate) {
+    try {
+      MappedFile input(argv[arg]);
+      size_t estimated =
+          Huffman::EstimateSize(input.data(), input.size(), options);
+      std::cout << "Estimated zap file size of " << argv[arg] << ": "
+                << estimated << " bytes";
+      if (input.size())
+        std::cout << " (" << 100.0 * estimated / input.size()
+                  << "% of " << input.size() << ")";
+      std::cout << '\n';
+      if (options.sync_interval || options.histograms)
+        std::cout << "Not counting the sync index or histograms\n";
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(1);
+    }
+    return 0;
+  }
+
+  // Pack every input file into one archive
+  if (archive) {
+    std::vector<std::string> input_names(argv + arg + 1, argv + argc);
+    try {
+      Archive::Create(argv[arg], input_names, options, dedup);
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(1);
+    }
+    std::cout << "Archived " << input_names.size() << " files into zap file "
+              << argv[arg] << '\n';
+    return 0;
+  }
+  const char *input_name = argv[arg];
+  const char *zap_name = argv[arg + 1];
+
   // Open files
-  std::ifstream ifs(argv[1]);
-  if (!ifs.is_open()) {
-    std::cerr << "Error: cannot open input file " << argv[1] << '\n';
+  int in_fd = open(input_name, O_RDONLY);
+  if (in_fd < 0) {
+    std::cerr << "Error: cannot open input file " << input_name << '\n';
     exit(1);
   }
 
-  std::ofstream ofs(argv[2],
-                    std::ios::out | std::ios::trunc | std::ios::binary);
-  if (!ofs.is_open()) {
-    std::cerr << "Error: cannot open zap file " << argv[2] << '\n';
+  // Appending reads the zap file to learn where it left off
+  int out_fd = append ? open(zap_name, O_RDWR)
+                      : open(zap_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0) {
+    std::cerr << "Error: cannot open zap file " << zap_name << '\n';
     exit(1);
   }
 
-  // Compress
-  Huffman::Compress(ifs, ofs);
+  if (append) {
+    uint64_t appended = 0;
+    try {
+      appended = Pipeline::Append(in_fd, out_fd, options);
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(1);
+    }
+    std::cout << "Appended " << appended << " bytes of input file "
+              << input_name << " to zap file " << zap_name << '\n';
+    close(in_fd);
+    close(out_fd);
+    return 0;
+  }
+
+  // Compress, overlapping reading and writing with coding, or hand the open
+  // files to a running zapd
+  try {
+    if (daemon_socket.empty())
+      Pipeline::Compress(in_fd, out_fd, options);
+    else
+      ZapClient(daemon_socket).Compress(in_fd, out_fd, options);
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    exit(1);
+  }
 
-  std::cout << "Compressed input file " << argv[1] << " into zap file "
-            << argv[2] << '\n';
+  if (!Pipeline::IsStdout(out_fd))
+    std::cout << "Compressed input file " << input_name << " into zap file "
+              << zap_name << '\n';
 
-  ifs.close();
-  ofs.close();
+  close(in_fd);
+  close(out_fd);
 }
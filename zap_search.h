@@ -0,0 +1,552 @@
+#ifndef ZAP_SEARCH_H_
+#define ZAP_SEARCH_H_
+
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bstream.h"
+#include "histogram_index.h"
+#include "huffman.h"
+#include "sync_index.h"
+#include "thread_pool.h"
+
+// Optional settings selected on the zapgrep command line
+struct SearchOptions {
+  // Report line numbers, which needs the newlines of every block counted
+  bool line_numbers = false;
+  // Only count the lines, they are not kept
+  bool count_only = false;
+  // Threads decoding blocks, 0 means one per core
+  size_t num_threads = 0;
+};
+
+// A line holding the needle, without its newline
+struct SearchMatch {
+  // Offset of the start of the line in the uncompressed data
+  uint64_t offset;
+  // From 1, only with SearchOptions::line_numbers set
+  uint64_t line_number;
+  std::string line;
+};
+
+// How much of the file a search got away without decoding
+struct SearchStats {
+  size_t blocks = 0;
+  size_t skipped_blocks = 0;
+  // Skipped blocks that had to be decoded later for a matching line
+  size_t late_blocks = 0;
+};
+
+// Finds the lines of a zap file holding a fixed string, decoding one block
+// at a time into a buffer and never the whole file.
+//
+// Files with a sync index, from zap --sync, have their blocks decoded in
+// parallel. Their block headers are read first, and a block whose trees
+// lack a byte of the needle cannot hold it, nor can a match reach across
+// its edges when the same goes for it together with each neighbour. Such
+// blocks are skipped, unless a matching line turns out to start in one.
+// A HistogramIndex, from zap --histograms, tells exactly which bytes each
+// block holds and how many newlines, so blocks are skipped even with line
+// numbers. Other files are decoded in order on the calling thread
+class ZapSearch {
+ public:
+  typedef std::function<void(const SearchMatch &)> MatchCallback;
+
+  // Calls on_match for each matching line in order and returns how many
+  // there were
+  static uint64_t Search(const char *zap, size_t zap_size,
+                         const std::string &needle,
+                         const SearchOptions &options,
+                         const MatchCallback &on_match,
+                         SearchStats *stats = nullptr);
+
+  // Offset of the first occurrence of needle in text at or after from, or
+  // npos. memchr on the rarest needle byte finds the candidates
+  static size_t Find(const char *text, size_t size, const std::string &needle,
+                     size_t from = 0);
+  static const size_t npos = static_cast<size_t>(-1);
+
+ private:
+  typedef std::bitset<1 << CHAR_BIT> ByteSet;
+
+  // A block of a file with a sync index
+  struct Block {
+    uint64_t offset;
+    uint64_t coded_offset;
+    uint64_t coded_size;
+    ByteSet symbols;
+    // From the histogram index, -1 when not known
+    long newlines = -1;
+    bool skip = false;
+  };
+
+  // What the search needs of a decoded block: the ends of the lines cut by
+  // its edges and the whole lines inside it that match
+  struct BlockResult {
+    uint64_t size = 0;
+    size_t newlines = 0;
+    // Up to the first newline, or all of the block without one
+    std::string head;
+    // After the last newline
+    std::string tail;
+    // Offsets are relative to the block, line numbers count from 0 at the
+    // first line starting inside it
+    std::vector<SearchMatch> matches;
+    uint64_t num_matches = 0;
+  };
+
+  // Part of the line being put together across blocks, text already decoded
+  // or a skipped block
+  struct Piece {
+    std::string text;
+    // -1 for text
+    long block;
+  };
+
+  // The lines of the blocks in order, with any unfinished line carried over
+  class LineJoiner {
+   public:
+    LineJoiner(const char *zap, const std::vector<Block> &blocks,
+               const std::string &needle, const SearchOptions &options,
+               const MatchCallback &on_match, SearchStats &stats)
+        : zap(zap), blocks(blocks), needle(needle), options(options),
+          on_match(on_match), stats(stats) {}
+
+    void Add(BlockResult &result, uint64_t block_offset);
+    void AddSkipped(size_t block);
+    // Ends the last line, which has no newline
+    void Finish();
+    uint64_t NumMatches() { return num_matches; }
+
+   private:
+    const char *zap;
+    const std::vector<Block> &blocks;
+    const std::string &needle;
+    const SearchOptions &options;
+    const MatchCallback &on_match;
+    SearchStats &stats;
+
+    std::vector<Piece> pieces;
+    // Where the line being joined starts, unknown while it starts in a
+    // skipped block
+    uint64_t line_start = 0;
+    uint64_t line_number = 1;
+    uint64_t num_matches = 0;
+
+    // Helpers
+    bool MayMatch(const std::string &head);
+    void EndLine(const std::string &head);
+    void Resolve();
+  };
+
+  static void Scan(const std::string &text, const std::string &needle,
+                   bool keep_lines, BlockResult &result);
+  static void DecodeBlock(const char *zap, const Block &block,
+                          std::string &text);
+  static void ReadBlocks(const char *zap, size_t zap_size,
+                         const std::vector<SyncPoint> &sync_points,
+                         uint64_t index_offset, std::vector<Block> &blocks);
+  static void AddHistograms(const std::vector<BlockHistogram> &histograms,
+                            std::vector<Block> &blocks);
+  static void PickSkipped(const std::string &needle,
+                          std::vector<Block> &blocks);
+};
+
+const size_t ZapSearch::npos;
+
+uint64_t ZapSearch::Search(const char *zap, size_t zap_size,
+                           const std::string &needle,
+                           const SearchOptions &options,
+                           const MatchCallback &on_match,
+                           SearchStats *stats) {
+  if (needle.find('\n') != std::string::npos)
+    throw std::invalid_argument("Search string has a newline");
+  SearchStats local_stats;
+  if (!stats)
+    stats = &local_stats;
+  *stats = SearchStats();
+
+  std::vector<SyncPoint> sync_points;
+  uint64_t index_offset;
+  std::vector<Block> blocks;
+  bool indexed = SyncIndex::Read(zap, zap_size, sync_points, index_offset);
+  LineJoiner joiner(zap, blocks, needle, options, on_match, *stats);
+  std::string text;
+
+  // Without an index the blocks can only be found by decoding them in turn
+  if (!indexed) {
+    BasicBinaryInputStream<MemorySource> bis(zap, zap_size);
+    std::shared_ptr<HuffmanNode> previous_tree;
+    uint64_t offset = 0;
+    while (true) {
+      unsigned char block_type = bis.GetChar();
+      if (block_type == kEndOfStream)
+        break;
+      text.clear();
+      Huffman::ReadBlock(bis, block_type, text, previous_tree);
+      BlockResult result;
+      Scan(text, needle, !options.count_only, result);
+      joiner.Add(result, offset);
+      offset += result.size;
+      stats->blocks++;
+    }
+    joiner.Finish();
+    return joiner.NumMatches();
+  }
+
+  ReadBlocks(zap, zap_size, sync_points, index_offset, blocks);
+  stats->blocks = blocks.size();
+  std::vector<BlockHistogram> histograms;
+  if (HistogramIndex::Read(zap, zap_size, histograms))
+    AddHistograms(histograms, blocks);
+  bool counted = true;
+  for (size_t i = 0; i < blocks.size(); i++)
+    counted = counted && blocks[i].newlines >= 0;
+  if (!options.line_numbers || counted)
+    PickSkipped(needle, blocks);
+
+  // A window of blocks is decoded ahead while the joiner takes them in order
+  ThreadPool pool(options.num_threads);
+  size_t window = 4 * pool.Size();
+  std::vector<BlockResult> results(window);
+  std::deque<std::future<void>> pending;
+  size_t next = 0;
+  try {
+    for (size_t i = 0; i < blocks.size(); i++) {
+      for (; next < blocks.size() && next < i + window; next++) {
+        if (blocks[next].skip) {
+          pending.push_back(std::future<void>());
+          continue;
+        }
+        BlockResult *result = &results[next % window];
+        const Block *block = &blocks[next];
+        pending.push_back(pool.Submit([&, result, block]() {
+          // Each worker keeps its buffer from block to block
+          thread_local std::string block_text;
+          block_text.clear();
+          DecodeBlock(zap, *block, block_text);
+          *result = BlockResult();
+          Scan(block_text, needle, !options.count_only, *result);
+        }));
+      }
+
+      std::future<void> done = std::move(pending.front());
+      pending.pop_front();
+      if (blocks[i].skip) {
+        joiner.AddSkipped(i);
+        stats->skipped_blocks++;
+        continue;
+      }
+      done.get();
+      joiner.Add(results[i % window], blocks[i].offset);
+    }
+  } catch (...) {
+    // The workers still write into results
+    for (size_t i = 0; i < pending.size(); i++) {
+      if (pending[i].valid())
+        pending[i].wait();
+    }
+    throw;
+  }
+  joiner.Finish();
+  return joiner.NumMatches();
+}
+
+size_t ZapSearch::Find(const char *text, size_t size,
+                       const std::string &needle, size_t from) {
+  if (needle.empty())
+    return from <= size ? from : npos;
+  if (needle.size() > size)
+    return npos;
+
+  // Letters are more common than anything else in text, so look for the
+  // needle byte least likely to be one, the later the better on a tie
+  size_t anchor = needle.size() - 1;
+  for (size_t i = needle.size(); i-- > 0;) {
+    if (!std::isalnum(static_cast<unsigned char>(needle[i])) &&
+        needle[i] != ' ') {
+      anchor = i;
+      break;
+    }
+  }
+
+  const char *end = text + size - (needle.size() - 1 - anchor);
+  for (const char *p = text + from + anchor; p < end;) {
+    const char *hit = static_cast<const char *>(
+        std::memchr(p, needle[anchor], end - p));
+    if (!hit)
+      return npos;
+    const char *start = hit - anchor;
+    if (std::memcmp(start, needle.data(), needle.size()) == 0)
+      return start - text;
+    p = hit + 1;
+  }
+  return npos;
+}
+
+// The needle is looked for in all the whole lines at once, and after a match
+// again from the next line on
+void ZapSearch::Scan(const std::string &text, const std::string &needle,
+                     bool keep_lines, BlockResult &result) {
+  result.size = text.size();
+  size_t first = text.find('\n');
+  if (first == std::string::npos) {
+    result.head = text;
+    return;
+  }
+  result.head.assign(text, 0, first);
+  size_t end = text.rfind('\n') + 1;
+  result.tail.assign(text, end, std::string::npos);
+  const char *data = text.data();
+  result.newlines = std::count(data + first, data + end, '\n');
+
+  // Whole lines between the first and last newline. The needle has no
+  // newline, so a match never leaves its line
+  size_t line_begin = first + 1, line_index = 0;
+  while (line_begin < end) {
+    size_t hit = Find(data, end, needle, line_begin);
+    if (hit == npos)
+      break;
+    // Lines passed over on the way
+    for (const char *p = data + line_begin;
+         (p = static_cast<const char *>(
+              std::memchr(p, '\n', data + hit - p)));
+         p++) {
+      line_begin = p - data + 1;
+      line_index++;
+    }
+    size_t line_end = static_cast<const char *>(
+                          std::memchr(data + hit, '\n', end - hit)) -
+                      data;
+
+    result.num_matches++;
+    if (keep_lines) {
+      SearchMatch match = {line_begin, line_index,
+                           std::string(data + line_begin, data + line_end)};
+      result.matches.push_back(std::move(match));
+    }
+    line_begin = line_end + 1;
+    line_index++;
+  }
+}
+
+void ZapSearch::DecodeBlock(const char *zap, const Block &block,
+                            std::string &text) {
+  BasicBinaryInputStream<MemorySource> bis(zap + block.coded_offset,
+                                           block.coded_size);
+  // Streams with sync points never reuse trees
+  std::shared_ptr<HuffmanNode> previous_tree;
+  unsigned char block_type = bis.GetChar();
+  Huffman::ReadBlock(bis, block_type, text, previous_tree);
+}
+
+// Block starts are the sync points at the start of a block, and each block
+// ends where the next begins
+void ZapSearch::ReadBlocks(const char *zap, size_t zap_size,
+                           const std::vector<SyncPoint> &sync_points,
+                           uint64_t index_offset,
+                           std::vector<Block> &blocks) {
+  for (size_t i = 0; i < sync_points.size(); i++) {
+    if (sync_points[i].block_skip || sync_points[i].bit_skip)
+      continue;
+    Block block;
+    block.offset = sync_points[i].offset;
+    block.coded_offset = sync_points[i].block_offset;
+    blocks.push_back(block);
+  }
+  // Less the end of stream marker
+  uint64_t stream_end = index_offset ? index_offset - 1 : 0;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    uint64_t block_end =
+        i + 1 < blocks.size() ? blocks[i + 1].coded_offset : stream_end;
+    if (block_end <= blocks[i].coded_offset || block_end > zap_size)
+      throw std::runtime_error("Bad sync index in zap file");
+    blocks[i].coded_size = block_end - blocks[i].coded_offset;
+  }
+
+  // Headers are short, reading them all costs little next to decoding
+  for (size_t i = 0; i < blocks.size(); i++) {
+    BasicBinaryInputStream<MemorySource> bis(zap + blocks[i].coded_offset,
+                                             blocks[i].coded_size);
+    unsigned char block_type = bis.GetChar();
+    Huffman::BlockSymbols(bis, block_type, blocks[i].symbols);
+  }
+}
+
+// Histograms are per block of zap's input, which the blocks of the sync
+// index only line up with when they were not split further
+void ZapSearch::AddHistograms(const std::vector<BlockHistogram> &histograms,
+                              std::vector<Block> &blocks) {
+  if (histograms.empty())
+    return;
+  uint64_t size = histograms.back().offset + histograms.back().size;
+  size_t j = 0;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    uint64_t end = i + 1 < blocks.size() ? blocks[i + 1].offset : size;
+    while (j < histograms.size() && histograms[j].offset < blocks[i].offset)
+      j++;
+    if (j == histograms.size())
+      return;
+    if (histograms[j].offset != blocks[i].offset ||
+        histograms[j].offset + histograms[j].size != end)
+      continue;
+    ByteSet present;
+    for (size_t b = 0; b < present.size(); b++)
+      present[b] = histograms[j].counts[b] != 0;
+    blocks[i].symbols &= present;
+    blocks[i].newlines = histograms[j].counts['\n'];
+  }
+}
+
+// A match inside a block needs all of the needle bytes in it, and one across
+// an edge needs them in the two blocks together. Needles longer than a block
+// could reach across a whole one, so nothing is skipped for them
+void ZapSearch::PickSkipped(const std::string &needle,
+                            std::vector<Block> &blocks) {
+  ByteSet needle_bytes;
+  for (size_t i = 0; i < needle.size(); i++)
+    needle_bytes.set(static_cast<unsigned char>(needle[i]));
+  if (needle_bytes.none())
+    return;
+  for (size_t i = 0; i + 1 < blocks.size(); i++) {
+    if (needle.size() > blocks[i + 1].offset - blocks[i].offset)
+      return;
+  }
+
+  auto lacks = [&](const ByteSet &symbols) {
+    return (needle_bytes & ~symbols).any();
+  };
+  for (size_t i = 0; i < blocks.size(); i++) {
+    const ByteSet &symbols = blocks[i].symbols;
+    blocks[i].skip =
+        lacks(symbols) &&
+        (i == 0 || lacks(symbols | blocks[i - 1].symbols)) &&
+        (i + 1 == blocks.size() || lacks(symbols | blocks[i + 1].symbols));
+  }
+}
+
+void ZapSearch::LineJoiner::Add(BlockResult &result, uint64_t block_offset) {
+  if (!result.newlines) {
+    Piece piece = {std::move(result.head), -1};
+    pieces.push_back(std::move(piece));
+    return;
+  }
+
+  EndLine(result.head);
+  for (size_t i = 0; i < result.matches.size(); i++) {
+    SearchMatch &match = result.matches[i];
+    match.offset += block_offset;
+    match.line_number = options.line_numbers
+                            ? line_number + match.line_number
+                            : 0;
+    on_match(match);
+  }
+  num_matches += result.num_matches;
+  line_number += result.newlines - 1;
+
+  line_start = block_offset + result.size - result.tail.size();
+  Piece piece = {std::move(result.tail), -1};
+  pieces.assign(1, std::move(piece));
+}
+
+void ZapSearch::LineJoiner::AddSkipped(size_t block) {
+  // A line ending inside the block has to be finished first, which takes
+  // decoding the block if the line matches
+  if (blocks[block].symbols.test('\n')) {
+    if (MayMatch(std::string())) {
+      std::string text;
+      DecodeBlock(zap, blocks[block], text);
+      stats.late_blocks++;
+      BlockResult result;
+      Scan(text, needle, !options.count_only, result);
+      Add(result, blocks[block].offset);
+      return;
+    }
+    Piece piece = {std::string(), static_cast<long>(block)};
+    pieces.assign(1, piece);
+    if (options.line_numbers)
+      line_number += blocks[block].newlines;
+    return;
+  }
+  Piece piece = {std::string(), static_cast<long>(block)};
+  pieces.push_back(piece);
+}
+
+void ZapSearch::LineJoiner::Finish() {
+  bool empty = true;
+  for (size_t i = 0; i < pieces.size(); i++)
+    empty = empty && pieces[i].block < 0 && pieces[i].text.empty();
+  if (!empty)
+    EndLine(std::string());
+  pieces.clear();
+}
+
+// Skipped blocks hold no match and none reaches across their edges, so the
+// line can only match inside the text between them
+bool ZapSearch::LineJoiner::MayMatch(const std::string &head) {
+  std::string run;
+  for (size_t i = 0; i <= pieces.size(); i++) {
+    if (i == pieces.size() || pieces[i].block >= 0) {
+      if (i == pieces.size())
+        run += head;
+      if (Find(run.data(), run.size(), needle) != npos)
+        return true;
+      run.clear();
+    } else {
+      run += pieces[i].text;
+    }
+  }
+  return false;
+}
+
+void ZapSearch::LineJoiner::EndLine(const std::string &head) {
+  if (MayMatch(head)) {
+    num_matches++;
+    if (!options.count_only) {
+      Resolve();
+      SearchMatch match = {line_start,
+                           options.line_numbers ? line_number : 0,
+                           std::string()};
+      for (size_t i = 0; i < pieces.size(); i++)
+        match.line += pieces[i].text;
+      match.line += head;
+      on_match(match);
+    }
+  }
+  line_number++;
+}
+
+// Decodes the skipped blocks the line runs through. The first piece is
+// where the line starts, after the last newline of its block
+void ZapSearch::LineJoiner::Resolve() {
+  std::string text;
+  for (size_t i = 0; i < pieces.size(); i++) {
+    if (pieces[i].block < 0)
+      continue;
+    const Block &block = blocks[pieces[i].block];
+    text.clear();
+    DecodeBlock(zap, block, text);
+    stats.late_blocks++;
+    size_t start = 0;
+    if (i == 0) {
+      size_t newline = text.rfind('\n');
+      start = newline == std::string::npos ? 0 : newline + 1;
+      line_start = block.offset + start;
+    }
+    pieces[i].text.assign(text, start, std::string::npos);
+    pieces[i].block = -1;
+  }
+}
+
+#endif  // ZAP_SEARCH_H_
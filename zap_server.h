@@ -0,0 +1,666 @@
+#ifndef ZAP_SERVER_H_
+#define ZAP_SERVER_H_
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bstream.h"
+#include "histogram_index.h"
+#include "huffman.h"
+#include "pipeline.h"
+#include "sync_index.h"
+#include "thread_pool.h"
+#include "tree_cache.h"
+
+// Requests a zapd client can make
+enum ServerOp {
+  kServerCompress = 0,
+  kServerDecompress = 1,
+  // The server's counters as text
+  kServerStats = 2,
+};
+
+// Sent before every request, in host byte order since both ends are on the
+// same machine. With has_fds set, the input and output file descriptors come
+// along with it and there is no payload
+struct RequestHeader {
+  uint8_t op;
+  uint8_t has_fds;
+  uint8_t bwt;
+  uint8_t sampled;
+  uint8_t reuse_tables;
+  uint8_t split_blocks;
+  uint8_t filter;
+  uint8_t histograms;
+  int32_t lz77_level;
+  int32_t store_margin;
+  int32_t reuse_threshold;
+  uint64_t sync_interval;
+  uint64_t block_size;
+  uint64_t payload_size;
+};
+
+// Sent back for every request, followed by the output, the error message or
+// the counters. Requests with file descriptors get an empty payload
+struct ResponseHeader {
+  uint8_t ok;
+  uint64_t payload_size;
+};
+
+// Whole messages over a connected Unix domain socket, with file descriptors
+// passed alongside as SCM_RIGHTS
+class SocketIo {
+ public:
+  static void SendAll(int fd, const void *data, size_t size);
+  // Throws if the connection ends first
+  static void ReceiveAll(int fd, void *data, size_t size);
+  // Sends num_fds file descriptors along with the first byte
+  static void SendWithFds(int fd, const void *data, size_t size,
+                          const int *fds, int num_fds);
+  // Puts up to two file descriptors sent along into fds, -1 for those that
+  // were not. Returns false if the connection ended before the first byte
+  static bool ReceiveWithFds(int fd, void *data, size_t size, int fds[2]);
+  // Fills in address, throwing if the path does not fit
+  static void Address(const std::string &socket_path, sockaddr_un &address);
+};
+
+void SocketIo::SendAll(int fd, const void *data, size_t size) {
+  const char *bytes = static_cast<const char *>(data);
+  while (size) {
+    // A client going away must not kill the server with SIGPIPE
+    ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0)
+      throw std::runtime_error("Cannot send on socket");
+    bytes += sent;
+    size -= sent;
+  }
+}
+
+void SocketIo::ReceiveAll(int fd, void *data, size_t size) {
+  char *bytes = static_cast<char *>(data);
+  while (size) {
+    ssize_t received = ::recv(fd, bytes, size, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received < 0)
+      throw std::runtime_error("Cannot receive on socket");
+    if (!received)
+      throw std::runtime_error("Connection closed mid-message");
+    bytes += received;
+    size -= received;
+  }
+}
+
+void SocketIo::SendWithFds(int fd, const void *data, size_t size,
+                           const int *fds, int num_fds) {
+  union {
+    char buffer[CMSG_SPACE(2 * sizeof(int))];
+    cmsghdr align;
+  } control;
+  if (num_fds > 2 || !size)
+    throw std::invalid_argument("Cannot send file descriptors");
+
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  std::memset(&control, 0, sizeof(control));
+  iovec iov = {const_cast<void *>(data), size};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+  std::memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+  ssize_t sent;
+  do {
+    sent = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0)
+    throw std::runtime_error("Cannot send on socket");
+  SendAll(fd, static_cast<const char *>(data) + sent, size - sent);
+}
+
+bool SocketIo::ReceiveWithFds(int fd, void *data, size_t size, int fds[2]) {
+  union {
+    char buffer[CMSG_SPACE(2 * sizeof(int))];
+    cmsghdr align;
+  } control;
+  fds[0] = fds[1] = -1;
+
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  iovec iov = {data, size};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+
+  ssize_t received;
+  do {
+    received = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  if (received < 0)
+    throw std::runtime_error("Cannot receive on socket");
+  if (!received)
+    return false;
+
+  int num_fds = 0;
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg;
+       cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; i++) {
+      int received_fd;
+      std::memcpy(&received_fd, CMSG_DATA(cmsg) + i * sizeof(int),
+                  sizeof(int));
+      // Extra descriptors would only leak
+      if (num_fds < 2)
+        fds[num_fds++] = received_fd;
+      else
+        ::close(received_fd);
+    }
+  }
+  try {
+    if (message.msg_flags & MSG_CTRUNC)
+      throw std::runtime_error("File descriptors lost in transit");
+    ReceiveAll(fd, static_cast<char *>(data) + received, size - received);
+  } catch (...) {
+    for (int i = 0; i < num_fds; i++)
+      ::close(fds[i]);
+    throw;
+  }
+  return true;
+}
+
+void SocketIo::Address(const std::string &socket_path, sockaddr_un &address) {
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+    throw std::invalid_argument("Bad socket path " + socket_path);
+  std::memcpy(address.sun_path, socket_path.data(), socket_path.size());
+}
+
+// Serves compression on a Unix domain socket, so that callers do not start a
+// process per file and decoders find their trees already built in the
+// TreeCache. Each connection is served by one worker of the pool, so at most
+// that many at once, and may carry any number of requests in turn. Workers
+// keep their payload buffers from request to request
+//
+// Requests with file descriptors run through Pipeline and those with inline
+// payloads are coded on the worker, both giving the same bytes as zap
+class ZapServer {
+ public:
+  // Binds socket_path, replacing a stale socket but not a live server.
+  // 0 workers means one per core
+  explicit ZapServer(const std::string &socket_path, size_t num_workers = 0);
+  ~ZapServer();
+  ZapServer(const ZapServer &) = delete;
+  ZapServer &operator=(const ZapServer &) = delete;
+
+  // Accepts connections until Stop(), after which connections only finish
+  // the request they are on
+  void Run();
+  // Safe to call from a signal handler or from another thread
+  void Stop();
+  // Counters since the server started, the text sent for kServerStats
+  std::string Stats();
+
+  // The stream zap writes for input, sync index included
+  static void Compress(const std::string &input,
+                       const CompressOptions &options, std::string &output);
+  static void Decompress(const std::string &input, std::string &output);
+
+ private:
+  // Larger payloads are refused and larger buffers not kept
+  static const size_t kMaxPayload = static_cast<size_t>(1) << 30;
+  static const size_t kMaxKeptBuffer = 64 << 20;
+  // Latencies are counted in buckets of powers of two microseconds
+  static const int kLatencyBuckets = 40;
+
+  std::string socket_path;
+  int listen_fd = -1;
+  std::atomic<bool> stopping{false};
+  std::chrono::steady_clock::time_point start;
+
+  // Open connections, to be woken up when stopping
+  std::mutex connections_mutex;
+  std::set<int> connections;
+
+  std::atomic<uint64_t> requests[kServerStats + 1];
+  std::atomic<uint64_t> errors{0}, bytes_in{0}, bytes_out{0};
+  std::atomic<uint64_t> busy_micros{0}, max_micros{0};
+  std::atomic<uint64_t> latency_counts[kLatencyBuckets];
+
+  // Last, so that workers are joined before anything they use goes away
+  ThreadPool pool;
+
+  // Helpers
+  void Serve(int fd);
+  bool ServeRequest(int fd, std::string &input, std::string &output);
+  void Count(int op, bool ok, uint64_t in, uint64_t out, uint64_t micros);
+  static CompressOptions Options(const RequestHeader &header);
+  static uint64_t FileSize(int fd);
+  static void CloseFds(int fds[2]);
+};
+
+const size_t ZapServer::kMaxPayload;
+const size_t ZapServer::kMaxKeptBuffer;
+const int ZapServer::kLatencyBuckets;
+
+ZapServer::ZapServer(const std::string &socket_path, size_t num_workers)
+    : socket_path(socket_path),
+      start(std::chrono::steady_clock::now()),
+      pool(num_workers) {
+  for (int i = 0; i <= kServerStats; i++)
+    requests[i] = 0;
+  for (int i = 0; i < kLatencyBuckets; i++)
+    latency_counts[i] = 0;
+
+  sockaddr_un address;
+  SocketIo::Address(socket_path, address);
+  listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0)
+    throw std::runtime_error("Cannot create socket");
+
+  // A socket nobody accepts on is left over from a server that died
+  int probe_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool live = probe_fd >= 0 &&
+              ::connect(probe_fd, reinterpret_cast<sockaddr *>(&address),
+                        sizeof(address)) == 0;
+  if (probe_fd >= 0)
+    ::close(probe_fd);
+  if (live) {
+    ::close(listen_fd);
+    throw std::runtime_error("A server is already listening on " +
+                             socket_path);
+  }
+  ::unlink(socket_path.c_str());
+
+  if (::bind(listen_fd, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 ||
+      ::listen(listen_fd, SOMAXCONN) < 0) {
+    ::close(listen_fd);
+    throw std::runtime_error("Cannot listen on " + socket_path);
+  }
+}
+
+ZapServer::~ZapServer() {
+  Stop();
+  ::close(listen_fd);
+  ::unlink(socket_path.c_str());
+}
+
+void ZapServer::Run() {
+  while (!stopping) {
+    int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (stopping)
+        break;
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      throw std::runtime_error("Cannot accept on " + socket_path);
+    }
+    {
+      std::lock_guard<std::mutex> lock(connections_mutex);
+      connections.insert(fd);
+    }
+    pool.Submit([this, fd]() { Serve(fd); });
+  }
+
+  // Idle clients would otherwise keep their workers waiting forever. Replies
+  // to requests already read still go out
+  std::lock_guard<std::mutex> lock(connections_mutex);
+  for (int fd : connections)
+    ::shutdown(fd, SHUT_RD);
+}
+
+void ZapServer::Stop() {
+  stopping = true;
+  // Wakes up accept()
+  ::shutdown(listen_fd, SHUT_RDWR);
+}
+
+void ZapServer::Serve(int fd) {
+  thread_local std::string input, output;
+  try {
+    while (ServeRequest(fd, input, output)) {
+      if (input.capacity() > kMaxKeptBuffer)
+        std::string().swap(input);
+      if (output.capacity() > kMaxKeptBuffer)
+        std::string().swap(output);
+    }
+  } catch (const std::exception &) {
+    // The client went away, there is no one left to answer
+  }
+
+  std::lock_guard<std::mutex> lock(connections_mutex);
+  connections.erase(fd);
+  ::close(fd);
+}
+
+// Returns false once the connection should close
+bool ZapServer::ServeRequest(int fd, std::string &input, std::string &output) {
+  RequestHeader header;
+  int fds[2];
+  if (!SocketIo::ReceiveWithFds(fd, &header, sizeof(header), fds))
+    return false;
+  std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
+
+  // A payload too large is not read, so the connection cannot go on
+  bool too_large = header.payload_size > kMaxPayload;
+  if (!too_large) {
+    input.resize(header.payload_size);
+    try {
+      SocketIo::ReceiveAll(fd, &input[0], input.size());
+    } catch (...) {
+      CloseFds(fds);
+      throw;
+    }
+  }
+
+  ResponseHeader response;
+  std::memset(&response, 0, sizeof(response));
+  response.ok = 1;
+  output.clear();
+  uint64_t in = 0, out = 0;
+  try {
+    if (too_large)
+      throw std::invalid_argument("Payload too large");
+    if (header.op > kServerStats)
+      throw std::invalid_argument("Unknown request");
+    if (header.op != kServerStats && header.has_fds &&
+        (fds[0] < 0 || fds[1] < 0))
+      throw std::invalid_argument("Missing file descriptors");
+
+    if (header.op == kServerStats) {
+      output = Stats();
+    } else if (header.has_fds) {
+      if (header.op == kServerCompress)
+        Pipeline::Compress(fds[0], fds[1], Options(header));
+      else
+        Pipeline::Decompress(fds[0], fds[1]);
+      in = FileSize(fds[0]);
+      out = FileSize(fds[1]);
+    } else {
+      if (header.op == kServerCompress)
+        Compress(input, Options(header), output);
+      else
+        Decompress(input, output);
+      in = input.size();
+      out = output.size();
+    }
+  } catch (const std::exception &e) {
+    response.ok = 0;
+    output = e.what();
+  }
+  CloseFds(fds);
+
+  // Counted before replying, so that a client sees its own requests in the
+  // stats it asks for next
+  uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - begin)
+                        .count();
+  Count(header.op, response.ok, in, out, micros);
+
+  response.payload_size = output.size();
+  SocketIo::SendAll(fd, &response, sizeof(response));
+  SocketIo::SendAll(fd, output.data(), output.size());
+  return !too_large;
+}
+
+void ZapServer::Count(int op, bool ok, uint64_t in, uint64_t out,
+                      uint64_t micros) {
+  if (op <= kServerStats)
+    requests[op]++;
+  if (!ok)
+    errors++;
+  bytes_in += in;
+  bytes_out += out;
+  busy_micros += micros;
+  uint64_t max = max_micros;
+  while (micros > max && !max_micros.compare_exchange_weak(max, micros)) {
+  }
+
+  int bucket = 0;
+  while (bucket < kLatencyBuckets - 1 && micros >> bucket)
+    bucket++;
+  latency_counts[bucket]++;
+}
+
+std::string ZapServer::Stats() {
+  uint64_t counts[kLatencyBuckets];
+  uint64_t total = 0;
+  for (int i = 0; i < kLatencyBuckets; i++) {
+    counts[i] = latency_counts[i];
+    total += counts[i];
+  }
+  // Bucket i holds latencies below 2^i microseconds
+  auto percentile = [&](double fraction) -> uint64_t {
+    uint64_t seen = 0;
+    for (int i = 0; i < kLatencyBuckets; i++) {
+      seen += counts[i];
+      if (seen && seen >= fraction * total)
+        return static_cast<uint64_t>(1) << i;
+    }
+    return 0;
+  };
+
+  double uptime = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  double busy = busy_micros / 1e6;
+  std::ostringstream stats;
+  stats << "requests: compress " << requests[kServerCompress]
+        << ", decompress " << requests[kServerDecompress] << ", stats "
+        << requests[kServerStats] << ", errors " << errors << '\n'
+        << "bytes: in " << bytes_in << ", out " << bytes_out << '\n'
+        << "throughput: " << (busy ? bytes_in / busy / 1e6 : 0)
+        << " MB/s while busy, " << bytes_in / uptime / 1e6
+        << " MB/s over " << uptime << " s up\n"
+        << "latency: mean " << (total ? busy_micros / total : 0)
+        << " us, p50 < " << percentile(0.5) << " us, p99 < "
+        << percentile(0.99) << " us, max " << max_micros << " us\n"
+        << "tree cache: hits " << TreeCache::Instance().Hits() << ", misses "
+        << TreeCache::Instance().Misses() << ", "
+        << TreeCache::Instance().Bytes() << " of "
+        << TreeCache::Instance().Capacity() << " bytes\n";
+  return stats.str();
+}
+
+void ZapServer::Compress(const std::string &input,
+                         const CompressOptions &options, std::string &output) {
+  // Block by block through the same StreamTail as Pipeline::Compress, so the
+  // two write the same blocks and indexes
+  size_t max_block_size = Huffman::BlockSize(options);
+  StreamTail tail;
+  tail.coded_offset = output.size();
+  for (size_t i = 0; i < input.size(); i += max_block_size) {
+    CodedBlock coded;
+    tail.CodeBlock(input.data() + i,
+                   std::min(max_block_size, input.size() - i), options, coded);
+    tail.Add(coded, options);
+    output += coded.coded;
+  }
+  output += tail.End(options);
+}
+
+void ZapServer::Decompress(const std::string &input, std::string &output) {
+  BasicBinaryInputStream<MemorySource> bis(input);
+  StringSink sink(output);
+  Huffman::Decompress(bis, sink);
+}
+
+CompressOptions ZapServer::Options(const RequestHeader &header) {
+  CompressOptions options;
+  options.bwt = header.bwt;
+  options.lz77_level = header.lz77_level;
+  options.sync_interval = header.sync_interval;
+  options.store_margin = header.store_margin;
+  options.sampled = header.sampled;
+  options.block_size = header.block_size;
+  options.reuse_tables = header.reuse_tables;
+  options.reuse_threshold = header.reuse_threshold;
+  options.split_blocks = header.split_blocks;
+  options.filter = header.filter;
+  options.histograms = header.histograms;
+  // zap checks these on its command line, other clients may not
+  if (options.block_size > Huffman::kBlockSize)
+    throw std::invalid_argument("Block size too large");
+  if (options.lz77_level &&
+      (options.lz77_level < Lz77::kMinLevel ||
+       options.lz77_level > Lz77::kMaxLevel))
+    throw std::invalid_argument("Bad LZ77 level");
+  if (options.filter && !Filter::Valid(options.filter))
+    throw std::invalid_argument("Bad filter");
+  if (options.store_margin < 0 || options.store_margin > 99)
+    throw std::invalid_argument("Bad store margin");
+  if (options.reuse_threshold < 0 || options.reuse_threshold > 100)
+    throw std::invalid_argument("Bad reuse threshold");
+  return options;
+}
+
+// Sizes of regular files, 0 for pipes and the like
+uint64_t ZapServer::FileSize(int fd) {
+  struct stat st;
+  if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    return 0;
+  return st.st_size;
+}
+
+void ZapServer::CloseFds(int fds[2]) {
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] >= 0)
+      ::close(fds[i]);
+    fds[i] = -1;
+  }
+}
+
+// One connection to a zapd server, over which requests go one at a time
+class ZapClient {
+ public:
+  explicit ZapClient(const std::string &socket_path);
+  ~ZapClient();
+  ZapClient(const ZapClient &) = delete;
+  ZapClient &operator=(const ZapClient &) = delete;
+
+  // Payloads sent inline, errors of the server are thrown here
+  void Compress(const std::string &input, std::string &output,
+                const CompressOptions &options = CompressOptions());
+  void Decompress(const std::string &input, std::string &output);
+  // The server reads in_fd and writes out_fd itself
+  void Compress(int in_fd, int out_fd,
+                const CompressOptions &options = CompressOptions());
+  void Decompress(int in_fd, int out_fd);
+  std::string Stats();
+
+ private:
+  int fd = -1;
+
+  // Helpers
+  void Request(int op, const CompressOptions &options,
+               const std::string &payload, const int *fds,
+               std::string &output);
+};
+
+ZapClient::ZapClient(const std::string &socket_path) {
+  sockaddr_un address;
+  SocketIo::Address(socket_path, address);
+  fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    throw std::runtime_error("Cannot create socket");
+  if (::connect(fd, reinterpret_cast<sockaddr *>(&address),
+                sizeof(address)) < 0) {
+    ::close(fd);
+    throw std::runtime_error("Cannot connect to " + socket_path);
+  }
+}
+
+ZapClient::~ZapClient() {
+  ::close(fd);
+}
+
+void ZapClient::Compress(const std::string &input, std::string &output,
+                         const CompressOptions &options) {
+  Request(kServerCompress, options, input, nullptr, output);
+}
+
+void ZapClient::Decompress(const std::string &input, std::string &output) {
+  Request(kServerDecompress, CompressOptions(), input, nullptr, output);
+}
+
+void ZapClient::Compress(int in_fd, int out_fd,
+                         const CompressOptions &options) {
+  int fds[2] = {in_fd, out_fd};
+  std::string output;
+  Request(kServerCompress, options, std::string(), fds, output);
+}
+
+void ZapClient::Decompress(int in_fd, int out_fd) {
+  int fds[2] = {in_fd, out_fd};
+  std::string output;
+  Request(kServerDecompress, CompressOptions(), std::string(), fds, output);
+}
+
+std::string ZapClient::Stats() {
+  std::string output;
+  Request(kServerStats, CompressOptions(), std::string(), nullptr, output);
+  return output;
+}
+
+void ZapClient::Request(int op, const CompressOptions &options,
+                        const std::string &payload, const int *fds,
+                        std::string &output) {
+  RequestHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.op = op;
+  header.has_fds = fds != nullptr;
+  header.bwt = options.bwt;
+  header.sampled = options.sampled;
+  header.reuse_tables = options.reuse_tables;
+  header.split_blocks = options.split_blocks;
+  header.filter = options.filter;
+  header.histograms = options.histograms;
+  header.lz77_level = options.lz77_level;
+  header.store_margin = options.store_margin;
+  header.reuse_threshold = options.reuse_threshold;
+  header.sync_interval = options.sync_interval;
+  header.block_size = options.block_size;
+  header.payload_size = payload.size();
+
+  if (fds)
+    SocketIo::SendWithFds(fd, &header, sizeof(header), fds, 2);
+  else
+    SocketIo::SendAll(fd, &header, sizeof(header));
+  SocketIo::SendAll(fd, payload.data(), payload.size());
+
+  ResponseHeader response;
+  SocketIo::ReceiveAll(fd, &response, sizeof(response));
+  output.resize(response.payload_size);
+  SocketIo::ReceiveAll(fd, &output[0], output.size());
+  if (!response.ok)
+    throw std::runtime_error(output);
+}
+
+#endif  // ZAP_SERVER_H_
@@ -0,0 +1,104 @@
+#include <signal.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "pipeline.h"
+#include "tree_cache.h"
+#include "zap_server.h"
+
+// The server to stop on SIGINT or SIGTERM
+static ZapServer *running_server = nullptr;
+
+static void StopServer(int) {
+  if (running_server)
+    running_server->Stop();
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_workers = 0;
+  size_t cache_size = 64 << 20;
+  bool stats = false;
+
+  // Options come before the socket path
+  int arg = 1;
+  for (; arg < argc && std::string(argv[arg]).compare(0, 2, "--") == 0;
+       arg++) {
+    std::string option(argv[arg]);
+    if (option == "--stats") {
+      stats = true;
+    } else if (option.compare(0, 10, "--threads=") == 0) {
+      long threads = std::atol(option.c_str() + 10);
+      if (threads <= 0) {
+        std::cerr << "Error: thread count must be positive\n";
+        exit(1);
+      }
+      num_workers = threads;
+    } else if (option.compare(0, 9, "--coders=") == 0) {
+      long coders = std::atol(option.c_str() + 9);
+      if (coders <= 0) {
+        std::cerr << "Error: coder count must be positive\n";
+        exit(1);
+      }
+      Pipeline::coder_threads = coders;
+    } else if (option.compare(0, 8, "--cache=") == 0) {
+      long long cache = std::atoll(option.c_str() + 8);
+      if (cache < 0) {
+        std::cerr << "Error: cache size cannot be negative\n";
+        exit(1);
+      }
+      cache_size = cache;
+    } else {
+      std::cerr << "Error: unknown option " << option << '\n';
+      exit(1);
+    }
+  }
+
+  if (argc - arg != 1) {
+    std::cerr << "Usage: " << argv[0] << " [options] <socket>\n"
+              << "       " << argv[0] << " --stats <socket>\n"
+              << "Options:\n"
+              << "  --threads=N     serve N connections at once\n"
+              << "  --coders=N      code blocks of all of them on N threads\n"
+              << "  --cache=BYTES   keep up to BYTES of decode trees, 0 for "
+                 "none\n";
+    exit(1);
+  }
+  const char *socket_path = argv[arg];
+
+  // Ask a running server for its counters
+  if (stats) {
+    try {
+      ZapClient client(socket_path);
+      std::cout << client.Stats();
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(1);
+    }
+    return 0;
+  }
+
+  // Writes to pipes passed in by clients that went away fail instead
+  signal(SIGPIPE, SIG_IGN);
+  TreeCache::Instance().SetCapacity(cache_size);
+
+  try {
+    ZapServer server(socket_path, num_workers);
+    running_server = &server;
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = StopServer;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    std::cout << "Serving on " << socket_path << '\n';
+    server.Run();
+    running_server = nullptr;
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    exit(1);
+  }
+  std::cout << "Stopped serving on " << socket_path << '\n';
+}
@@ -0,0 +1,96 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "archive.h"
+#include "bstream.h"
+#include "zap_search.h"
+
+// Exits with 0 if some line matched, 1 if none did and 2 on errors, like grep
+int main(int argc, char *argv[]) {
+  SearchOptions options;
+  bool byte_offsets = false, show_stats = false;
+  int arg = 1;
+  for (; arg < argc && std::string(argv[arg]).compare(0, 1, "-") == 0 &&
+         std::string(argv[arg]) != "-";
+       arg++) {
+    std::string option(argv[arg]);
+    if (option == "-c") {
+      options.count_only = true;
+    } else if (option == "-b") {
+      byte_offsets = true;
+    } else if (option == "-n") {
+      options.line_numbers = true;
+    } else if (option == "--stats") {
+      show_stats = true;
+    } else if (option.compare(0, 2, "-j") == 0 && option.size() > 2) {
+      options.num_threads = std::strtoul(option.c_str() + 2, nullptr, 10);
+    } else if (option == "--") {
+      arg++;
+      break;
+    } else {
+      std::cerr << "Error: unknown option " << option << '\n';
+      exit(2);
+    }
+  }
+
+  if (argc - arg < 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-c] [-b] [-n] [--stats] [-jTHREADS] <string>"
+              << " <zapfile>...\n";
+    exit(2);
+  }
+  std::string needle(argv[arg++]);
+  bool show_names = argc - arg > 1;
+
+  bool matched = false;
+  for (; arg < argc; arg++) {
+    std::string name(argv[arg]);
+    std::string prefix = show_names ? name + ':' : "";
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "Error: cannot open zap file " << name << '\n';
+      exit(2);
+    }
+    bool is_archive = Archive::IsArchive(fd);
+    close(fd);
+    if (is_archive) {
+      std::cerr << "Error: " << name << " is an archive\n";
+      exit(2);
+    }
+
+    // Lines go out as they are found, in order
+    SearchStats stats;
+    uint64_t count;
+    try {
+      MappedFile zap(name);
+      count = ZapSearch::Search(
+          zap.data(), zap.size(), needle, options,
+          [&](const SearchMatch &match) {
+            std::cout << prefix;
+            if (options.line_numbers)
+              std::cout << match.line_number << ':';
+            if (byte_offsets)
+              std::cout << match.offset << ':';
+            std::cout << match.line << '\n';
+          },
+          &stats);
+    } catch (const std::exception &e) {
+      std::cout.flush();
+      std::cerr << "Error: " << e.what() << '\n';
+      exit(2);
+    }
+
+    if (options.count_only)
+      std::cout << prefix << count << '\n';
+    if (show_stats)
+      std::cerr << name << ": skipped " << stats.skipped_blocks << " of "
+                << stats.blocks << " blocks, decoded "
+                << stats.late_blocks << " of them later\n";
+    matched = matched || count;
+  }
+  return matched ? 0 : 1;
+}